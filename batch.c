@@ -0,0 +1,288 @@
+/* BATCH.C: quantizes a list of images on a bounded pool of workers, with
+   loading overlapped with quantization */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "batch.h"
+#include "thread.h"
+#include "stats.h"
+
+/* wildcards are expanded here, so long lists need not go through the shell */
+#if !defined(_WIN32) && !defined(MSDOS) && !defined(__DJGPP__)
+    #define BATCH_GLOB
+    #include <glob.h>
+#endif
+
+/* busy polls before a waiting thread gives up the processor */
+#define BATCH_SPINS     (64)
+/* images loaded ahead of the workers, beyond one per worker */
+#define BATCH_AHEAD     (2)
+
+/* appends a copy of [name] */
+static bool batch_append(batch_list_t * list, const char * name, size_t len) {
+    char    * copy;
+
+    if (list->count == list->size) {
+        int     size = list->size ? list->size * 2 : 64;
+        char    ** grown = (char **) realloc(list->name, size * sizeof(char *));
+        if (!grown) return false;
+        list->name = grown;
+        list->size = size;
+    }
+    if (!(copy = (char *) malloc(len + 1))) return false;
+    memcpy(copy, name, len);
+    copy[len] = 0;
+    list->name[list->count++] = copy;
+    return true;
+}
+
+/* adds a name or pattern, no list files */
+static bool batch_add_name(batch_list_t * list, const char * name) {
+#ifdef BATCH_GLOB
+    if (strpbrk(name, "*?[")) {
+        glob_t  g;
+        bool    ok;
+
+        if (glob(name, 0, NULL, &g))
+            return false;
+        ok = g.gl_pathc > 0;
+        for (size_t i = 0; ok && i < g.gl_pathc; i++)
+            ok = batch_append(list, g.gl_pathv[i], strlen(g.gl_pathv[i]));
+        globfree(&g);
+        return ok;
+    }
+#endif
+    return batch_append(list, name, strlen(name));
+}
+
+/*  batch_add()
+*   adds [spec] to the list: @file reads one name or pattern per line,
+*   blank lines are skipped
+*/
+bool batch_add(batch_list_t * list, const char * spec) {
+    FILE    * fp;
+    char    line[1024];
+    bool    ok = true;
+
+    if (spec[0] != '@')
+        return batch_add_name(list, spec);
+
+    if (!(fp = fopen(spec + 1, "r")))
+        return false;
+    while (ok && fgets(line, sizeof(line), fp)) {
+        size_t  len = strlen(line);
+        while (len && (line[len-1] == '\n' || line[len-1] == '\r' ||
+                       line[len-1] == ' ' || line[len-1] == '\t'))
+            line[--len] = 0;
+        if (len)
+            ok = batch_add_name(list, line);
+    }
+    fclose(fp);
+    return ok;
+}
+
+void batch_free(batch_list_t * list) {
+    for (int i = 0; i < list->count; i++)
+        free(list->name[i]);
+    free(list->name);
+    list->name = NULL;
+    list->count = list->size = 0;
+}
+
+/*  batch_output()
+*   output path of [input] inside [dir]: same base name, .bmp extension
+*/
+bool batch_output(char * path, uint32 size, const char * dir,
+                  const char * input) {
+    const char  * base = input, * dot;
+    size_t      dlen = strlen(dir), blen;
+
+    for (const char * p = input; *p; p++)
+        if (*p == '/' || *p == '\\')
+            base = p + 1;
+    dot = strrchr(base, '.');
+    blen = dot && dot != base ? (size_t) (dot - base) : strlen(base);
+
+    /* no separator is doubled, none is needed after a bare drive */
+    bool sep = dlen && dir[dlen-1] != '/' && dir[dlen-1] != '\\' &&
+               dir[dlen-1] != ':';
+    if (dlen + sep + blen + 5 > size)
+        return false;
+    memcpy(path, dir, dlen);
+    if (sep)
+        path[dlen++] = '/';
+    memcpy(path + dlen, base, blen);
+    strcpy(path + dlen + blen, ".bmp");
+    return true;
+}
+
+/* output path of an input, sorted to find clashes */
+typedef struct {
+    char    * path;
+    int     index;
+} batch_path_t;
+
+static int batch_path_compare(const void * a, const void * b) {
+    const batch_path_t * x = (const batch_path_t *) a;
+    const batch_path_t * y = (const batch_path_t *) b;
+    int     c = strcmp(x->path, y->path);
+
+    return c ? c : x->index - y->index;
+}
+
+/*  batch_clash()
+*   sorts the output paths of the inputs so equal ones end up side by
+*   side: a/x.bmp and b/x.bmp, or x.bmp and x.ppm, would be written by two
+*   workers at once. Names too long for batch_output() fail later anyway.
+*/
+int batch_clash(const batch_list_t * list, const char * dir, int * first,
+                int * second) {
+    batch_path_t    * paths;
+    char            path[1024];
+    int             count = 0, found = 0;
+
+    if (!(paths = (batch_path_t *) malloc((list->count ? list->count : 1) *
+                                          sizeof(batch_path_t))))
+        return -1;
+    for (int i = 0; i < list->count; i++) {
+        if (!batch_output(path, sizeof(path), dir, list->name[i]))
+            continue;
+        if (!(paths[count].path = strdup(path))) {
+            found = -1;
+            break;
+        }
+        paths[count++].index = i;
+    }
+    if (!found) {
+        qsort(paths, count, sizeof(batch_path_t), batch_path_compare);
+        for (int i = 1; i < count && !found; i++)
+            if (!strcmp(paths[i - 1].path, paths[i].path)) {
+                *first = paths[i - 1].index;
+                *second = paths[i].index;
+                found = 1;
+            }
+    }
+    for (int i = 0; i < count; i++)
+        free(paths[i].path);
+    free(paths);
+    return found;
+}
+
+/* ring of loaded images shared by the loader and the workers. Image i
+   goes to slot i % depth once image i - depth has been processed. */
+typedef struct {
+    const batch_list_t  * list;
+    batch_job_t         job;
+    void                * arg;
+    int                 depth;
+    bitmap              * slot;     /* loaded images, memory is reused */
+    char                * ok;       /* slot holds a loaded image */
+    int                 * next;     /* image each slot may receive next */
+    stats_t             * stats;    /* record of every slot, if enabled */
+    int                 loaded;     /* images in the ring so far */
+    int                 taken;      /* images claimed by workers */
+    int                 failed;
+} batch_t;
+
+/* polls a condition without hogging the processor for long */
+static void batch_wait(int * spins) {
+    if (++(*spins) > BATCH_SPINS) {
+        thread_yield();
+        *spins = 0;
+    }
+}
+
+/* claims and processes the oldest loaded image, false if none is waiting */
+static bool batch_step(batch_t * b) {
+    int     t = thread_load(&b->taken);
+
+    if (t >= thread_load(&b->loaded))
+        return false;
+    if (!thread_cas(&b->taken, t, t + 1))
+        return true;            /* another worker got it, try again */
+
+    int     s = t % b->depth;
+    stats_attach(b->stats ? &b->stats[s] : NULL);
+    if (!b->job(b->arg, t, b->ok[s] ? b->slot[s] : NULL))
+        thread_fetch_add(&b->failed, 1);
+    stats_attach(NULL);
+    thread_store(&b->next[s], t + b->depth);
+    return true;
+}
+
+/* worker 0 loads every image, and quantizes one itself whenever the ring
+   is full, so it never waits on workers that may not be running. The
+   others only quantize. */
+static void batch_worker(void * arg, int index) {
+    batch_t * b = (batch_t *) arg;
+    int     count = b->list->count, spins = 0;
+
+    if (index == 0)
+        for (int i = 0; i < count; i++) {
+            int s = i % b->depth;
+            while (thread_load(&b->next[s]) != i)
+                if (!batch_step(b))
+                    batch_wait(&spins);
+            if (b->stats) {
+                stats_reset(&b->stats[s]);
+                stats_attach(&b->stats[s]);
+            }
+            double start = stats_start();
+            b->ok[s] = image_reload(b->list->name[i], &b->slot[s]) != NULL;
+            stats_stop(STATS_LOAD, start);
+            stats_attach(NULL);
+            thread_store(&b->loaded, i + 1);
+        }
+
+    while (thread_load(&b->taken) < count)
+        if (!batch_step(b))
+            batch_wait(&spins);
+}
+
+/*  batch_run()
+*   runs [job] on every image of [list] using [workers] threads (0 = one
+*   per processor). At most workers + BATCH_AHEAD images are held in memory.
+*   With stats_enabled(), each image has a record attached from its load
+*   through its job, which may read it from stats_current.
+*/
+int batch_run(const batch_list_t * list, int workers, batch_job_t job,
+              void * arg) {
+    batch_t b;
+
+    workers = thread_count(workers);
+    if (workers > list->count)
+        workers = list->count > 0 ? list->count : 1;
+
+    memset(&b, 0, sizeof(b));
+    b.list = list;
+    b.job = job;
+    b.arg = arg;
+    b.depth = workers + BATCH_AHEAD;
+    b.slot = (bitmap *) calloc(b.depth, sizeof(bitmap));
+    b.ok = (char *) calloc(b.depth, 1);
+    b.next = (int *) malloc(b.depth * sizeof(int));
+    if (stats_enabled())
+        b.stats = (stats_t *) calloc(b.depth, sizeof(stats_t));
+    if (!b.slot || !b.ok || !b.next || (stats_enabled() && !b.stats)) {
+        free(b.slot);
+        free(b.ok);
+        free(b.next);
+        free(b.stats);
+        return list->count;
+    }
+    for (int i = 0; i < b.depth; i++)
+        b.next[i] = i;
+
+    thread_parallel(workers, batch_worker, &b);
+
+    for (int i = 0; i < b.depth; i++)
+        bitmap_destroy(&b.slot[i]);
+    free(b.slot);
+    free(b.ok);
+    free(b.next);
+    free(b.stats);
+    return b.failed;
+}
@@ -0,0 +1,47 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__ (1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "image.h"
+
+/*----------------------------- BATCH PROCESSING -----------------------------*/
+
+/* input file names of a batch */
+typedef struct batch_list {
+    char    ** name;
+    int     count;
+    int     size;               /* slots allocated in [name] */
+} batch_list_t;
+
+/* adds a file name, a wildcard pattern or an @list file of names (one per
+   line) to [list]. False when a pattern matches nothing, a list file
+   cannot be read or memory runs out. */
+bool    batch_add(batch_list_t * list, const char * spec);
+void    batch_free(batch_list_t * list);
+
+/* builds [dir]/[name of input].bmp into [path], false if it does not fit */
+bool    batch_output(char * path, uint32 size, const char * dir,
+                     const char * input);
+/* looks for two inputs of [list] that batch_output() sends to the same
+   file of [dir]. Returns 1 with their indices in [first] < [second], 0
+   when there are none or -1 when memory runs out. */
+int     batch_clash(const batch_list_t * list, const char * dir,
+                    int * first, int * second);
+
+/* processes image [index] of the list, [bmp] is NULL when the file could
+   not be loaded. Returns success. Runs on several threads at once. */
+typedef bool (*batch_job_t)(void * arg, int index, bitmap bmp);
+
+/* loads the images of [list] ahead into a small ring of reused bitmaps
+   and hands them to [workers] concurrent jobs, returns the failures */
+int     batch_run(const batch_list_t * list, int workers, batch_job_t job,
+                  void * arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
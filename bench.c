@@ -0,0 +1,487 @@
+/* BENCH.C: load/quantize/save benchmark with a regression check against a
+   saved baseline */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+#include "bitmap.h"
+#include "quantize.h"
+#include "simd.h"
+#include "thread.h"
+
+#if !defined(_WIN32) && !defined(MSDOS) && !defined(__DJGPP__)
+    #include <sys/resource.h>
+    #define USE_RUSAGE
+#endif
+
+#define BENCH_RUNS      (21)            /* timed runs per image */
+#define BENCH_TOLERANCE (15.0)          /* percent a median may slow down */
+#define BENCH_SLACK     (0.1)           /* ms of noise always tolerated */
+#define BENCH_RESULTS   (256)
+#define BENCH_INPUT     "bench_in.bmp"  /* synthetic images are loaded from */
+#define BENCH_OUTPUT    "bench_out.bmp"
+#define BENCH_WIDTHS    (130)           /* scanline widths the kernels are
+                                           checked on, past two AVX2 steps */
+
+#if defined(_WIN32) || defined(MSDOS) || defined(__DJGPP__)
+    #define SEP         "\\"
+#else
+    #define SEP         "/"
+#endif
+
+typedef enum {  STAGE_LOAD,             /* bmp_load() */
+                STAGE_QUANTIZE,         /* quantize_uniform(), no dither */
+                STAGE_DITHER,           /* quantize_uniform(), ordered dither */
+                STAGE_SAVE,             /* bmp_save() of the 8-bit result */
+                STAGES } stage_t;
+
+static const char * stageNames[STAGES] = {
+    "load", "quantize", "quantize_dither", "save" };
+
+/* one line of the report, also what a baseline holds */
+typedef struct {
+    char    image[64];
+    char    stage[24];
+    uint32  pixels;
+    double  p50, p90, max;              /* ms */
+} bench_result_t;
+
+typedef struct {
+    int             runs;
+    int             threads;
+    FILE            * save;             /* baseline being written, if any */
+    bench_result_t  results[BENCH_RESULTS];
+    int             count;
+} bench_t;
+
+static void usage(void) {
+    printf("Usage: unipal_bench [options]\n");
+    printf("Times bmp_load(), quantize_uniform() with and without dithering and\n");
+    printf("bmp_save() over the bundled images and synthetic ones, one JSON line\n");
+    printf("per image and stage.\n");
+    printf("Options:\n");
+    printf("  -n, -runs N        timed runs per image (default %d)\n", BENCH_RUNS);
+    printf("  -s, -sizes L       synthetic image sides, comma separated\n");
+    printf("                     (default 1024,2048, 0 = none)\n");
+    printf("  -t, -threads N     quantize using N threads (default 1, 0 = all)\n");
+    printf("  -save F            also write the report to F, as a baseline\n");
+    printf("  -compare F         compare medians against the baseline F, fails\n");
+    printf("                     when a stage got slower than the tolerance or\n");
+    printf("                     is missing\n");
+    printf("  -tolerance P       allowed slowdown in percent (default %.0f)\n",
+           BENCH_TOLERANCE);
+    printf("  -check             only check that every SIMD level quantizes\n");
+    printf("                     like the C reference and that the malformed\n");
+    printf("                     files in tests are rejected, times nothing\n");
+}
+
+/* peak resident set of the process so far, in KB, 0 if unknown */
+static long bench_rss(void) {
+#ifdef USE_RUSAGE
+    struct rusage   ru;
+
+    if (getrusage(RUSAGE_SELF, &ru))
+        return 0;
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024;         /* bytes there */
+#else
+    return ru.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+static int bench_compare(const void * a, const void * b) {
+    double  x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* nearest rank percentile [q] of the sorted [n] values */
+static double bench_percentile(const double * v, int n, double q) {
+    int     k = (int) (q * n + 0.999999);
+    return v[k < 1 ? 0 : k > n ? n - 1 : k - 1];
+}
+
+/* a deterministic RGB24 test card: gradients with noise, so that every
+   path of the quantizers does real work */
+static bitmap bench_synthetic(uint32 size) {
+    bitmap  bmp = bitmap_create(size, size, BMF_RGB24, false);
+    uint32  seed = 0x2545F491u;
+
+    if (!bmp)
+        return NULL;
+    for (uint32 y = 0; y < size; y++) {
+        uint8   * p = bmp->data + y * bmp->rowsize;
+
+        for (uint32 x = 0; x < size; x++, p += 3) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            p[0] = clamp(x * 255 / size + (int) (seed & 15) - 8);
+            p[1] = clamp(y * 255 / size + (int) (seed >> 4 & 15) - 8);
+            p[2] = clamp((x + y) * 127 / size + (int) (seed >> 8 & 31) - 16);
+        }
+    }
+    return bmp;
+}
+
+/* runs every stage of [filename] once untimed, then [b->runs] times, and
+   reports the latency percentiles of each stage */
+static bool bench_image(bench_t * b, const char * filename, const char * label) {
+    double  * times = (double *) malloc(STAGES * b->runs * sizeof(double));
+    uint32  pixels = 0;
+    bool    ok = times != NULL;
+
+    for (int r = -1; ok && r < b->runs; r++) {
+        double  t[STAGES + 1];
+        bitmap  bmp, res = NULL, dith = NULL;
+
+        t[0] = thread_clock();
+        ok = (bmp = bmp_load(filename)) != NULL;
+        t[1] = thread_clock();
+        ok = ok && (res = quantize_uniform(bmp, false, b->threads)) != NULL;
+        t[2] = thread_clock();
+        ok = ok && (dith = quantize_uniform(bmp, true, b->threads)) != NULL;
+        t[3] = thread_clock();
+        ok = ok && bmp_save(BENCH_OUTPUT, &res);
+        t[4] = thread_clock();
+
+        if (ok && r >= 0)               /* the first run only warms up */
+            for (int s = 0; s < STAGES; s++)
+                times[s * b->runs + r] = (t[s + 1] - t[s]) * 1000;
+        if (bmp)
+            pixels = bmp->width * bmp->height;
+        bitmap_destroy(&bmp);
+        bitmap_destroy(&res);
+        bitmap_destroy(&dith);
+    }
+    if (!ok) {
+        fprintf(stderr, "ERROR: cannot benchmark [%s].\n", filename);
+        free(times);
+        return false;
+    }
+
+    for (int s = 0; s < STAGES && b->count < BENCH_RESULTS; s++) {
+        bench_result_t  * res = &b->results[b->count++];
+        double          * v = times + s * b->runs;
+        char            line[512];
+
+        qsort(v, b->runs, sizeof(double), bench_compare);
+        snprintf(res->image, sizeof(res->image), "%s", label);
+        snprintf(res->stage, sizeof(res->stage), "%s", stageNames[s]);
+        res->pixels = pixels;
+        res->p50 = bench_percentile(v, b->runs, 0.5);
+        res->p90 = bench_percentile(v, b->runs, 0.9);
+        res->max = v[b->runs - 1];
+        snprintf(line, sizeof(line),
+                 "{\"image\":\"%s\",\"stage\":\"%s\",\"pixels\":%u,"
+                 "\"runs\":%d,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"max_ms\":%.3f,"
+                 "\"mpx_s\":%.1f,\"peak_rss_kb\":%ld}\n",
+                 res->image, res->stage, res->pixels, b->runs, res->p50,
+                 res->p90, res->max,
+                 res->p50 > 0 ? res->pixels / (res->p50 * 1000) : 0.0,
+                 bench_rss());
+        fputs(line, stdout);
+        if (b->save)
+            fputs(line, b->save);
+    }
+    fflush(stdout);
+    free(times);
+    return true;
+}
+
+/* quantizes scanlines of every width up to BENCH_WIDTHS with each SIMD
+   level the CPU has and compares the indices and color cubes with those
+   of the C reference, bit for bit. Returns the levels that differ. */
+static int bench_simd(void) {
+    static const simd_level_t levels[] = { SIMD_SSE2, SIMD_AVX2, SIMD_NEON };
+    simd_level_t    best = simd_level();
+    uint8           src[BENCH_WIDTHS * 3], ref[BENCH_WIDTHS], dst[BENCH_WIDTHS];
+    static cubes    refCubes, dstCubes;
+    uint32          seed = 0x2545F491u;
+    int             failed = 0;
+
+    for (uint32 i = 0; i < sizeof(src); i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        src[i] = seed;
+    }
+    for (uint32 l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+        int     wrong = 0;
+
+        simd_limit(levels[l]);
+        if (simd_level() != levels[l])
+            continue;                   /* not on this CPU */
+        for (int curve = GAMMA_NONE; curve <= GAMMA_SRGB; curve++) {
+            gamma_set((gamma_t) curve, 0);
+            for (uint32 w = 1; w <= BENCH_WIDTHS; w++)
+                for (int k = 0; k < 16; k++) {
+                    bool    dither = k & 1, bgr = k & 2;
+                    uint32  y = k >> 2;
+                    void    (*row)(const uint8 *, uint8 *, uint32, uint32,
+                                   bool, cube *) =
+                            bgr ? quantize_uniform_row_bgr : quantize_uniform_row;
+
+                    memset(refCubes, 0, sizeof(cubes));
+                    memset(dstCubes, 0, sizeof(cubes));
+                    simd_limit(SIMD_NONE);
+                    row(src, ref, w, y, dither, refCubes);
+                    simd_limit(levels[l]);
+                    row(src, dst, w, y, dither, dstCubes);
+                    wrong += memcmp(ref, dst, w) != 0 ||
+                             memcmp(refCubes, dstCubes, sizeof(cubes)) != 0;
+                }
+        }
+        gamma_set(GAMMA_NONE, 0);
+        fprintf(stderr, "  %-32s %s\n", simd_name(levels[l]),
+                wrong ? "MISMATCH" : "identical");
+        failed += wrong > 0;
+    }
+    simd_limit(best);
+    return failed;
+}
+
+/* an 8x1 RLE8 image whose delta codes move x to 2^32 - 10, where a run of
+   15 pixels would wrap back into the row and start before it. NULL when
+   out of memory. */
+static uint8 * bench_rle_delta(uint32 * size) {
+    const uint32    deltas = 16843009;  /* 16843008 of 255, one of 245 */
+    const uint32    offset = 14 + 40 + 1024, len = deltas * 4 + 4;
+    uint8           * p;
+
+    *size = offset + len;
+    if (!(p = (uint8 *) calloc(*size, 1)))
+        return NULL;
+    const uint32    fields[] = { 2, *size, 10, offset, 14, 40, 18, 8, 22, 1,
+                                 30, 1, 34, len, 46, 256 };
+    p[0] = 'B';
+    p[1] = 'M';
+    for (uint32 i = 0; i < sizeof(fields) / sizeof(fields[0]); i += 2)
+        for (int k = 0; k < 4; k++)
+            p[fields[i] + k] = fields[i + 1] >> (8 * k);
+    p[26] = 1;                          /* planes */
+    p[28] = 8;                          /* bits per pixel */
+    for (uint32 i = 0; i < deltas; i++) {
+        uint8   * d = p + offset + i * 4;
+
+        d[1] = 2;
+        d[2] = i + 1 < deltas ? 255 : 245;
+    }
+    p[*size - 4] = 15;                  /* the run, then end of bitmap */
+    p[*size - 3] = 7;
+    p[*size - 1] = 1;
+    return p;
+}
+
+/* every malformed file must fail to load, whole and streamed, and the
+   crafted RLE stream to decode, without crashing. Returns the inputs that
+   were accepted. */
+static int bench_malformed(void) {
+    static const char * files[] = {
+        "tests" SEP "rle8_overflow.bmp" };  /* rows wrap 32-bit sizes */
+    int     failed = 0;
+
+    for (uint32 i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        bitmap      bmp = image_load(files[i]);
+        BMP_CONTEXT * ctx = bmp_open(files[i]);
+        bool        ok = !bmp && !ctx;
+
+        bitmap_destroy(&bmp);
+        bmp_close(&ctx);
+        fprintf(stderr, "  %-32s %s\n", files[i], ok ? "rejected" : "ACCEPTED");
+        failed += !ok;
+    }
+
+    uint32  size;
+    uint8   * data = bench_rle_delta(&size);
+    bitmap  bmp = NULL;
+    bool    ok = data && !bmp_decode(data, size, &bmp);
+
+    bitmap_destroy(&bmp);
+    free(data);
+    fprintf(stderr, "  %-32s %s\n", "RLE8 deltas past the row",
+            ok ? "rejected" : data ? "ACCEPTED" : "not enough memory");
+    return failed + !ok;
+}
+
+/* reads the medians of a baseline report, returns their count */
+static int bench_baseline(const char * filename, bench_result_t * base,
+                          int max) {
+    FILE    * fp = fopen(filename, "r");
+    char    line[512];
+    int     count = 0;
+
+    if (!fp)
+        return -1;
+    while (count < max && fgets(line, sizeof(line), fp)) {
+        bench_result_t  * r = &base[count];
+
+        if (sscanf(line, "{\"image\":\"%63[^\"]\",\"stage\":\"%23[^\"]\","
+                   "\"pixels\":%u,\"runs\":%*d,\"p50_ms\":%lf",
+                   r->image, r->stage, &r->pixels, &r->p50) == 4)
+            count++;
+    }
+    fclose(fp);
+    return count;
+}
+
+/* prints how every stage moved against [base], returns the regressions
+   and the baseline stages this run did not measure */
+static int bench_check(const bench_t * b, const bench_result_t * base,
+                       int count, double tolerance) {
+    int     failed = 0;
+
+    for (int i = 0; i < b->count; i++) {
+        const bench_result_t * r = &b->results[i], * old = NULL;
+
+        for (int j = 0; j < count && !old; j++)
+            if (!strcmp(base[j].image, r->image) &&
+                !strcmp(base[j].stage, r->stage) &&
+                base[j].pixels == r->pixels)
+                old = &base[j];
+        if (!old) {
+            fprintf(stderr, "  %-20s %-16s %9.3f ms  (not in baseline)\n",
+                    r->image, r->stage, r->p50);
+            continue;
+        }
+
+        bool    slow = r->p50 > old->p50 * (1 + tolerance / 100) &&
+                       r->p50 > old->p50 + BENCH_SLACK;
+        fprintf(stderr, "  %-20s %-16s %9.3f ms -> %9.3f ms %+6.1f%%%s\n",
+                r->image, r->stage, old->p50, r->p50,
+                old->p50 > 0 ? (r->p50 / old->p50 - 1) * 100 : 0.0,
+                slow ? "  REGRESSION" : "");
+        failed += slow;
+    }
+
+    for (int j = 0; j < count; j++) {
+        bool    found = false;
+
+        for (int i = 0; i < b->count && !found; i++)
+            found = !strcmp(base[j].image, b->results[i].image) &&
+                    !strcmp(base[j].stage, b->results[i].stage) &&
+                    base[j].pixels == b->results[i].pixels;
+        if (!found) {
+            fprintf(stderr, "  %-20s %-16s %9.3f ms  MISSING\n",
+                    base[j].image, base[j].stage, base[j].p50);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+int main(int argc, char ** argv) {
+    static bench_t  b;
+    static bench_result_t base[BENCH_RESULTS];
+    const char      * images[] = { "lena.bmp", "heroine.bmp", "jessie.bmp",
+                                   "test.bmp" };
+    const char      * sizes = "1024,2048", * save = NULL, * compare = NULL;
+    double          tolerance = BENCH_TOLERANCE;
+    int             count = 0, failed, broken = 0;
+    bool            check = false;
+
+    b.runs = BENCH_RUNS;
+    b.threads = 1;
+    for (int i = 1; i < argc; i++) {
+        const char  * arg = argv[i];
+
+        if (!strcmp(arg, "-check")) {
+            check = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage();
+            return -1;
+        }
+        if (!strcmp(arg, "-runs") || !strcmp(arg, "-n"))
+            b.runs = atoi(argv[++i]);
+        else
+        if (!strcmp(arg, "-sizes") || !strcmp(arg, "-s"))
+            sizes = argv[++i];
+        else
+        if (!strcmp(arg, "-threads") || !strcmp(arg, "-t"))
+            b.threads = atoi(argv[++i]);
+        else
+        if (!strcmp(arg, "-save"))
+            save = argv[++i];
+        else
+        if (!strcmp(arg, "-compare"))
+            compare = argv[++i];
+        else
+        if (!strcmp(arg, "-tolerance"))
+            tolerance = atof(argv[++i]);
+        else {
+            usage();
+            return -1;
+        }
+    }
+    if (b.runs < 1 || tolerance < 0) {
+        usage();
+        return -1;
+    }
+
+    if (check) {
+        fprintf(stderr, "SIMD kernels against the C reference:\n");
+        failed = bench_simd();
+        fprintf(stderr, "Malformed files:\n");
+        failed += bench_malformed();
+        if (failed)
+            fprintf(stderr, "FAILED: %d check(s) failed.\n", failed);
+        return failed ? 1 : 0;
+    }
+
+    /* the baseline is read first, it may be overwritten by -save */
+    if (compare && (count = bench_baseline(compare, base, BENCH_RESULTS)) < 0) {
+        fprintf(stderr, "ERROR: cannot read baseline [%s].\n", compare);
+        return -1;
+    }
+    if (save && !(b.save = fopen(save, "w"))) {
+        fprintf(stderr, "ERROR: cannot write baseline [%s].\n", save);
+        return -1;
+    }
+
+    for (uint32 i = 0; i < sizeof(images) / sizeof(images[0]); i++)
+        broken += !bench_image(&b, images[i], images[i]);
+
+    for (const char * p = sizes; *p;) {
+        uint32  size = strtoul(p, NULL, 10);
+        char    label[32];
+        bitmap  bmp;
+
+        if (size) {
+            snprintf(label, sizeof(label), "synthetic-%u", size);
+            if (!(bmp = bench_synthetic(size)) || !bmp_save(BENCH_INPUT, &bmp)) {
+                fprintf(stderr, "ERROR: cannot create [%s].\n", label);
+                broken++;
+            }
+            else
+                broken += !bench_image(&b, BENCH_INPUT, label);
+            bitmap_destroy(&bmp);
+        }
+        p += strcspn(p, ",");
+        p += *p == ',';
+    }
+    remove(BENCH_INPUT);
+    remove(BENCH_OUTPUT);
+    if (b.save && fclose(b.save)) {
+        fprintf(stderr, "ERROR: cannot write baseline [%s].\n", save);
+        return -1;
+    }
+
+    if (broken)
+        fprintf(stderr, "FAILED: %d image(s) could not be benchmarked.\n",
+                broken);
+    if (!compare)
+        return broken ? 1 : 0;
+    fprintf(stderr, "Medians against [%s], tolerance %.1f%%:\n", compare,
+            tolerance);
+    failed = bench_check(&b, base, count, tolerance);
+    if (failed)
+        fprintf(stderr, "FAILED: %d stage(s) regressed or missing.\n", failed);
+    return failed || broken ? 1 : 0;
+}
@@ -1,9 +1,108 @@
-/* TODO: - reading RLE compressed image */
+/* memory-mapped I/O is only available on POSIX systems */
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(__DJGPP__)
+	#define	USE_MMAP
+	#define	_POSIX_C_SOURCE	200809L
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef USE_MMAP
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
 #include "bitmap.h"
+#include "stats.h"
+
+/* little-endian field access for the on-disk header layout */
+static uint16 bmp_get16(const uint8 * p) {
+	return (uint16) (p[0] | (p[1] << 8));
+}
+
+static uint32 bmp_get32(const uint8 * p) {
+	return (uint32) p[0] | ((uint32) p[1] << 8) |
+		   ((uint32) p[2] << 16) | ((uint32) p[3] << 24);
+}
+
+static void bmp_set16(uint8 * p, uint16 v) {
+	p[0] = v & 0xff; p[1] = v >> 8;
+}
+
+static void bmp_set32(uint8 * p, uint32 v) {
+	p[0] = v & 0xff; p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff; p[3] = v >> 24;
+}
+
+/* decodes the 40-byte V3 information block */
+static void bmp_decode_info(BMP_INFO_HEADER * info, const uint8 * p) {
+	info->size		= bmp_get32(p +  0);
+	info->width		= bmp_get32(p +  4);
+	info->height	= bmp_get32(p +  8);
+	info->planes	= bmp_get16(p + 12);
+	info->bitcount	= bmp_get16(p + 14);
+	info->compress	= bmp_get32(p + 16);
+	info->imagesize	= bmp_get32(p + 20);
+	info->xppm		= bmp_get32(p + 24);
+	info->yppm		= bmp_get32(p + 28);
+	info->clrused	= bmp_get32(p + 32);
+	info->clrimp	= bmp_get32(p + 36);
+}
+
+/* decodes the V4 color masks following the V3 block */
+static void bmp_decode_masks(BMP_CONTEXT * ctx, const uint8 * p) {
+	ctx->info.maskr = bmp_get32(p + 0);
+	ctx->info.maskg = bmp_get32(p + 4);
+	ctx->info.maskb = bmp_get32(p + 8);
+
+	/* detect the bitfield formats for both 16 and 32-bit images */
+	switch (ctx->info.maskr) {
+	case 0x7800    : ctx->fields = BMPBF_R5G6B5;   break;
+	case 0x7c00    : ctx->fields = BMPBF_A1R5G5B5; break;
+	case 0x0f00    : ctx->fields = BMPBF_A4R4G4B4; break;
+	case 0xff000000: ctx->fields = BMPBF_A8R8G8B8; break;
+	}
+}
+
+static BMP_CONTEXT * bmp_map_parse(BMP_CONTEXT * ctx);
+static bitmap bmp_read(BMP_CONTEXT * ctx, bitmap * bmp);
+static bool bmp_write(BMP_CONTEXT * ctx, const bitmap * bmp);
+
+/* works out the CLUT size and scanline width once the headers are known */
+static bool bmp_prepare(BMP_CONTEXT * ctx) {
+	/* detect total colors for the CLUT */
+	switch (ctx->info.bitcount) {
+	case 1:		/* monochrome bitmap */
+		ctx->colors = 2;
+		break;
+	case 4:		/* 16 colors bitmap */
+		ctx->colors = 16;
+		break;
+	case 8:		/* 256 colors bitmap */
+		ctx->colors = 256;
+		break;
+	case 16:	/* RGB bitmap, no palette needed */
+	case 24:
+	case 32:
+		ctx->colors = 0;
+		break;
+	default:	/* we ran into a corrupted bitmap */
+		return false;
+	}
+
+	/* calculate the memory needed for each bitmap scanline, the rows and
+	   the decoded RGB24 image must stay within 32-bit sizes, whatever the
+	   compression */
+	if (((uint64) ctx->info.width * ctx->info.bitcount + 31) / 32 * 4 *
+		ctx->info.height > 0xFFFFFFFFu ||
+		(uint64) ctx->info.width * ctx->info.height * 3 > 0xFFFFFFFFu)
+		return false;
+	ctx->rowsize = ((ctx->info.width * ctx->info.bitcount+31)/32)*4;
+	if (!(ctx->scanline = (uint8 *) calloc(ctx->rowsize, 1)))
+		return false;				/* not enough memory */
+	return true;
+}
 
 /*	bmp_open(): Open a Windows BMP image file for reading
  *
@@ -21,11 +120,8 @@ BMP_CONTEXT * bmp_open(const char * filename) {
 		return NULL;				/* not enough memory for context */
 
 	/* reset everything inside the context */
-	memset(&ctx->hdr, 0, BMP_HEADER_SIZE);
-	memset(&ctx->info, 0, BMP_INFO_HEADER_V3_SIZE);
-	ctx->rowsize = 0;
+	memset(ctx, 0, sizeof(BMP_CONTEXT));
 	ctx->fields = BMPBF_UNKNOWN;
-	ctx->scanline = NULL;
 
 	/* open file for reading */
 	if(!(ctx->fp = fopen(filename, "rb"))) {
@@ -46,48 +142,20 @@ BMP_CONTEXT * bmp_open(const char * filename) {
 	}
 
 	/* read up the information header block */
-	if (!bmp_get_info_block(&ctx)) {
+	if (!bmp_get_info_block(&ctx) || !bmp_prepare(ctx)) {
 		bmp_close(&ctx);			/* header read error */
 		return NULL;
 	}
 
-	/* detect total colors for the CLUT */
-	switch (ctx->info.bitcount) {
-	case 1:		/* monochrome bitmap */
-		ctx->colors = 2;
-		break;
-	case 4:		/* 16 colors bitmap */
-		ctx->colors = 16;
-		break;
-	case 8:		/* 256 colors bitmap */
-		ctx->colors = 256;
-		break;
-	case 16:	/* RGB bitmap, no palette needed */
-	case 24:
-	case 32:
-		ctx->colors = 0;
-		break;
-	default:	/* we ran into a corrupted bitmap */
-		bmp_close(&ctx);
-		return NULL;
-		break;
-	}
-
-	/* load up the palette if presents */
+	/* load up the palette if presents, it follows the information block */
 	if (ctx->colors) {
-		if (fread(ctx->palette, sizeof(rgba_t) * ctx->colors, 1, ctx->fp) != 1) {
+		if (fseek(ctx->fp, BMP_HEADER_SIZE + ctx->info.size, SEEK_SET) ||
+			fread(ctx->palette, sizeof(rgba_t) * ctx->colors, 1, ctx->fp) != 1) {
 			bmp_close(&ctx);
 			return NULL;
 		}
 	}
 
-	/* calculate the memory needed for each bitmap scanline */
-	ctx->rowsize = ((ctx->info.width * ctx->info.bitcount+31)/32)*4;
-	if (!(ctx->scanline = (uint8 *) malloc(ctx->rowsize))) {
-		bmp_close(&ctx);			/* not enough memory */
-	    return NULL;
-	}
-
 	/* jump to the bitmap data */
 	fseek(ctx->fp, ctx->hdr.offset, SEEK_SET);
 	return ctx;						/* return the context */
@@ -108,19 +176,207 @@ BMP_CONTEXT * bmp_create(const char * filename) {
 	if (!ctx)
 		return NULL;
 
+	memset(ctx, 0, sizeof(BMP_CONTEXT));
 	if(!(ctx->fp = fopen(filename, "wb"))) {
 		free(ctx);
 		return NULL;
 	}
 
-	memset(&ctx->hdr, 0, BMP_HEADER_SIZE);
-	memset(&ctx->info, 0, BMP_INFO_HEADER_V3_SIZE);
-	ctx->rowsize = 0;
-	ctx->scanline = NULL;
+	return ctx;
+}
+
+/*	bmp_map(): Open a Windows BMP image file for reading through a memory
+ *	mapping. Scanlines can then be accessed in place with bmp_map_row()
+ *	without any copy; bmp_get_row() keeps working as well.
+ *
+ *	Params:
+ *		filename: image file name to open
+ *	Returns:
+ *		Context attatched to the mapped image file on success
+ *		NULL if error or if memory mapping is not available, the caller
+ *		should fall back to bmp_open()
+ */
+BMP_CONTEXT * bmp_map(const char * filename) {
+#ifdef USE_MMAP
+	BMP_CONTEXT * ctx;
+	struct stat	st;
+	void		* map;
+	int			fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+		st.st_size < BMP_HEADER_SIZE + BMP_INFO_HEADER_V3_SIZE ||
+		st.st_size > 0xFFFFFFFFL) {
+		close(fd);
+		return NULL;
+	}
+
+	/* the mapping stays valid once the descriptor is closed */
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	if (!(ctx = (BMP_CONTEXT *) calloc(1, sizeof(BMP_CONTEXT)))) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	ctx->map = (uint8 *) map;
+	ctx->mapsize = (uint32) st.st_size;
+	return bmp_map_parse(ctx);
+#else
+	return NULL;
+#endif
+}
+
+/*	bmp_memory(): Open a Windows BMP image held in memory for reading, the
+ *	same way as bmp_map(). The memory must outlive the context.
+ *
+ *	Params:
+ *		data: image file contents
+ *		size: bytes in data
+ *	Returns:
+ *		Context reading from data on success
+ *		NULL if error
+ */
+BMP_CONTEXT * bmp_memory(const uint8 * data, uint32 size) {
+	BMP_CONTEXT * ctx;
+
+	if (!data || size < BMP_HEADER_SIZE + BMP_INFO_HEADER_V3_SIZE)
+		return NULL;
+	if (!(ctx = (BMP_CONTEXT *) calloc(1, sizeof(BMP_CONTEXT))))
+		return NULL;
+	ctx->map = (uint8 *) data;
+	ctx->mapsize = size;
+	ctx->memory = true;
+	return bmp_map_parse(ctx);
+}
+
+/* validates the headers of a mapped or in-memory image, the context is
+   closed on failure */
+static BMP_CONTEXT * bmp_map_parse(BMP_CONTEXT * ctx) {
+	ctx->fields = BMPBF_UNKNOWN;
+
+	/* parse the headers straight from the mapping */
+	ctx->hdr.signature = bmp_get16(ctx->map + 0);
+	ctx->hdr.size      = bmp_get32(ctx->map + 2);
+	ctx->hdr.reserved1 = bmp_get16(ctx->map + 6);
+	ctx->hdr.reserved2 = bmp_get16(ctx->map + 8);
+	ctx->hdr.offset    = bmp_get32(ctx->map + 10);
+	bmp_decode_info(&ctx->info, ctx->map + BMP_HEADER_SIZE);
+
+	if (ctx->hdr.signature != BMP_TYPE ||
+		ctx->info.size < BMP_INFO_HEADER_V3_SIZE ||
+		ctx->info.size > ctx->mapsize - BMP_HEADER_SIZE) {
+		bmp_close(&ctx);			/* not a valid Windows BMP */
+		return NULL;
+	}
+	if (ctx->info.size > BMP_INFO_HEADER_V3_SIZE) {
+		if (ctx->info.size < BMP_INFO_HEADER_V3_SIZE + 12) {
+			bmp_close(&ctx);
+			return NULL;
+		}
+		bmp_decode_masks(ctx, ctx->map + BMP_HEADER_SIZE +
+							  BMP_INFO_HEADER_V3_SIZE);
+	}
+
+	if (!bmp_prepare(ctx)) {
+		bmp_close(&ctx);
+		return NULL;
+	}
+
+	/* the palette and every scanline must lie inside the file */
+	if (ctx->colors) {
+		uint32 pos = BMP_HEADER_SIZE + ctx->info.size;
+		if (ctx->colors * sizeof(rgba_t) > ctx->mapsize - pos) {
+			bmp_close(&ctx);
+			return NULL;
+		}
+		memcpy(ctx->palette, ctx->map + pos, ctx->colors * sizeof(rgba_t));
+	}
+	if (ctx->hdr.offset > ctx->mapsize ||
+		(ctx->rowsize && ctx->info.compress != 1 && ctx->info.compress != 2 &&
+		 ctx->info.height > (ctx->mapsize - ctx->hdr.offset) / ctx->rowsize)) {
+		bmp_close(&ctx);
+		return NULL;
+	}
 
 	return ctx;
 }
 
+/*	bmp_map_create(): Create a Windows BMP image file for writing through a
+ *	memory mapping. The file is sized up front from [bmp], its headers are
+ *	set up but not written yet, just like bmp_create() + bmp_setup_header().
+ *
+ *	Params:
+ *		filename: image file name to create, any existed file will be
+ *		overwritten.
+ *		bmp: bitmap describing the image to be written
+ *	Returns:
+ *		Context attatched to the mapped image file on success
+ *		NULL if error, if the space cannot be reserved or if memory mapping
+ *		is not available, the caller should fall back to bmp_create()
+ */
+BMP_CONTEXT * bmp_map_create(const char * filename, const bitmap * bmp) {
+#ifdef USE_MMAP
+	BMP_CONTEXT	* ctx;
+	void		* map;
+	int			fd;
+
+	if (!(ctx = (BMP_CONTEXT *) calloc(1, sizeof(BMP_CONTEXT))))
+		return NULL;
+
+	if (!bmp_setup_header(&ctx, bmp)) {
+		bmp_close(&ctx);
+		return NULL;
+	}
+
+	if ((fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		bmp_close(&ctx);
+		return NULL;
+	}
+
+	/* the blocks are reserved up front, a full disk must not turn into a
+	   SIGBUS while the rows are stored */
+	if (posix_fallocate(fd, 0, ctx->hdr.size)) {
+		close(fd);
+		bmp_close(&ctx);
+		return NULL;
+	}
+
+	map = mmap(NULL, ctx->hdr.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		bmp_close(&ctx);
+		return NULL;
+	}
+
+	ctx->map = (uint8 *) map;
+	ctx->mapsize = ctx->hdr.size;
+	return ctx;
+#else
+	return NULL;
+#endif
+}
+
+/*	bmp_map_row(): Direct access to a stored scanline of a mapped context.
+ *	Rows are in file order (bottom-up) and pixels in file order (B, G, R).
+ *
+ *	Params:
+ *		ctx: context returned by bmp_map() or bmp_map_create()
+ *		row: scanline index counted from the bottom of the image
+ *	Returns:
+ *		pointer to the scanline inside the mapping
+ *		NULL if the context is not mapped or the row is out of range
+ */
+uint8 * bmp_map_row(BMP_CONTEXT ** ctx, uint32 row) {
+	if (!(*ctx)->map || row >= (*ctx)->info.height)
+		return NULL;
+	return (*ctx)->map + (*ctx)->hdr.offset + row * (*ctx)->rowsize;
+}
+
 /*	bmp_close(): Close a Windows BMP context
  *
  *	Params:
@@ -129,12 +385,18 @@ BMP_CONTEXT * bmp_create(const char * filename) {
  *		none
  */
 void bmp_close(BMP_CONTEXT ** ctx) {
-	if(!ctx)
+	if(!ctx || !(*ctx))
 		return;
 
-	fclose((*ctx)->fp);
+	if ((*ctx)->fp)
+		fclose((*ctx)->fp);
 
-	if(!(*ctx)->scanline) {
+#ifdef USE_MMAP
+	if ((*ctx)->map && !(*ctx)->memory)
+		munmap((*ctx)->map, (*ctx)->mapsize);
+#endif
+
+	if((*ctx)->scanline) {
 		free((*ctx)->scanline);
 		(*ctx)->scanline = NULL;
 	}
@@ -143,8 +405,273 @@ void bmp_close(BMP_CONTEXT ** ctx) {
 	(*ctx) = NULL;
 }
 
+/*	bmp_finish(): Close a Windows BMP context written to, making sure that
+ *	everything reached the file
+ *
+ *	Params:
+ *		ctx: context returned by bmp_create() or bmp_map_create()
+ *	Returns:
+ *		true on success
+ *		false if the file could not be flushed or unmapped
+ */
+bool bmp_finish(BMP_CONTEXT ** ctx) {
+	bool	ok = true;
+
+	if(!ctx || !(*ctx))
+		return false;
+
+	if ((*ctx)->fp) {
+		ok = !fclose((*ctx)->fp);
+		(*ctx)->fp = NULL;
+	}
+
+#ifdef USE_MMAP
+	if ((*ctx)->map && !(*ctx)->memory) {
+		/* hands the pages to the kernel as fclose() would, without waiting
+		   for the disk */
+		ok = !msync((*ctx)->map, (*ctx)->mapsize, MS_ASYNC) && ok;
+		ok = !munmap((*ctx)->map, (*ctx)->mapsize) && ok;
+		(*ctx)->map = NULL;
+	}
+#endif
+
+	bmp_close(ctx);
+	return ok;
+}
+
+/*------------------------- RUN-LENGTH ENCODING ------------------------------*/
+
+/* stores a 4-bit index at pixel [x], the leftmost one in the high nibble */
+static void bmp_put_nibble(uint8 * row, uint32 x, uint8 index) {
+	row[x / 2] = x & 1 ? (row[x / 2] & 0xF0) | index
+					   : (row[x / 2] & 0x0F) | (index << 4);
+}
+
+/* decodes an RLE8 or RLE4 stream into the top-down rows of [bmp]. Runs
+   crossing the right edge are clipped, rows past the top fail. */
+static bool bmp_unpack_rle(const uint8 * src, uint32 len, bitmap bmp,
+						   uint32 bits) {
+	const uint8	* end = src + len;
+	uint32		x = 0, y = 0;			/* y counts from the bottom */
+
+	memset(bmp->data, 0, bmp->size);	/* skipped pixels use index 0 */
+	while (end - src >= 2) {
+		uint32	count = src[0], code = src[1], n, x0, bytes;
+		uint8	* row;
+
+		src += 2;
+		if (!count)
+			switch (code) {
+			case 0:						/* end of line */
+				x = 0;
+				y++;
+				continue;
+			case 1:						/* end of bitmap */
+				return true;
+			case 2:						/* delta */
+				if (end - src < 2)
+					return false;
+				x += src[0];
+				y += src[1];
+				src += 2;
+				if (x > bmp->width || y > bmp->height)
+					return false;
+				continue;
+			}
+
+		if (y >= bmp->height)
+			return false;
+		row = bmp->data + (bmp->height - 1 - y) * bmp->rowsize;
+		/* runs start at x0 <= width and are clipped to the row */
+		x0 = x;
+		n = count ? count : code;
+		x = n > bmp->width - x0 ? bmp->width : x0 + n;
+		n = x - x0;
+
+		if (count) {					/* encoded run, nibbles alternate */
+			if (bits == 8)
+				memset(row + x0, code, n);
+			else
+				for (uint32 k = 0; k < n; k++)
+					bmp_put_nibble(row, x0 + k,
+								   k & 1 ? code & 15 : code >> 4);
+			continue;
+		}
+
+		/* absolute run, padded to a word */
+		bytes = bits == 8 ? code : (code + 1) / 2;
+		if ((uint32) (end - src) < bytes)
+			return false;
+		if (bits == 8)
+			memcpy(row + x0, src, n);
+		else
+			for (uint32 k = 0; k < n; k++)
+				bmp_put_nibble(row, x0 + k,
+							   k & 1 ? src[k / 2] & 15 : src[k / 2] >> 4);
+		bytes += bytes & 1;
+		src += (uint32) (end - src) < bytes ? (uint32) (end - src) : bytes;
+	}
+	return true;						/* tolerate a missing end marker */
+}
+
+/* reads the compressed image of an open RLE8 or RLE4 context */
+static bool bmp_read_rle(BMP_CONTEXT * ctx, bitmap bmp) {
+	const uint8	* src;
+	uint8		* buf = NULL;
+	uint32		len;
+	bool		ok;
+	double		start = stats_start();
+
+	if (ctx->map) {
+		src = ctx->map + ctx->hdr.offset;
+		len = ctx->mapsize - ctx->hdr.offset;
+		if (ctx->info.imagesize && ctx->info.imagesize < len)
+			len = ctx->info.imagesize;
+	}
+	else {
+		/* the stream size is optional in the header, up to the end then */
+		long	pos = ftell(ctx->fp), end;
+
+		if (pos < 0 || fseek(ctx->fp, 0, SEEK_END) ||
+			(end = ftell(ctx->fp)) < pos || fseek(ctx->fp, pos, SEEK_SET))
+			return false;
+		len = end - pos;
+		if (ctx->info.imagesize && ctx->info.imagesize < len)
+			len = ctx->info.imagesize;
+		if (!(buf = (uint8 *) malloc(len ? len : 1)))
+			return false;
+		if (fread(buf, 1, len, ctx->fp) != len) {
+			free(buf);
+			return false;
+		}
+		src = buf;
+	}
+
+	ok = bmp_unpack_rle(src, len, bmp, ctx->info.bitcount);
+	free(buf);
+	stats_read(len);
+	stats_stop(STATS_DECODE, start);
+	return ok;
+}
+
+/* appends the RLE8 or RLE4 codes of one row of pixel indices, one byte per
+   pixel. Runs of 3 or more are encoded, the rest goes in absolute mode. */
+static uint8 * bmp_pack_row(uint8 * dst, const uint8 * idx, uint32 width,
+							uint32 bits) {
+	uint32	i = 0;
+
+	while (i < width) {
+		uint32	run = 1, j;
+
+		while (i + run < width && run < 255 && idx[i + run] == idx[i])
+			run++;
+		if (run >= 3 || width - i < 3) {
+			*dst++ = run;
+			*dst++ = bits == 8 ? idx[i] : idx[i] | (idx[i] << 4);
+			i += run;
+			continue;
+		}
+
+		/* gather pixels up to the next run worth encoding, both tests are
+		   evaluated at once as mixed pixels defeat branch prediction */
+		uint32	last = width - i > 255 ? i + 255 : width;
+		for (j = i; j < last && j + 2 < width; j++)
+			if ((idx[j] == idx[j + 1]) & (idx[j] == idx[j + 2]))
+				break;
+		if (j + 2 >= width)
+			j = last;
+		if (j - i < 3) {				/* 0 to 2 are escape codes */
+			*dst++ = run;
+			*dst++ = bits == 8 ? idx[i] : idx[i] | (idx[i] << 4);
+			i += run;
+			continue;
+		}
+
+		uint32	n = j - i, bytes = bits == 8 ? n : (n + 1) / 2;
+		*dst++ = 0;
+		*dst++ = n;
+		if (bits == 8)
+			memcpy(dst, idx + i, n);
+		else
+		for (uint32 k = 0; k < bytes; k++)
+			dst[k] = (idx[i + 2 * k] << 4) |
+					 (2 * k + 1 < n ? idx[i + 2 * k + 1] : 0);
+		dst += bytes;
+		if (bytes & 1)
+			*dst++ = 0;
+		i = j;
+	}
+	return dst;
+}
+
+/* compresses an indexed bitmap as RLE8, or RLE4 when it only uses the
+   first 16 colors, and adjusts the headers set up in [ctx]. Returns the
+   stream size, 0 when the bitmap cannot be compressed or would not shrink. */
+static uint32 bmp_pack_rle(BMP_CONTEXT * ctx, const bitmap * bmp,
+						   uint8 ** out) {
+	bitmap	b = *bmp;
+	uint32	bits = 8, len, plain;
+	uint8	* idx, * dst;
+
+	if (b->format != BMF_INDEXED8 && b->format != BMF_INDEXED4)
+		return 0;
+	if (b->format == BMF_INDEXED4)
+		bits = 4;
+	else {
+		uint8	top = 0;
+		for (uint32 i = 0; i < b->size; i++)
+			top |= b->data[i];
+		if (top < 16)
+			bits = 4;
+	}
+
+	/* worst case: every pixel as a run of one, plus the row ends */
+	*out = (uint8 *) malloc((uint64) b->height * (2 * b->width + 2) + 2);
+	idx = (uint8 *) malloc(b->width);
+	if (!*out || !idx) {
+		free(*out);
+		free(idx);
+		*out = NULL;
+		return 0;
+	}
+
+	dst = *out;
+	for (uint32 y = 0; y < b->height; y++) {
+		/* stored bottom-up */
+		const uint8	* row = b->data + (b->height - 1 - y) * b->rowsize;
+		if (b->format == BMF_INDEXED4)
+			for (uint32 x = 0; x < b->width; x++)
+				idx[x] = x & 1 ? row[x / 2] & 15 : row[x / 2] >> 4;
+		else
+			memcpy(idx, row, b->width);
+		dst = bmp_pack_row(dst, idx, b->width, bits);
+		*dst++ = 0;
+		*dst++ = y + 1 < b->height ? 0 : 1;		/* end of line or bitmap */
+	}
+	free(idx);
+
+	/* compared with the uncompressed file written otherwise */
+	len = dst - *out;
+	plain = b->height * ctx->rowsize;
+	if (len >= plain) {
+		free(*out);
+		*out = NULL;
+		return 0;
+	}
+
+	/* 16 colors are enough for RLE4 */
+	ctx->hdr.offset -= (1 << ctx->info.bitcount) * sizeof(rgba_t);
+	ctx->info.bitcount = bits;
+	ctx->info.clrused = 1 << bits;
+	ctx->hdr.offset += (1 << bits) * sizeof(rgba_t);
+	ctx->info.compress = bits == 8 ? 1 : 2;
+	ctx->info.imagesize = len;
+	ctx->hdr.size = ctx->hdr.offset + len;
+	return len;
+}
+
 /*	bmp_load(): Windows BMP easy loader. Supports loading of uncompressed
- *	1, 4, 8, 24 and 32-bit images.
+ *	1, 4, 8, 24 and 32-bit images, and of RLE8 and RLE4 compressed ones.
  *
  *	Params:
  *		filename: Windows BMP file name to load
@@ -153,18 +680,65 @@ void bmp_close(BMP_CONTEXT ** ctx) {
  *		NULL if error
  */
 bitmap bmp_load(const char * filename) {
+	bitmap			bmp = NULL;			/* Result bitmap */
+
+	if (!bmp_reload(filename, &bmp))
+		bitmap_destroy(&bmp);
+	return bmp;
+}
+
+/*	bmp_reload(): Windows BMP loader into an existing bitmap, whose memory
+ *	is reused when large enough (see bitmap_recreate()).
+ *
+ *	Params:
+ *		filename: Windows BMP file name to load
+ *		bmp: bitmap to load into, NULL to create a new one
+ *	Returns:
+ *		the bitmap stored in bmp on success
+ *		NULL if error, bmp keeps its memory for another attempt
+ */
+bitmap bmp_reload(const char * filename, bitmap * bmp) {
+	BMP_CONTEXT 	* ctx;
+	double			start = stats_start();
+
+	/* open the Windows BMP image file, mapped when possible */
+	if (!(ctx = bmp_map(filename)) && !(ctx = bmp_open(filename)))
+		return NULL;			/* error opening the file */
+	stats_stop(STATS_HEADER, start);
+	return bmp_read(ctx, bmp);
+}
+
+/*	bmp_decode(): Windows BMP loader from a file image held in memory, into
+ *	an existing bitmap like bmp_reload().
+ *
+ *	Params:
+ *		data: Windows BMP file contents
+ *		size: bytes in data
+ *		bmp: bitmap to load into, NULL to create a new one
+ *	Returns:
+ *		the bitmap stored in bmp on success
+ *		NULL if error, bmp keeps its memory for another attempt
+ */
+bitmap bmp_decode(const uint8 * data, uint32 size, bitmap * bmp) {
 	BMP_CONTEXT 	* ctx;
+	double			start = stats_start();
+
+	if (!(ctx = bmp_memory(data, size)))
+		return NULL;
+	stats_stop(STATS_HEADER, start);
+	return bmp_read(ctx, bmp);
+}
+
+/* reads the image of an open context into [bmp], closes the context */
+static bitmap bmp_read(BMP_CONTEXT * ctx, bitmap * bmp) {
 	bitmap_format_t	fmt;
-	bitmap			bmp = NULL;			/* Result bitmap */
 	uint32			linew;
 	bool			hasPal = false;
 
-	/* open the Windows BMP image file */
-	if (!(ctx = bmp_open(filename)))
-		return NULL;			/* error opening the file */
-
-	/* at the moment, we don't support reading compression BMPs */
-	if (!(ctx->info.compress == 0 || ctx->info.compress == 3)) {
+	/* RLE8 and RLE4 only apply to their own depth */
+	if (!(ctx->info.compress == 0 || ctx->info.compress == 3 ||
+		  (ctx->info.compress == 1 && ctx->info.bitcount == 8) ||
+		  (ctx->info.compress == 2 && ctx->info.bitcount == 4))) {
 		bmp_close(&ctx);
 		return NULL;
 	}
@@ -187,36 +761,44 @@ bitmap bmp_load(const char * filename) {
 		return NULL;
 	}
 
-	/* create a place holder for the upcoming bitmap */
-	if (!(bmp = bitmap_create(ctx->info.width, ctx->info.height,
-							  fmt, hasPal))) {
+	/* create or reshape a place holder for the upcoming bitmap */
+	if (!bitmap_recreate(bmp, ctx->info.width, ctx->info.height,
+						 fmt, hasPal)) {
 		bmp_close(&ctx);		/* not enuf memory */
 	    return NULL;
 	}
 
+	/* headers and palette precede the bits */
+	stats_read(ctx->hdr.offset);
+
 	/* fetch the color lookup table from the context */
-	if (ctx->colors && bitmap_has_pal(&bmp)) {
+	if (ctx->colors && bitmap_has_pal(bmp)) {
 		for (int i = 0; i < ctx->colors; i++) {
-			/* only take R, G, B and discard the A component */
-			bmp->pal[i].r = ctx->palette[i].r;
-			bmp->pal[i].g = ctx->palette[i].g;
-			bmp->pal[i].b = ctx->palette[i].b;
+			/* entries are stored as B, G, R, A: swap and discard A */
+			(*bmp)->pal[i].r = ctx->palette[i].b;
+			(*bmp)->pal[i].g = ctx->palette[i].g;
+			(*bmp)->pal[i].b = ctx->palette[i].r;
 		}
 	}
 
-	linew = bitmap_row_size(&bmp);
+	if (ctx->info.compress == 1 || ctx->info.compress == 2) {
+		bitmap	res = bmp_read_rle(ctx, *bmp) ? *bmp : NULL;
+		bmp_close(&ctx);
+		return res;
+	}
+
+	linew = bitmap_row_size(bmp);
 	/* read up each scanline and store it in the top-down order */
 	for (int i = 0; i < ctx->info.height; i++) {
-		uint32	index = (bmp->height-i-1)*linew;
-		if (!bmp_get_row(&ctx, bmp->data+index, linew)) {
+		uint32	index = ((*bmp)->height-i-1)*linew;
+		if (!bmp_get_row(&ctx, (*bmp)->data+index, linew)) {
 			bmp_close(&ctx);
-			bitmap_destroy(&bmp);
 			return NULL;
 		}
 	}
 
 	bmp_close(&ctx);
-	return bmp;
+	return (*bmp);
 }
 
 /*	bmp_save(): Windows BMP easy writer. Supports saving of uncompressed
@@ -230,16 +812,135 @@ bitmap bmp_load(const char * filename) {
  */
 bool bmp_save(const char * filename, const bitmap * bmp) {
 	BMP_CONTEXT * ctx;
-	uint32		linew;
 
 	if (!bmp)
 		return false;
 
-	/* open file for writing */
-	if (!(ctx = bmp_create(filename)))
-		return false;
+	/* open file for writing, mapped when possible */
+	if (!(ctx = bmp_map_create(filename, bmp))) {
+		if (!(ctx = bmp_create(filename)))
+			return false;
+		if (!bmp_setup_header(&ctx, bmp)) {	/* header preparation */
+			bmp_close(&ctx);
+			return false;
+		}
+	}
+	return bmp_write(ctx, bmp);
+}
+
+/* encodes [bmp] into a growing buffer, RLE compressed on request */
+static uint32 bmp_pack(const bitmap * bmp, uint8 ** buf, uint32 * capacity,
+					   bool rle) {
+	BMP_CONTEXT * ctx;
+	uint8		* data = NULL;
+	uint32		size, len = 0;
+	bool		ok;
+
+	if (!bmp || !(*bmp))
+		return 0;
+	if (!(ctx = (BMP_CONTEXT *) calloc(1, sizeof(BMP_CONTEXT))))
+		return 0;
+	if (!bmp_setup_header(&ctx, bmp)) {
+		bmp_close(&ctx);
+		return 0;
+	}
+	if (rle) {
+		double	start = stats_start();
+		len = bmp_pack_rle(ctx, bmp, &data);
+		stats_stop(STATS_ENCODE, start);
+	}
+
+	size = ctx->hdr.size;
+	if (size > *capacity) {
+		uint8 * grown = (uint8 *) realloc(*buf, size);
+		if (!grown) {
+			free(data);
+			bmp_close(&ctx);
+			return 0;
+		}
+		*buf = grown;
+		*capacity = size;
+	}
+
+	/* scanline padding is not written by bmp_put_row() */
+	memset(*buf, 0, size);
+	ctx->map = *buf;
+	ctx->mapsize = size;
+	ctx->memory = true;
+	if (!len)
+		return bmp_write(ctx, bmp) ? size : 0;
+
+	memcpy(*buf + ctx->hdr.offset, data, len);
+	free(data);
+	ok = bmp_put_header_block(&ctx) && bmp_put_info_block(&ctx);
+	bmp_close(&ctx);
+	if (ok)
+		stats_write(size);
+	return ok ? size : 0;
+}
+
+/*	bmp_encode(): Windows BMP writer into memory. The file image is stored
+ *	in a growing buffer, so encoding many images reuses one allocation.
+ *
+ *	Params:
+ *		bmp: bitmap to encode
+ *		buf: buffer receiving the file image, realloc'ed when too small
+ *		capacity: bytes allocated for buf
+ *	Returns:
+ *		the file size in bytes on success
+ *		0 if error
+ */
+uint32 bmp_encode(const bitmap * bmp, uint8 ** buf, uint32 * capacity) {
+	return bmp_pack(bmp, buf, capacity, false);
+}
+
+/*	bmp_encode_rle(): Windows BMP writer into memory like bmp_encode(),
+ *	compressing 8-bit images as RLE8, or as RLE4 when they only use the
+ *	first 16 colors. Other images, and those RLE would not shrink, are
+ *	stored uncompressed.
+ *
+ *	Params:
+ *		bmp: bitmap to encode
+ *		buf: buffer receiving the file image, realloc'ed when too small
+ *		capacity: bytes allocated for buf
+ *	Returns:
+ *		the file size in bytes on success
+ *		0 if error
+ */
+uint32 bmp_encode_rle(const bitmap * bmp, uint8 ** buf, uint32 * capacity) {
+	return bmp_pack(bmp, buf, capacity, true);
+}
+
+/*	bmp_save_rle(): Windows BMP writer with RLE8 or RLE4 compression, see
+ *	bmp_encode_rle(). The file is written in one go.
+ *
+ *	Params:
+ *		filename: Windows BMP file name to save
+ *		bmp: bitmap to save
+ *	Returns:
+ *		true on success
+ *		false if error
+ */
+bool bmp_save_rle(const char * filename, const bitmap * bmp) {
+	uint8	* buf = NULL;
+	uint32	capacity = 0, size;
+	FILE	* fp;
+	bool	ok = false;
+
+	if ((size = bmp_pack(bmp, &buf, &capacity, true)) &&
+		(fp = fopen(filename, "wb"))) {
+		ok = fwrite(buf, size, 1, fp) == 1;
+		if (fclose(fp))
+			ok = false;
+	}
+	free(buf);
+	return ok;
+}
+
+/* writes the headers and scanlines of [bmp], closes the context */
+static bool bmp_write(BMP_CONTEXT * ctx, const bitmap * bmp) {
+	uint32		linew;
 
-	bmp_setup_header(&ctx, bmp);			/* header preparation */
 	if (!bmp_put_header_block(&ctx)) {		/* write the header block */
 		bmp_close(&ctx);
 		return false;
@@ -249,6 +950,7 @@ bool bmp_save(const char * filename, const bitmap * bmp) {
 		bmp_close(&ctx);
 		return false;
 	}
+	stats_write(ctx->hdr.offset);
 
 	linew = bitmap_row_size(bmp);			/* determine source line width */
 	for (int i = 0; i < (*bmp)->height; i++) {
@@ -262,8 +964,7 @@ bool bmp_save(const char * filename, const bitmap * bmp) {
 	}
 
 	/* close the bitmap file */
-	bmp_close(&ctx);
-	return true;
+	return bmp_finish(&ctx);
 }
 
 bool bmp_get_row(BMP_CONTEXT ** ctx, uint8 * buf, uint32 len) {
@@ -271,7 +972,19 @@ bool bmp_get_row(BMP_CONTEXT ** ctx, uint8 * buf, uint32 len) {
 	uint16	* src16 = (uint16 *) (*ctx)->scanline;
 	uint32	* src32 = (uint32 *) (*ctx)->scanline;
 	uint32	pixel;
+	double	start = stats_start();
 
+	if ((*ctx)->map) {
+		uint8 * row = bmp_map_row(ctx, (*ctx)->row++);
+		if (!row)
+			return false;
+		/* byte formats are read in place, packed words may be unaligned */
+		if ((*ctx)->info.bitcount <= 8 || (*ctx)->info.bitcount == 24)
+			src = row;
+		else
+			memcpy((*ctx)->scanline, row, (*ctx)->rowsize);
+	}
+	else
 	if (fread((*ctx)->scanline, (*ctx)->rowsize, 1, (*ctx)->fp) != 1)
 		return false;
 
@@ -344,28 +1057,36 @@ bool bmp_get_row(BMP_CONTEXT ** ctx, uint8 * buf, uint32 len) {
 			break;
 		}
 	}
+	stats_read((*ctx)->rowsize);
+	stats_stop(STATS_DECODE, start);
 	return true;
 }
 
 bool bmp_put_row(BMP_CONTEXT ** ctx, uint8 * buf, uint32 len) {
 	uint8 * src = buf, * dst = (*ctx)->scanline;
+	double	start = stats_start();
+
+	/* mapped files are written in place */
+	if ((*ctx)->map && !(dst = bmp_map_row(ctx, (*ctx)->row++)))
+		return false;
+
 	switch ((*ctx)->info.bitcount) {
 	case 1:
 	case 4:
 	case 8:
-		memcpy((*ctx)->scanline, buf, len);	/* len = buffer size */
+		memcpy(dst, buf, len);	/* len = buffer size */
 		break;
 	case 16:
 		break;
 	case 24:
-		for (int j = 0; j < (*ctx)->rowsize; j+=3) {
+		for (int j = 0; j < (*ctx)->info.width*3; j+=3) {
 			dst[j+2] = (*src++);
 			dst[j+1] = (*src++);
 			dst[j+0] = (*src++);
 		}
 		break;
 	case 32:
-		for (int j = 0; j < (*ctx)->rowsize; j+=4) {
+		for (int j = 0; j < (*ctx)->info.width*4; j+=4) {
 			dst[j+3] = (*src++);
 			dst[j+2] = (*src++);
 			dst[j+1] = (*src++);
@@ -373,92 +1094,138 @@ bool bmp_put_row(BMP_CONTEXT ** ctx, uint8 * buf, uint32 len) {
 		}
 		break;
 	}
-	if (fwrite((*ctx)->scanline, (*ctx)->rowsize, 1, (*ctx)->fp) != 1)
+	if (!(*ctx)->map &&
+		fwrite((*ctx)->scanline, (*ctx)->rowsize, 1, (*ctx)->fp) != 1)
 		return false;
+	stats_write((*ctx)->rowsize);
+	stats_stop(STATS_ENCODE, start);
 	return true;
 }
 
 bool bmp_get_header_block(BMP_CONTEXT ** ctx) {
+	uint8	buf[BMP_HEADER_SIZE];
+
 	/* avoid structure alignment on modern C compilers,
-	   read single field each time */
-	if (fread(&(*ctx)->hdr.signature, 2, 1, (*ctx)->fp) != 1) return false;
-	if (fread(&(*ctx)->hdr.size,      4, 1, (*ctx)->fp) != 1) return false;
-	if (fread(&(*ctx)->hdr.reserved1, 2, 1, (*ctx)->fp) != 1) return false;
-	if (fread(&(*ctx)->hdr.reserved2, 2, 1, (*ctx)->fp) != 1) return false;
-	if (fread(&(*ctx)->hdr.offset,    4, 1, (*ctx)->fp) != 1) return false;
+	   read the whole block at once and decode it field by field */
+	if (fread(buf, BMP_HEADER_SIZE, 1, (*ctx)->fp) != 1) return false;
+
+	(*ctx)->hdr.signature = bmp_get16(buf + 0);
+	(*ctx)->hdr.size      = bmp_get32(buf + 2);
+	(*ctx)->hdr.reserved1 = bmp_get16(buf + 6);
+	(*ctx)->hdr.reserved2 = bmp_get16(buf + 8);
+	(*ctx)->hdr.offset    = bmp_get32(buf + 10);
 
 	return true;
 }
 
 bool bmp_put_header_block(BMP_CONTEXT ** ctx) {
+	uint8	buf[BMP_HEADER_SIZE];
+
 	/* avoid structure alignment on modern C compilers,
-	   write single field each time */
-	if (fwrite(&(*ctx)->hdr.signature, 2, 1, (*ctx)->fp) != 1) return false;
-	if (fwrite(&(*ctx)->hdr.size,      4, 1, (*ctx)->fp) != 1) return false;
-	if (fwrite(&(*ctx)->hdr.reserved1, 2, 1, (*ctx)->fp) != 1) return false;
-	if (fwrite(&(*ctx)->hdr.reserved2, 2, 1, (*ctx)->fp) != 1) return false;
-	if (fwrite(&(*ctx)->hdr.offset,    4, 1, (*ctx)->fp) != 1) return false;
+	   encode field by field and write the whole block at once */
+	bmp_set16(buf + 0,  (*ctx)->hdr.signature);
+	bmp_set32(buf + 2,  (*ctx)->hdr.size);
+	bmp_set16(buf + 6,  (*ctx)->hdr.reserved1);
+	bmp_set16(buf + 8,  (*ctx)->hdr.reserved2);
+	bmp_set32(buf + 10, (*ctx)->hdr.offset);
+
+	if ((*ctx)->map) {
+		memcpy((*ctx)->map, buf, BMP_HEADER_SIZE);
+		return true;
+	}
+	if (fwrite(buf, BMP_HEADER_SIZE, 1, (*ctx)->fp) != 1) return false;
 
 	return true;
 }
 
 bool bmp_get_info_block(BMP_CONTEXT ** ctx) {
-	/* read the bitmap information block, field by field */
-	if (fread(&(*ctx)->info.size,         4, 1, (*ctx)->fp) != 1) return false;
-	if (fread(&(*ctx)->info.width,        4, 1, (*ctx)->fp) != 1) return false;
-	if (fread(&(*ctx)->info.height,       4, 1, (*ctx)->fp) != 1) return false;
-	if (fread(&(*ctx)->info.planes,       2, 1, (*ctx)->fp) != 1) return false;
-	if (fread(&(*ctx)->info.bitcount,     2, 1, (*ctx)->fp) != 1) return false;
-	if (fread(&(*ctx)->info.compress,     4, 1, (*ctx)->fp) != 1) return false;
-	if (fread(&(*ctx)->info.imagesize,    4, 1, (*ctx)->fp) != 1) return false;
-	if (fread(&(*ctx)->info.xppm,         4, 1, (*ctx)->fp) != 1) return false;
-	if (fread(&(*ctx)->info.yppm,         4, 1, (*ctx)->fp) != 1) return false;
-	if (fread(&(*ctx)->info.clrused,      4, 1, (*ctx)->fp) != 1) return false;
-	if (fread(&(*ctx)->info.clrimp,       4, 1, (*ctx)->fp) != 1) return false;
+	uint8	buf[BMP_INFO_HEADER_V3_SIZE];
+
+	/* read the bitmap information block in one go */
+	if (fread(buf, BMP_INFO_HEADER_V3_SIZE, 1, (*ctx)->fp) != 1) return false;
+	bmp_decode_info(&(*ctx)->info, buf);
+	if ((*ctx)->info.size < BMP_INFO_HEADER_V3_SIZE) return false;
 
 	/* read the V4.0 header */
 	if ((*ctx)->info.size > BMP_INFO_HEADER_V3_SIZE) {
-		if (fread(&(*ctx)->info.maskr,  4, 1, (*ctx)->fp) != 1) return false;
-		if (fread(&(*ctx)->info.maskg,  4, 1, (*ctx)->fp) != 1) return false;
-		if (fread(&(*ctx)->info.maskb,  4, 1, (*ctx)->fp) != 1) return false;
-
-		/* detect the bitfield formats for both 16 and 32-bit images */
-		switch ((*ctx)->info.maskr) {
-		case 0x7800    : (*ctx)->fields = BMPBF_R5G6B5;   break;
-		case 0x7c00    : (*ctx)->fields = BMPBF_A1R5G5B5; break;
-		case 0x0f00    : (*ctx)->fields = BMPBF_A4R4G4B4; break;
-		case 0xff000000: (*ctx)->fields = BMPBF_A8R8G8B8; break;
-		}
+		if (fread(buf, 12, 1, (*ctx)->fp) != 1) return false;
+		bmp_decode_masks(*ctx, buf);
 	}
 
 	return true;
 }
 
 bool bmp_put_info_block(BMP_CONTEXT ** ctx) {
+	uint8	buf[BMP_INFO_HEADER_V3_SIZE + 256 * sizeof(rgba_t)];
+	uint32	len = BMP_INFO_HEADER_V3_SIZE;
+
 	/* store the bitmap information block, field by field */
-	if (fwrite(&(*ctx)->info.size,         4, 1, (*ctx)->fp) != 1) return false;
-	if (fwrite(&(*ctx)->info.width,        4, 1, (*ctx)->fp) != 1) return false;
-	if (fwrite(&(*ctx)->info.height,       4, 1, (*ctx)->fp) != 1) return false;
-	if (fwrite(&(*ctx)->info.planes,       2, 1, (*ctx)->fp) != 1) return false;
-	if (fwrite(&(*ctx)->info.bitcount,     2, 1, (*ctx)->fp) != 1) return false;
-	if (fwrite(&(*ctx)->info.compress,     4, 1, (*ctx)->fp) != 1) return false;
-	if (fwrite(&(*ctx)->info.imagesize,    4, 1, (*ctx)->fp) != 1) return false;
-	if (fwrite(&(*ctx)->info.xppm,         4, 1, (*ctx)->fp) != 1) return false;
-	if (fwrite(&(*ctx)->info.yppm,         4, 1, (*ctx)->fp) != 1) return false;
-	if (fwrite(&(*ctx)->info.clrused,      4, 1, (*ctx)->fp) != 1) return false;
-	if (fwrite(&(*ctx)->info.clrimp,       4, 1, (*ctx)->fp) != 1) return false;
-
-	/* store the color palette */
+	bmp_set32(buf +  0, (*ctx)->info.size);
+	bmp_set32(buf +  4, (*ctx)->info.width);
+	bmp_set32(buf +  8, (*ctx)->info.height);
+	bmp_set16(buf + 12, (*ctx)->info.planes);
+	bmp_set16(buf + 14, (*ctx)->info.bitcount);
+	bmp_set32(buf + 16, (*ctx)->info.compress);
+	bmp_set32(buf + 20, (*ctx)->info.imagesize);
+	bmp_set32(buf + 24, (*ctx)->info.xppm);
+	bmp_set32(buf + 28, (*ctx)->info.yppm);
+	bmp_set32(buf + 32, (*ctx)->info.clrused);
+	bmp_set32(buf + 36, (*ctx)->info.clrimp);
+
+	/* followed by the color palette */
 	if ((*ctx)->info.bitcount <= 8) {
-		if(fwrite(	(*ctx)->palette,
-					(1 << (*ctx)->info.bitcount) * 4, 1,
-					(*ctx)->fp) != 1)
-			return false;
+		memcpy(buf + len, (*ctx)->palette,
+			   (1 << (*ctx)->info.bitcount) * sizeof(rgba_t));
+		len += (1 << (*ctx)->info.bitcount) * sizeof(rgba_t);
+	}
+
+	if ((*ctx)->map) {
+		memcpy((*ctx)->map + BMP_HEADER_SIZE, buf, len);
+		return true;
 	}
+	if (fwrite(buf, len, 1, (*ctx)->fp) != 1) return false;
 
 	return true;
 }
 
+/*	bmp_put_palette(): Rewrite the color palette of a file being written,
+ *	so streaming writers can emit the header before the CLUT is known. The
+ *	file position is left at the end of the file.
+ *
+ *	Params:
+ *		ctx: context created by bmp_create() with the header already written
+ *		pal: (1 << bitcount) palette entries in R, G, B order
+ *	Returns:
+ *		true on success
+ *		false if error
+ */
+bool bmp_put_palette(BMP_CONTEXT ** ctx, const rgb_t * pal) {
+	uint32	colors;
+
+	if ((*ctx)->info.bitcount > 8)
+		return false;
+
+	colors = 1 << (*ctx)->info.bitcount;
+	for (int i = 0; i < colors; i++) {
+		(*ctx)->palette[i].r = pal[i].b;
+		(*ctx)->palette[i].g = pal[i].g;
+		(*ctx)->palette[i].b = pal[i].r;
+		(*ctx)->palette[i].a = 0;
+	}
+
+	if ((*ctx)->map) {
+		memcpy((*ctx)->map + BMP_HEADER_SIZE + (*ctx)->info.size,
+			   (*ctx)->palette, colors * sizeof(rgba_t));
+		return true;
+	}
+
+	if (fseek((*ctx)->fp, BMP_HEADER_SIZE + (*ctx)->info.size, SEEK_SET))
+		return false;
+	if (fwrite((*ctx)->palette, colors * sizeof(rgba_t), 1, (*ctx)->fp) != 1)
+		return false;
+	return !fseek((*ctx)->fp, 0, SEEK_END);
+}
+
 bool bmp_setup_header(BMP_CONTEXT ** ctx, const bitmap * bmp) {
 	(*ctx)->info.size		= BMP_INFO_HEADER_V3_SIZE;
 	(*ctx)->info.width		= (*bmp)->width;
@@ -474,8 +1241,11 @@ bool bmp_setup_header(BMP_CONTEXT ** ctx, const bitmap * bmp) {
 	default: break;
 	}
 
+	/* stored scanlines are padded to 4 bytes */
+	(*ctx)->rowsize = (((*ctx)->info.width * (*ctx)->info.bitcount+31)/32)*4;
+
 	(*ctx)->info.compress	= 0;
-	(*ctx)->info.imagesize	= (*bmp)->height * bitmap_row_size(bmp);
+	(*ctx)->info.imagesize	= (*bmp)->height * (*ctx)->rowsize;
 	(*ctx)->info.xppm		= 2835;
 	(*ctx)->info.yppm		= 2835;
 	(*ctx)->info.clrused	= (1 << (*ctx)->info.bitcount);
@@ -485,7 +1255,7 @@ bool bmp_setup_header(BMP_CONTEXT ** ctx, const bitmap * bmp) {
 	(*ctx)->hdr.reserved1	= 0;
 	(*ctx)->hdr.reserved2	= 0;
 	(*ctx)->hdr.offset		= BMP_HEADER_SIZE + BMP_INFO_HEADER_V3_SIZE;
-	(*ctx)->hdr.size		= (*bmp)->height * bitmap_row_size(bmp) +
+	(*ctx)->hdr.size		= (*bmp)->height * (*ctx)->rowsize +
 							  BMP_HEADER_SIZE +
 							  BMP_INFO_HEADER_V3_SIZE;
 
@@ -494,9 +1264,10 @@ bool bmp_setup_header(BMP_CONTEXT ** ctx, const bitmap * bmp) {
 			return false;
 
 		for (int i = 0; i < (1 << (*ctx)->info.bitcount); i++) {
-			(*ctx)->palette[i].r = (*bmp)->pal[i].r;
+			/* stored on disk in the B, G, R, A order */
+			(*ctx)->palette[i].r = (*bmp)->pal[i].b;
 			(*ctx)->palette[i].g = (*bmp)->pal[i].g;
-			(*ctx)->palette[i].b = (*bmp)->pal[i].b;
+			(*ctx)->palette[i].b = (*bmp)->pal[i].r;
 			(*ctx)->palette[i].a = 0;
 		}
 	}
@@ -512,9 +1283,8 @@ bool bmp_setup_header(BMP_CONTEXT ** ctx, const bitmap * bmp) {
 		break;
 	}
 
-	/* calculate the memory needed for each bitmap scanline */
-	(*ctx)->rowsize = (((*ctx)->info.width * (*ctx)->info.bitcount+31)/32)*4;
-	if (!((*ctx)->scanline = (uint8 *) malloc((*ctx)->rowsize))) {
+	/* allocate the scanline buffer */
+	if (!((*ctx)->scanline = (uint8 *) calloc((*ctx)->rowsize, 1))) {
 	    return false;
 	}
 
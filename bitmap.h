@@ -16,12 +16,20 @@ typedef	struct bmp_context {
 	uint32			rowsize;
 	uint8			* scanline;
 	FILE			* fp;
+	uint8			* map;		/* file mapping, NULL for stdio access */
+	uint32			mapsize;
+	uint32			row;		/* next scanline of a mapped file */
+	bool			memory;		/* map is caller memory, not a file */
 } BMP_CONTEXT;
 
 /* BMP API */
 BMP_CONTEXT * bmp_open(const char * filename);
 BMP_CONTEXT * bmp_create(const char * filename);
+BMP_CONTEXT * bmp_map(const char * filename);
+BMP_CONTEXT * bmp_map_create(const char * filename, const bitmap * bmp);
+BMP_CONTEXT * bmp_memory(const uint8 * data, uint32 size);
 void bmp_close(BMP_CONTEXT ** ctx);
+bool bmp_finish(BMP_CONTEXT ** ctx);
 
 bool bmp_setup_header(BMP_CONTEXT ** ctx, const bitmap * bmp);
 bool bmp_get_header_block(BMP_CONTEXT ** ctx);
@@ -30,6 +38,8 @@ bool bmp_get_info_block(BMP_CONTEXT ** ctx);
 bool bmp_put_info_block(BMP_CONTEXT ** ctx);
 bool bmp_get_row(BMP_CONTEXT ** ctx, uint8 * buf, uint32 len);
 bool bmp_put_row(BMP_CONTEXT ** ctx, uint8 * buf, uint32 len);
+bool bmp_put_palette(BMP_CONTEXT ** ctx, const rgb_t * pal);
+uint8 * bmp_map_row(BMP_CONTEXT ** ctx, uint32 row);
 
 #ifdef __cplusplus
 }
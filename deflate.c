@@ -0,0 +1,678 @@
+/* DEFLATE.C: zlib stream compressor, LZ77 over hash chains with fixed,
+   dynamic Huffman or stored blocks, whichever is the smallest */
+
+#include <stdlib.h>
+#include <string.h>
+#include "deflate.h"
+
+#define DEFLATE_WINDOW      (32768)     /* farthest match distance */
+#define DEFLATE_WMASK       (DEFLATE_WINDOW - 1)
+#define DEFLATE_HASH_BITS   (15)
+#define DEFLATE_HASH        (1 << DEFLATE_HASH_BITS)
+#define DEFLATE_MIN_MATCH   (3)
+#define DEFLATE_MAX_MATCH   (258)
+#define DEFLATE_BLOCK       (1 << 15)   /* symbols per block */
+#define DEFLATE_STORED      (65535)     /* bytes per stored block */
+#define DEFLATE_LITERALS    (288)       /* literal/length alphabet */
+#define DEFLATE_DISTANCES   (30)
+#define DEFLATE_LENGTHS     (19)        /* code length alphabet */
+
+/* match search effort of every level */
+static const struct {
+    uint16  chain;          /* candidates tried per position */
+    uint16  nice;           /* a match this long ends the search */
+    uint16  insert;         /* matches up to this long get the positions
+                               inside them hashed too */
+    bool    lazy;           /* look for a longer match one byte ahead */
+} deflate_levels[10] = {
+    {    0,   0,   0, false },
+    {    4,   8,   8, false },
+    {    8,  16, 258, false },
+    {   32,  32, 258, false },
+    {   32,  32, 258, true  },
+    {   64,  64, 258, true  },
+    {  128, 128, 258, true  },
+    {  256, 128, 258, true  },
+    { 1024, 258, 258, true  },
+    { 4096, 258, 258, true  }
+};
+
+static const uint16 deflate_len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8  deflate_len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16 deflate_dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577 };
+static const uint8  deflate_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8  deflate_order[DEFLATE_LENGTHS] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+/* Huffman code of one alphabet, codes are bit reversed for LSB first
+   output */
+typedef struct {
+    uint8   len[DEFLATE_LITERALS];
+    uint16  code[DEFLATE_LITERALS];
+} deflate_tree_t;
+
+typedef struct {
+    const uint8 * src;
+    uint32  length;
+    uint32  start;                      /* first byte of the current block */
+    int     level;
+
+    uint8   * out;                      /* compressed stream */
+    uint32  size, capacity;
+    bool    ok;
+    uint64  acc;                        /* pending bits */
+    uint32  count;
+
+    uint32  head[DEFLATE_HASH];         /* chain heads, position + 1 */
+    uint32  prev[DEFLATE_WINDOW];       /* older position of the same hash */
+
+    uint16  sym[DEFLATE_BLOCK];         /* literal, or match length */
+    uint16  dist[DEFLATE_BLOCK];        /* match distance, 0 for a literal */
+    uint32  symbols;
+    uint32  lfreq[DEFLATE_LITERALS];
+    uint32  dfreq[DEFLATE_DISTANCES];
+
+    uint8   lcode[DEFLATE_MAX_MATCH + 1];   /* length to its code - 257 */
+    uint8   dcode[512];                     /* distance - 1 to its code */
+    deflate_tree_t fixed_lit, fixed_dist;
+} deflate_t;
+
+/*----------------------------- BIT OUTPUT -----------------------------------*/
+
+/* makes room for [bytes] more output bytes */
+static bool deflate_reserve(deflate_t * d, uint32 bytes) {
+    uint64  need = (uint64) d->size + bytes + 16;
+
+    if (need > 0xFFFFFFFFu)
+        return d->ok = false;
+    if (need > d->capacity) {
+        uint64  cap = d->capacity + (d->capacity >> 1);
+        uint8   * grown;
+
+        if (cap < need)
+            cap = need;
+        if (cap > 0xFFFFFFFFu)
+            cap = 0xFFFFFFFFu;
+        if (!(grown = (uint8 *) realloc(d->out, cap)))
+            return d->ok = false;
+        d->out = grown;
+        d->capacity = cap;
+    }
+    return true;
+}
+
+/* appends [n] bits of [value], at most 16, room being reserved already */
+static void deflate_bits(deflate_t * d, uint32 value, uint32 n) {
+    d->acc |= (uint64) value << d->count;
+    d->count += n;
+    if (d->count >= 32) {
+        uint8   * p = d->out + d->size;
+
+        p[0] = d->acc;
+        p[1] = d->acc >> 8;
+        p[2] = d->acc >> 16;
+        p[3] = d->acc >> 24;
+        d->size += 4;
+        d->acc >>= 32;
+        d->count -= 32;
+    }
+}
+
+/* pads the pending bits with zeros up to a byte boundary */
+static void deflate_align(deflate_t * d) {
+    while (d->count) {
+        d->out[d->size++] = d->acc;
+        d->acc >>= 8;
+        d->count = d->count > 8 ? d->count - 8 : 0;
+    }
+    d->acc = 0;
+}
+
+/*----------------------------- HUFFMAN CODES --------------------------------*/
+
+static int deflate_compare(const void * a, const void * b) {
+    uint64  x = *(const uint64 *) a, y = *(const uint64 *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* code lengths of at most [limit] bits for the [n] symbols of [freq].
+   Huffman depths are computed with two queues over the sorted weights,
+   then too deep leaves are moved up, splitting shallower ones to keep the
+   code complete. */
+static void deflate_lengths(const uint32 * freq, uint32 n, uint32 limit,
+                            uint8 * len) {
+    uint64  leaf[DEFLATE_LITERALS];     /* frequency << 16 | symbol */
+    uint32  weight[2 * DEFLATE_LITERALS], parent[2 * DEFLATE_LITERALS];
+    uint32  count[DEFLATE_LITERALS + 1];
+    uint32  m = 0, top = 0;
+
+    memset(len, 0, n);
+    for (uint32 s = 0; s < n; s++)
+        if (freq[s])
+            leaf[m++] = (uint64) freq[s] << 16 | s;
+    if (m < 2) {
+        if (m)                          /* a lone symbol still takes a bit */
+            len[leaf[0] & 0xFFFF] = 1;
+        return;
+    }
+    qsort(leaf, m, sizeof(leaf[0]), deflate_compare);
+
+    /* leaves come in by weight, internal nodes are made in weight order */
+    uint32  next = 0, node = m;
+    for (uint32 i = 0; i < m; i++)
+        weight[i] = leaf[i] >> 16;
+    for (uint32 k = m; k < 2 * m - 1; k++) {
+        weight[k] = 0;
+        for (int pick = 0; pick < 2; pick++) {
+            uint32  i = next < m &&
+                        (node >= k || weight[next] <= weight[node]) ?
+                        next++ : node++;
+            weight[k] += weight[i];
+            parent[i] = k;
+        }
+    }
+
+    /* depths from the root down, reusing the weights */
+    memset(count, 0, sizeof(count));
+    weight[2 * m - 2] = 0;
+    for (int i = 2 * m - 3; i >= 0; i--) {
+        weight[i] = weight[parent[i]] + 1;
+        if (i < (int) m) {
+            count[weight[i]]++;
+            if (weight[i] > top)
+                top = weight[i];
+        }
+    }
+
+    if (top > limit) {
+        uint32  total = 0;
+
+        for (uint32 b = limit + 1; b <= top; b++) {
+            count[limit] += count[b];
+            count[b] = 0;
+        }
+        for (uint32 b = 1; b <= limit; b++)
+            total += count[b] << (limit - b);
+        for (; total > (1u << limit); total--) {
+            count[limit]--;
+            for (uint32 b = limit - 1; b; b--)
+                if (count[b]) {
+                    count[b]--;
+                    count[b + 1] += 2;
+                    break;
+                }
+        }
+        top = limit;
+    }
+
+    /* the rarest symbols get the longest codes */
+    for (uint32 b = top, i = 0; b; b--)
+        for (uint32 c = count[b]; c; c--)
+            len[leaf[i++] & 0xFFFF] = b;
+}
+
+/* canonical codes of the lengths in [tree] */
+static void deflate_codes(deflate_tree_t * tree, uint32 n) {
+    uint32  count[16] = { 0 }, next[16];
+    uint32  code = 0;
+
+    for (uint32 s = 0; s < n; s++)
+        count[tree->len[s]]++;
+    count[0] = 0;
+    for (uint32 b = 1; b < 16; b++) {
+        code = (code + count[b - 1]) << 1;
+        next[b] = code;
+    }
+    for (uint32 s = 0; s < n; s++) {
+        uint32  b = tree->len[s], v, r = 0;
+
+        if (!b)
+            continue;
+        for (v = next[b]++; b; b--, v >>= 1)
+            r = (r << 1) | (v & 1);
+        tree->code[s] = r;
+    }
+}
+
+/*------------------------------- BLOCKS -------------------------------------*/
+
+/* bits taken by the symbols of the block with the given codes */
+static uint64 deflate_cost(const deflate_t * d, const deflate_tree_t * lit,
+                           const deflate_tree_t * dist) {
+    uint64  bits = 0;
+
+    for (uint32 s = 0; s < 286; s++)
+        bits += (uint64) d->lfreq[s] * (lit->len[s] +
+                (s > 256 ? deflate_len_extra[s - 257] : 0));
+    for (uint32 s = 0; s < DEFLATE_DISTANCES; s++)
+        bits += (uint64) d->dfreq[s] * (dist->len[s] + deflate_dist_extra[s]);
+    return bits;
+}
+
+/* run-length codes of the lengths of both alphabets (RFC 1951 3.2.7),
+   symbol | repeat << 8 for every code length symbol */
+static uint32 deflate_runs(const uint8 * lens, uint32 n, uint16 * runs,
+                           uint32 * freq) {
+    uint32  count = 0;
+
+    memset(freq, 0, DEFLATE_LENGTHS * sizeof(uint32));
+    for (uint32 i = 0; i < n;) {
+        uint32  v = lens[i], r = 1;
+
+        while (i + r < n && lens[i + r] == v)
+            r++;
+        i += r;
+        if (!v)
+            while (r >= 3) {            /* zeros, 3 to 138 at once */
+                uint32  k = r > 138 ? 138 : r;
+                runs[count++] = (k >= 11 ? 18 : 17) | (k << 8);
+                freq[k >= 11 ? 18 : 17]++;
+                r -= k;
+            }
+        else {
+            runs[count++] = v;          /* the value, then repeats of it */
+            freq[v]++;
+            r--;
+            while (r >= 3) {
+                uint32  k = r > 6 ? 6 : r;
+                runs[count++] = 16 | (k << 8);
+                freq[16]++;
+                r -= k;
+            }
+        }
+        for (; r; r--) {
+            runs[count++] = v;
+            freq[v]++;
+        }
+    }
+    return count;
+}
+
+/* sends the symbols of the block with the given codes */
+static void deflate_symbols(deflate_t * d, const deflate_tree_t * lit,
+                            const deflate_tree_t * dist) {
+    for (uint32 i = 0; i < d->symbols; i++) {
+        uint32  s = d->sym[i];
+
+        if (!d->dist[i]) {
+            deflate_bits(d, lit->code[s], lit->len[s]);
+            continue;
+        }
+
+        uint32  c = d->lcode[s], v = d->dist[i] - 1;
+        deflate_bits(d, lit->code[257 + c], lit->len[257 + c]);
+        if (deflate_len_extra[c])
+            deflate_bits(d, s - deflate_len_base[c], deflate_len_extra[c]);
+        c = d->dcode[v < 256 ? v : 256 + (v >> 7)];
+        deflate_bits(d, dist->code[c], dist->len[c]);
+        if (deflate_dist_extra[c])
+            deflate_bits(d, v + 1 - deflate_dist_base[c],
+                         deflate_dist_extra[c]);
+    }
+    deflate_bits(d, lit->code[256], lit->len[256]);
+}
+
+/* copies [len] bytes from [src] as stored blocks */
+static void deflate_stored(deflate_t * d, const uint8 * src, uint32 len,
+                           bool final) {
+    if (!deflate_reserve(d, len + 5 * (len / DEFLATE_STORED + 1)))
+        return;
+    do {
+        uint32  n = len > DEFLATE_STORED ? DEFLATE_STORED : len;
+
+        deflate_bits(d, final && n == len, 3);
+        deflate_align(d);
+        d->out[d->size++] = n;
+        d->out[d->size++] = n >> 8;
+        d->out[d->size++] = ~n;
+        d->out[d->size++] = ~n >> 8;
+        memcpy(d->out + d->size, src, n);
+        d->size += n;
+        src += n;
+        len -= n;
+    } while (len);
+}
+
+/* sends the block of symbols gathered since [d->start], up to [end] */
+static void deflate_block(deflate_t * d, uint32 end, bool final) {
+    deflate_tree_t  lit, dist, cl;
+    uint8           lens[286 + DEFLATE_DISTANCES];
+    uint16          runs[286 + DEFLATE_DISTANCES];
+    uint32          clfreq[DEFLATE_LENGTHS];
+    uint32          hlit = 286, hdist = DEFLATE_DISTANCES;
+    uint32          hclen = DEFLATE_LENGTHS, nruns, used = 0;
+    uint64          dynamic, fixed, stored;
+
+    d->lfreq[256] = 1;                  /* end of block */
+    deflate_lengths(d->lfreq, 286, 15, lit.len);
+    deflate_lengths(d->dfreq, DEFLATE_DISTANCES, 15, dist.len);
+    while (!lit.len[hlit - 1])
+        hlit--;
+    while (hdist > 1 && !dist.len[hdist - 1])
+        hdist--;
+    if (!dist.len[0] && hdist == 1)
+        dist.len[0] = 1;                /* at least one distance code */
+
+    /* both code lengths sets, run-length coded with their own code */
+    memcpy(lens, lit.len, hlit);
+    memcpy(lens + hlit, dist.len, hdist);
+    nruns = deflate_runs(lens, hlit + hdist, runs, clfreq);
+    deflate_lengths(clfreq, DEFLATE_LENGTHS, 7, cl.len);
+    while (hclen > 4 && !cl.len[deflate_order[hclen - 1]])
+        hclen--;
+
+    dynamic = 3 + 5 + 5 + 4 + 3 * hclen + deflate_cost(d, &lit, &dist) +
+              clfreq[16] * 2 + clfreq[17] * 3 + clfreq[18] * 7;
+    for (uint32 s = 0; s < DEFLATE_LENGTHS; s++) {
+        dynamic += (uint64) clfreq[s] * cl.len[s];
+        used += clfreq[s] != 0;
+    }
+    if (used < 2)                       /* inflaters reject a 1-code set */
+        dynamic = ~(uint64) 0;
+    fixed = 3 + deflate_cost(d, &d->fixed_lit, &d->fixed_dist);
+    stored = end - d->start;
+    stored = (stored + 5 * (stored / DEFLATE_STORED + 1)) * 8 + 7;
+
+    if (stored <= fixed && stored <= dynamic)
+        deflate_stored(d, d->src + d->start, end - d->start, final);
+    else
+    if (deflate_reserve(d, (fixed < dynamic ? fixed : dynamic) / 8 + 1)) {
+        if (fixed <= dynamic) {
+            deflate_bits(d, final | 2, 3);
+            deflate_symbols(d, &d->fixed_lit, &d->fixed_dist);
+        }
+        else {
+            deflate_codes(&lit, hlit);
+            deflate_codes(&dist, hdist);
+            deflate_codes(&cl, DEFLATE_LENGTHS);
+            deflate_bits(d, final | 4, 3);
+            deflate_bits(d, hlit - 257, 5);
+            deflate_bits(d, hdist - 1, 5);
+            deflate_bits(d, hclen - 4, 4);
+            for (uint32 i = 0; i < hclen; i++)
+                deflate_bits(d, cl.len[deflate_order[i]], 3);
+            for (uint32 i = 0; i < nruns; i++) {
+                uint32  s = runs[i] & 0xFF, r = runs[i] >> 8;
+
+                deflate_bits(d, cl.code[s], cl.len[s]);
+                if (s == 16)
+                    deflate_bits(d, r - 3, 2);
+                else
+                if (s == 17)
+                    deflate_bits(d, r - 3, 3);
+                else
+                if (s == 18)
+                    deflate_bits(d, r - 11, 7);
+            }
+            deflate_symbols(d, &lit, &dist);
+        }
+    }
+
+    d->start = end;
+    d->symbols = 0;
+    memset(d->lfreq, 0, sizeof(d->lfreq));
+    memset(d->dfreq, 0, sizeof(d->dfreq));
+}
+
+/*--------------------------------- LZ77 -------------------------------------*/
+
+static inline uint32 deflate_hash(const uint8 * p) {
+    uint32  v = p[0] | p[1] << 8 | p[2] << 16;
+    return (v * 0x9E3779B1u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+/* links [pos] at the head of its chain, 3 bytes must follow */
+static inline void deflate_insert(deflate_t * d, uint32 pos) {
+    uint32  h = deflate_hash(d->src + pos);
+
+    d->prev[pos & DEFLATE_WMASK] = d->head[h];
+    d->head[h] = pos + 1;
+}
+
+/* length of the common prefix of [p] and [q], up to [limit] bytes. The
+   word loop may read up to 7 bytes past a mismatch, never past [limit]. */
+static inline uint32 deflate_common(const uint8 * p, const uint8 * q,
+                                    uint32 limit) {
+    uint32  n = 0;
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; n + 8 <= limit; n += 8) {
+        uint64  a, b;
+
+        memcpy(&a, p + n, 8);
+        memcpy(&b, q + n, 8);
+        if (a != b)
+            return n + (__builtin_ctzll(a ^ b) >> 3);
+    }
+#endif
+    while (n < limit && p[n] == q[n])
+        n++;
+    return n;
+}
+
+/* longest earlier match of the bytes at [pos] found along its chain, 0 if
+   none reaches the minimum length */
+static uint32 deflate_match(const deflate_t * d, uint32 pos, uint32 * dist) {
+    const uint8 * p = d->src + pos;
+    uint32  limit = d->length - pos, best = DEFLATE_MIN_MATCH - 1;
+    uint32  chain = deflate_levels[d->level].chain;
+    uint32  nice = deflate_levels[d->level].nice;
+    uint32  cand = d->head[deflate_hash(p)];
+
+    if (limit > DEFLATE_MAX_MATCH)
+        limit = DEFLATE_MAX_MATCH;
+    if (nice > limit)
+        nice = limit;
+    while (cand && chain--) {
+        const uint8 * q = d->src + cand - 1;
+        uint32  next;
+
+        if (pos - (cand - 1) > DEFLATE_WINDOW)
+            break;
+        /* the byte that would make it longer is the likeliest to differ */
+        if (q[best] == p[best] && q[0] == p[0] && q[1] == p[1]) {
+            uint32  n = deflate_common(p, q, limit);
+
+            if (n > best) {
+                best = n;
+                *dist = pos - (cand - 1);
+                if (n >= nice)
+                    break;
+            }
+        }
+        /* a slot reused by a newer position ends the chain */
+        if ((next = d->prev[(cand - 1) & DEFLATE_WMASK]) >= cand)
+            break;
+        cand = next;
+    }
+    return best >= DEFLATE_MIN_MATCH ? best : 0;
+}
+
+static inline void deflate_literal(deflate_t * d, uint32 pos) {
+    d->sym[d->symbols] = d->src[pos];
+    d->dist[d->symbols++] = 0;
+    d->lfreq[d->src[pos]]++;
+}
+
+static inline void deflate_copy(deflate_t * d, uint32 len, uint32 dist) {
+    uint32  v = dist - 1;
+
+    d->sym[d->symbols] = len;
+    d->dist[d->symbols++] = dist;
+    d->lfreq[257 + d->lcode[len]]++;
+    d->dfreq[d->dcode[v < 256 ? v : 256 + (v >> 7)]]++;
+}
+
+/* parses the whole input into blocks. Greedy levels take the longest
+   match at each position, lazy ones first check whether the next position
+   starts a longer one, and emit a literal if it does. */
+static void deflate_parse(deflate_t * d) {
+    bool    lazy = deflate_levels[d->level].lazy;
+    uint32  insert = deflate_levels[d->level].insert;
+    uint32  nice = deflate_levels[d->level].nice;
+    uint32  pos = 0, len, dist = 0, next = 0, ndist = 0;
+    bool    pending = false;
+
+    while (pos < d->length && d->ok) {
+        bool    hashed = d->length - pos >= DEFLATE_MIN_MATCH;
+
+        if (d->symbols >= DEFLATE_BLOCK)
+            deflate_block(d, pos, false);
+
+        if (pending) {                  /* searched by the previous step */
+            len = next;
+            dist = ndist;
+            pending = false;
+        }
+        else
+            len = hashed ? deflate_match(d, pos, &dist) : 0;
+        if (hashed)
+            deflate_insert(d, pos);
+
+        if (len && lazy && len < nice &&
+            d->length - pos > DEFLATE_MIN_MATCH &&
+            (next = deflate_match(d, pos + 1, &ndist)) > len) {
+            deflate_literal(d, pos++);
+            pending = true;
+            continue;
+        }
+
+        if (len) {
+            deflate_copy(d, len, dist);
+            if (len <= insert)
+                for (uint32 i = 1; i < len &&
+                     pos + i + DEFLATE_MIN_MATCH <= d->length; i++)
+                    deflate_insert(d, pos + i);
+            pos += len;
+        }
+        else
+            deflate_literal(d, pos++);
+    }
+    deflate_block(d, d->length, true);
+}
+
+/*------------------------------ CHECKSUMS -----------------------------------*/
+
+static uint32 deflate_adler32(const uint8 * p, uint32 len) {
+    uint32  a = 1, b = 0;
+
+    while (len) {
+        uint32  n = len < 5552 ? len : 5552;    /* b stays below 2^32 */
+
+        len -= n;
+        while (n--) {
+            a += *p++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+/*  deflate_crc32()
+*   CRC-32 of [len] bytes of [p] (ISO 3309 polynomial), continuing [crc]
+*/
+uint32 deflate_crc32(uint32 crc, const uint8 * p, uint32 len) {
+    uint32  table[256];
+
+    for (uint32 n = 0; n < 256; n++) {
+        uint32  c = n;
+
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        table[n] = c;
+    }
+    crc = ~crc;
+    while (len--)
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+/*  deflate_zlib()
+*   compresses [src] into a zlib stream: a 2-byte header, deflate blocks
+*   and the Adler-32 of the input. Level 1 only tries a few candidates per
+*   position and hashes match starts alone, level 9 walks long chains with
+*   lazy matching.
+*/
+uint32 deflate_zlib(const uint8 * src, uint32 len, int level,
+                    uint8 ** out, uint32 * capacity) {
+    deflate_t   * d;
+    uint32      size, adler, flags;
+
+    if (!out || !capacity || (!src && len))
+        return 0;
+    if (!(d = (deflate_t *) malloc(sizeof(deflate_t))))
+        return 0;
+
+    d->src = src;
+    d->length = len;
+    d->start = 0;
+    d->level = level < 0 ? DEFLATE_DEFAULT : level > 9 ? 9 : level;
+    d->out = *out;
+    d->capacity = *out ? *capacity : 0;
+    d->size = 0;
+    d->ok = true;
+    d->acc = 0;
+    d->count = 0;
+    d->symbols = 0;
+    memset(d->head, 0, sizeof(d->head));
+    memset(d->lfreq, 0, sizeof(d->lfreq));
+    memset(d->dfreq, 0, sizeof(d->dfreq));
+
+    /* lookup of length and distance codes */
+    for (uint32 c = 0; c < 28; c++)
+        for (uint32 k = 0; k < (1u << deflate_len_extra[c]); k++)
+            d->lcode[deflate_len_base[c] + k] = c;
+    d->lcode[DEFLATE_MAX_MATCH] = 28;
+    for (uint32 c = 0; c < DEFLATE_DISTANCES; c++)
+        for (uint32 k = 0; k < (1u << deflate_dist_extra[c]); k++) {
+            uint32  v = deflate_dist_base[c] - 1 + k;
+            d->dcode[v < 256 ? v : 256 + (v >> 7)] = c;
+        }
+
+    /* fixed codes (RFC 1951 3.2.6) */
+    for (uint32 s = 0; s < DEFLATE_LITERALS; s++)
+        d->fixed_lit.len[s] = s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8;
+    memset(d->fixed_dist.len, 5, DEFLATE_DISTANCES);
+    deflate_codes(&d->fixed_lit, DEFLATE_LITERALS);
+    deflate_codes(&d->fixed_dist, DEFLATE_DISTANCES);
+
+    /* header: 32K window, the level hint and the check bits */
+    flags = (d->level < 2 ? 0 : d->level < 6 ? 1 : d->level == 6 ? 2 : 3) << 6;
+    flags |= (31 - (0x7800 | flags) % 31) % 31;
+    if (deflate_reserve(d, 2)) {
+        d->out[d->size++] = 0x78;
+        d->out[d->size++] = flags;
+    }
+
+    if (d->ok) {
+        if (d->level == DEFLATE_STORE)
+            deflate_stored(d, src, len, true);
+        else
+            deflate_parse(d);
+    }
+
+    adler = deflate_adler32(src, len);
+    if (d->ok && deflate_reserve(d, 4)) {
+        deflate_align(d);
+        for (int i = 3; i >= 0; i--)
+            d->out[d->size++] = adler >> (8 * i);
+    }
+
+    *out = d->out;
+    *capacity = d->capacity;
+    size = d->ok ? d->size : 0;
+    free(d);
+    return size;
+}
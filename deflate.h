@@ -0,0 +1,29 @@
+#ifndef __DEFLATE_H__
+#define __DEFLATE_H__ (1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "image.h"
+
+/*--------------------------- DEFLATE COMPRESSION ----------------------------*/
+#define DEFLATE_STORE   (0)     /* no compression, stored blocks only */
+#define DEFLATE_FAST    (1)     /* greedy parsing, short hash chains */
+#define DEFLATE_DEFAULT (6)
+#define DEFLATE_BEST    (9)     /* lazy parsing, long hash chains */
+
+/* compresses [len] bytes of [src] into a zlib stream (RFC 1950, 1951) at
+   [level] 0 to 9. The stream goes to [*out], realloc'ed when [*capacity]
+   is too small. Returns its size, 0 on failure. */
+uint32  deflate_zlib(const uint8 * src, uint32 len, int level,
+                     uint8 ** out, uint32 * capacity);
+
+/* CRC-32 as used by PNG and gzip, pass 0 to start a new one */
+uint32  deflate_crc32(uint32 crc, const uint8 * p, uint32 len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,332 @@
+/* DITHER.C: error diffusion dithering with fixed-point kernels */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dither.h"
+#include "quantize.h"
+#include "thread.h"
+
+#define DIFFUSE_REACH   (2)     /* largest horizontal tap distance */
+#define DIFFUSE_TAPS    (10)
+
+/* wavefront scheduling: a row runs one chunk at a time and needs the row
+   above to be DIFFUSE_LAG pixels past the end of that chunk, so the two
+   rows never touch the same error cells */
+#define DIFFUSE_CHUNK   (64)
+#define DIFFUSE_LAG     (2 * DIFFUSE_REACH + 1)
+#define DIFFUSE_SPINS   (64)
+
+typedef struct {
+    int     dx, dy, w;
+} diffuse_tap_t;
+
+typedef struct {
+    const char      * name;
+    int             shift;          /* weights are in units of 1/2^shift */
+    int             rows;           /* rows spanned, current one included */
+    int             taps;
+    diffuse_tap_t   tap[DIFFUSE_TAPS];
+} diffuse_taps_t;
+
+static const diffuse_taps_t diffuseKernels[] = {
+    { "floyd",    4, 2, 4,
+      {{ 1, 0, 7}, {-1, 1, 3}, { 0, 1, 5}, { 1, 1, 1}} },
+    { "atkinson", 3, 3, 6,
+      {{ 1, 0, 1}, { 2, 0, 1}, {-1, 1, 1}, { 0, 1, 1}, { 1, 1, 1},
+       { 0, 2, 1}} },
+    { "sierra",   5, 3, 10,
+      {{ 1, 0, 5}, { 2, 0, 3}, {-2, 1, 2}, {-1, 1, 4}, { 0, 1, 5},
+       { 1, 1, 4}, { 2, 1, 2}, {-1, 2, 2}, { 0, 2, 3}, { 1, 2, 2}} }
+};
+
+/* per-row progress of a wavefront run, in pixels done */
+typedef struct {
+    diffuse_t       * d;
+    const bitmap    src;
+    bitmap          dst;
+    uint32          next;           /* next row to be claimed */
+    uint32          * progress;
+    remap_t         ** maps;        /* one per worker, NULL for the ramp */
+} wavefront_t;
+
+/* 3-3-2 ramp: nearest level of every channel value and its intensity */
+static uint8 rampLevel3[256], rampLevel2[256];
+static uint8 rampValue3[8], rampValue2[4];
+static int   rampState = 0;      /* 1 = being built, 2 = ready */
+
+/* builds the ramp once, images of a batch may get here concurrently */
+static void diffuse_ramp(void) {
+    if (thread_load(&rampState) == 2)
+        return;
+    if (!thread_cas(&rampState, 0, 1)) {
+        while (thread_load(&rampState) != 2)
+            thread_yield();
+        return;
+    }
+    for (int i = 0; i < 8; i++) rampValue3[i] = (i * 255 + 3) / 7;
+    for (int i = 0; i < 4; i++) rampValue2[i] = i * 85;
+    for (int v = 0; v < 256; v++) {
+        rampLevel3[v] = (v * 7 + 127) / 255;
+        rampLevel2[v] = (v * 3 + 127) / 255;
+    }
+    thread_store(&rampState, 2);
+}
+
+/*  diffuse_parse()
+*   looks up a kernel by name, "fs" is accepted for Floyd-Steinberg
+*/
+bool diffuse_parse(const char * name, diffuse_kernel_t * kernel) {
+    if (!strcmp(name, "fs")) {
+        *kernel = DIFFUSE_FLOYD;
+        return true;
+    }
+    for (int i = 0; i < sizeof(diffuseKernels) / sizeof(diffuseKernels[0]); i++)
+        if (!strcmp(name, diffuseKernels[i].name)) {
+            *kernel = (diffuse_kernel_t) i;
+            return true;
+        }
+    return false;
+}
+
+const char * diffuse_name(diffuse_kernel_t kernel) {
+    return diffuseKernels[kernel].name;
+}
+
+/*  diffuse_create()
+*   allocates the error rows for scanlines of [width] pixels
+*/
+diffuse_t * diffuse_create(diffuse_kernel_t kernel, uint32 width,
+                           bool serpentine) {
+    diffuse_t * d = (diffuse_t *) malloc(sizeof(diffuse_t));
+
+    if (!d) return NULL;
+
+    d->kernel     = kernel;
+    d->width      = width;
+    d->serpentine = serpentine;
+    d->stride     = width * 3;
+    d->y          = 0;
+    d->remap      = NULL;
+    d->err        = (int *) calloc(d->stride * diffuseKernels[kernel].rows,
+                                   sizeof(int));
+    if (!d->err) {
+        free(d);
+        return NULL;
+    }
+
+    diffuse_ramp();
+    return d;
+}
+
+void diffuse_destroy(diffuse_t ** d) {
+    if (*d) {
+        free((*d)->err);
+        free(*d);
+        *d = NULL;
+    }
+}
+
+/* waits until row [y] of a wavefront run has [need] pixels done */
+static void diffuse_wait(wavefront_t * wf, uint32 y, uint32 need) {
+    int spins = 0;
+    while (thread_load(&wf->progress[y]) < need)
+        if (++spins > DIFFUSE_SPINS) {
+            thread_yield();
+            spins = 0;
+        }
+}
+
+/* dithers scanline [y] with kernel [k] against [map], or the ramp when
+   NULL. Error cells are cleared as soon as they are consumed, so a row
+   slot is clean once its scanline is done. [wf] is NULL when running
+   serially. */
+static inline void diffuse_span(diffuse_t * d, const uint8 * src, uint8 * dst,
+                                uint32 y, const diffuse_taps_t * k,
+                                wavefront_t * wf, remap_t * map) {
+    const int   half = 1 << (k->shift - 1);
+    const int   dir = (d->serpentine && (y & 1)) ? -1 : 1;
+    const int   width = d->width;
+    int         off[DIFFUSE_TAPS], dxs[DIFFUSE_TAPS], w[DIFFUSE_TAPS];
+    int         * cur = d->err + (y % k->rows) * d->stride;
+
+    /* tap offsets relative to the current pixel, mirrored on odd rows */
+    for (int t = 0; t < k->taps; t++) {
+        dxs[t] = k->tap[t].dx * dir;
+        off[t] = ((y + k->tap[t].dy) % k->rows) * d->stride -
+                 (cur - d->err) + dxs[t] * 3;
+        w[t] = k->tap[t].w;
+    }
+
+    for (int n = 0; n < width; n++) {
+        int x = dir > 0 ? n : width - 1 - n;
+
+        /* wavefront: publish what is done, then wait for the row above */
+        if (wf && !(n % DIFFUSE_CHUNK)) {
+            thread_store(&wf->progress[y], n);
+            if (y) {
+                uint32 need = n + DIFFUSE_CHUNK + DIFFUSE_LAG;
+                diffuse_wait(wf, y - 1, need < width ? need : width);
+            }
+        }
+
+        int         * e = cur + x * 3;
+        const uint8 * s = src + x * 3;
+
+        /* add the error carried so far, rounded back to whole units */
+        int r = clamp(s[0] + ((e[0] + half) >> k->shift));
+        int g = clamp(s[1] + ((e[1] + half) >> k->shift));
+        int b = clamp(s[2] + ((e[2] + half) >> k->shift));
+        e[0] = e[1] = e[2] = 0;
+
+        int er, eg, eb;
+        if (map) {
+            int i = remap_index(map, r, g, b);
+            dst[x] = i;
+            er = r - map->pal[i].r;
+            eg = g - map->pal[i].g;
+            eb = b - map->pal[i].b;
+        }
+        else {
+            /* same index layout as the uniform quantizer */
+            int lr = rampLevel2[r], lg = rampLevel3[g], lb = rampLevel3[b];
+            dst[x] = (lb << 5) | (lg << 2) | lr;
+            er = r - rampValue2[lr];
+            eg = g - rampValue3[lg];
+            eb = b - rampValue3[lb];
+        }
+
+        /* only pixels near the borders need their taps clipped */
+        bool edge = n < DIFFUSE_REACH || n >= width - DIFFUSE_REACH;
+        for (int t = 0; t < k->taps; t++) {
+            if (edge && (unsigned) (x + dxs[t]) >= (unsigned) width)
+                continue;
+            int * p = e + off[t];
+            p[0] += er * w[t];
+            p[1] += eg * w[t];
+            p[2] += eb * w[t];
+        }
+    }
+
+    if (wf)
+        thread_store(&wf->progress[y], width);
+}
+
+/* dispatches scanline [y], constant kernels let the compiler unroll the
+   taps */
+static void diffuse_scanline(diffuse_t * d, const uint8 * src, uint8 * dst,
+                             uint32 y, wavefront_t * wf, remap_t * map) {
+    switch (d->kernel) {
+    case DIFFUSE_FLOYD:
+        diffuse_span(d, src, dst, y, &diffuseKernels[DIFFUSE_FLOYD], wf, map);
+        break;
+    case DIFFUSE_ATKINSON:
+        diffuse_span(d, src, dst, y, &diffuseKernels[DIFFUSE_ATKINSON], wf, map);
+        break;
+    case DIFFUSE_SIERRA:
+        diffuse_span(d, src, dst, y, &diffuseKernels[DIFFUSE_SIERRA], wf, map);
+        break;
+    }
+}
+
+/*  diffuse_row()
+*   dithers the next RGB24 scanline into indices of [d->remap], or of the
+*   3-3-2 ramp. Scanlines must be fed top-down; in serpentine mode odd rows
+*   run right to left.
+*/
+void diffuse_row(diffuse_t * d, const uint8 * src, uint8 * dst) {
+    diffuse_scanline(d, src, dst, d->y++, NULL, d->remap);
+}
+
+/* wavefront worker: claims rows in order, so every row it waits on has
+   been claimed by a thread that is already running */
+static void diffuse_worker(void * arg, int index) {
+    wavefront_t * wf = (wavefront_t *) arg;
+    uint32 y;
+
+    /* the remap cache fills on use, so each worker has its own */
+    remap_t * map = wf->maps ? wf->maps[index] : NULL;
+
+    while ((y = thread_fetch_add(&wf->next, 1)) < wf->src->height)
+        diffuse_scanline(wf->d, wf->src->data + y * wf->src->rowsize,
+                         wf->dst->data + y * wf->dst->rowsize, y, wf, map);
+}
+
+/*  diffuse_uniform_clut()
+*   generates the 3-3-2 ramp palette error diffusion quantizes against
+*/
+void diffuse_uniform_clut(rgb_t * pal) {
+    diffuse_ramp();
+    for (int i = 0; i < 256; i++) {
+        pal[i].r = rampValue2[i & 3];
+        pal[i].g = rampValue3[(i >> 2) & 7];
+        pal[i].b = rampValue3[i >> 5];
+    }
+}
+
+/* RGB quantization with error diffusion against the first [colors]
+   entries of [pal], or the 3-3-2 ramp when [pal] is NULL. Serpentine
+   scanning is inherently sequential; raster scanning runs rows as a
+   wavefront on [threads] threads (0 = every processor) with output
+   identical to a serial run. */
+bitmap quantize_diffuse(const bitmap bmp, diffuse_kernel_t kernel,
+                        bool serpentine, const rgb_t * pal, uint32 colors,
+                        int threads) {
+    if (!bmp) return NULL;
+    if (bmp->format != BMF_RGB24) return NULL;
+
+    /* create output indexed bitmap */
+    bitmap res = bitmap_create(bmp->width, bmp->height, BMF_INDEXED8, true);
+    if (!res) return NULL;
+
+    diffuse_t * d = diffuse_create(kernel, bmp->width, serpentine);
+    if (!d) {
+        bitmap_destroy(&res);
+        return NULL;
+    }
+
+    wavefront_t wf = { d, bmp, res, 0, NULL, NULL };
+    int count = serpentine ? 1 : thread_count(threads);
+    if (count > bmp->height)
+        count = bmp->height;
+
+    /* one remap context per worker */
+    bool ok = true;
+    if (pal) {
+        ok = (wf.maps = (remap_t **) calloc(count, sizeof(remap_t *))) != NULL;
+        for (int i = 0; ok && i < count; i++)
+            ok = (wf.maps[i] = remap_create(pal, colors)) != NULL;
+        if (ok)
+            d->remap = wf.maps[0];
+    }
+
+    if (!ok)
+        bitmap_destroy(&res);
+    else
+    if (count > 1 &&
+        (wf.progress = (uint32 *) calloc(bmp->height, sizeof(uint32)))) {
+        thread_parallel(count, diffuse_worker, &wf);
+        free(wf.progress);
+    }
+    else
+        for (int y = 0; y < bmp->height; y++)
+            diffuse_row(d, bmp->data + y * bmp->rowsize,
+                           res->data + y * res->rowsize);
+
+    if (wf.maps) {
+        for (int i = 0; i < count; i++)
+            remap_destroy(&wf.maps[i]);
+        free(wf.maps);
+    }
+    diffuse_destroy(&d);
+
+    if (res) {
+        if (pal) {
+            memset(res->pal, 0, 256 * sizeof(rgb_t));
+            memcpy(res->pal, pal, (colors < 256 ? colors : 256) * sizeof(rgb_t));
+        }
+        else
+            diffuse_uniform_clut(res->pal);
+    }
+    return res;
+}
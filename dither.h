@@ -0,0 +1,46 @@
+#ifndef __DITHER_H__
+#define __DITHER_H__ (1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "image.h"
+#include "remap.h"
+
+/*------------------------- ERROR DIFFUSION DITHERING ------------------------*/
+typedef enum {  DIFFUSE_FLOYD,      /* Floyd-Steinberg, 2 rows, 1/16 */
+                DIFFUSE_ATKINSON,   /* Atkinson, 3 rows, 6/8 of the error */
+                DIFFUSE_SIERRA      /* Sierra, 3 rows, 1/32 */
+            } diffuse_kernel_t;
+
+/* diffusion state: a ring of fixed-point error rows, one per kernel row */
+typedef struct diffuse_context {
+    diffuse_kernel_t    kernel;
+    uint32              width;
+    bool                serpentine; /* odd rows run right to left */
+    uint32              stride;     /* ints per error row */
+    uint32              y;          /* next scanline to be processed */
+    int                 * err;
+    remap_t             * remap;    /* palette to dither against, not owned,
+                                       NULL = 3-3-2 ramp */
+} diffuse_t;
+
+bool            diffuse_parse(const char * name, diffuse_kernel_t * kernel);
+const char *    diffuse_name(diffuse_kernel_t kernel);
+
+diffuse_t *     diffuse_create(diffuse_kernel_t kernel, uint32 width,
+                               bool serpentine);
+void            diffuse_destroy(diffuse_t ** d);
+void            diffuse_row(diffuse_t * d, const uint8 * src, uint8 * dst);
+void            diffuse_uniform_clut(rgb_t * pal);
+
+bitmap          quantize_diffuse(const bitmap bmp, diffuse_kernel_t kernel,
+                                 bool serpentine, const rgb_t * pal,
+                                 uint32 colors, int threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,166 @@
+/* GIF.C: GIF89a writer for 8-bit indexed bitmaps */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+#include "stats.h"
+
+#define GIF_CODES       (4096)          /* 12-bit LZW codes */
+#define GIF_HASH_BITS   (14)            /* the table is a quarter full at most */
+#define GIF_HASH        (1 << GIF_HASH_BITS)
+
+/* LZW state: the dictionary maps (prefix code, pixel) to a code through an
+   open addressed hash table, codes are packed LSB first into data
+   sub-blocks of up to 255 bytes */
+typedef struct {
+    FILE    * fp;
+    uint32  entry[GIF_HASH];    /* prefix << 20 | pixel << 12 | code, one
+                                   load per probe. Codes start above 5, so
+                                   0 marks a free slot. */
+    uint32  next;               /* next code to assign */
+    uint32  width;              /* bits per code */
+    uint32  depth;              /* minimum code size */
+    uint32  bits, count;        /* pending bits */
+    uint8   block[256];         /* size byte + data */
+    bool    ok;
+} gif_lzw_t;
+
+static void gif_flush(gif_lzw_t * z) {
+    if (z->block[0] && fwrite(z->block, z->block[0] + 1, 1, z->fp) != 1)
+        z->ok = false;
+    z->block[0] = 0;
+}
+
+static void gif_byte(gif_lzw_t * z, uint8 v) {
+    z->block[++z->block[0]] = v;
+    if (z->block[0] == 255)
+        gif_flush(z);
+}
+
+static void gif_put(gif_lzw_t * z, uint32 code) {
+    z->bits |= code << z->count;
+    z->count += z->width;
+    while (z->count >= 8) {
+        gif_byte(z, z->bits & 0xFF);
+        z->bits >>= 8;
+        z->count -= 8;
+    }
+}
+
+/* empties the dictionary, the clear code is sent by the caller */
+static void gif_reset(gif_lzw_t * z) {
+    memset(z->entry, 0, sizeof(z->entry));
+    z->next = (1 << z->depth) + 2;
+    z->width = z->depth + 1;
+}
+
+/* compresses the rows of [bmp] one after the other */
+static bool gif_compress(gif_lzw_t * z, const bitmap bmp) {
+    uint32  clear = 1 << z->depth, prefix = bmp->data[0];
+    bool    first = true;
+
+    gif_reset(z);
+    gif_put(z, clear);
+    for (uint32 y = 0; y < bmp->height; y++) {
+        const uint8 * row = bmp->data + y * bmp->rowsize;
+
+        for (uint32 x = first; x < bmp->width; x++) {
+            uint32  key = (prefix << 8 | row[x]) << 12;
+            uint32  h = (key * 0x9E3779B1u) >> (32 - GIF_HASH_BITS);
+            uint32  e;
+
+            while ((e = z->entry[h]) && (e & ~0xFFFu) != key)
+                h = (h + 1) & (GIF_HASH - 1);
+            if (e) {                /* known string, keep extending it */
+                prefix = e & 0xFFF;
+                continue;
+            }
+
+            gif_put(z, prefix);
+            if (z->next < GIF_CODES) {
+                if (z->next == (1u << z->width))
+                    z->width++;
+                z->entry[h] = key | z->next++;
+            }
+            else {                  /* dictionary full, start over */
+                gif_put(z, clear);
+                gif_reset(z);
+            }
+            prefix = row[x];
+        }
+        first = false;
+    }
+    gif_put(z, prefix);
+    gif_put(z, clear + 1);          /* end of information */
+    if (z->count)
+        gif_byte(z, z->bits);       /* the last byte, zero padded */
+    gif_flush(z);
+    return z->ok;
+}
+
+/*  gif_save()
+*   GIF89a easy writer for BMF_INDEXED8 bitmaps. The color table is cut to
+*   the smallest power of 2 holding every index used, and pixels are LZW
+*   compressed row by row straight from the bitmap.
+*/
+bool gif_save(const char * filename, const bitmap * bmp) {
+    gif_lzw_t   * z;
+    uint8       head[13 + 768 + 11], * p = head;
+    uint32      top = 0, bits = 1;
+    bool        ok;
+    double      start = stats_start();
+
+    if (!bmp || !(*bmp) || (*bmp)->format != BMF_INDEXED8 || !(*bmp)->pal ||
+        (*bmp)->width > 0xFFFF || (*bmp)->height > 0xFFFF ||
+        !(*bmp)->width || !(*bmp)->height)
+        return false;
+
+    /* the widest index used sets the table size */
+    bitmap  b = *bmp;
+    for (uint32 i = 0; i < b->size; i++)
+        top |= b->data[i];
+    while ((1u << bits) <= top)
+        bits++;
+
+    /* header, logical screen with the global color table */
+    memcpy(p, "GIF89a", 6);
+    p[6] = b->width & 0xFF;  p[7] = b->width >> 8;
+    p[8] = b->height & 0xFF; p[9] = b->height >> 8;
+    p[10] = 0xF0 | (bits - 1);      /* table present, 8-bit primaries */
+    p[11] = 0;                      /* background */
+    p[12] = 0;                      /* square pixels */
+    p += 13;
+    memcpy(p, b->pal, 3 << bits);   /* R, G, B entries as stored */
+    p += 3 << bits;
+
+    /* image descriptor covering the screen, no local table */
+    *p++ = ',';
+    memset(p, 0, 4);
+    p[4] = b->width & 0xFF;  p[5] = b->width >> 8;
+    p[6] = b->height & 0xFF; p[7] = b->height >> 8;
+    p[8] = 0;
+    p += 9;
+    *p++ = bits < 2 ? 2 : bits;     /* LZW minimum code size */
+
+    if (!(z = (gif_lzw_t *) malloc(sizeof(gif_lzw_t))))
+        return false;
+    if (!(z->fp = fopen(filename, "wb"))) {
+        free(z);
+        return false;
+    }
+    z->depth = bits < 2 ? 2 : bits;
+    z->bits = z->count = 0;
+    z->block[0] = 0;
+    z->ok = fwrite(head, p - head, 1, z->fp) == 1;
+
+    /* data sub-blocks, their terminator and the trailer */
+    ok = z->ok && gif_compress(z, b) && fwrite("\0;", 2, 1, z->fp) == 1;
+    if (ok)
+        stats_write(ftell(z->fp));
+    if (fclose(z->fp))
+        ok = false;
+    free(z);
+    stats_stop(STATS_ENCODE, start);
+    return ok;
+}
@@ -1,15 +1,36 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
 #include "image.h"
+#include "stats.h"
+
+/* bytes per scanline of a [width] pixels wide bitmap in [format] */
+static uint64 bitmap_line(uint32 width, bitmap_format_t format) {
+    switch (format) {
+    case BMF_BINARY:    return ((uint64) width+7)/8;
+    case BMF_INDEXED2:  return ((uint64) width+3)/4;
+    case BMF_INDEXED4:  return ((uint64) width+1)/2;
+    case BMF_INDEXED8:  return width;
+    case BMF_RGB24:     return (uint64) width*3;
+    case BMF_RGB32:     return (uint64) width*4;
+    }
+    return width;
+}
 
 /*  bitmap_create()
 *   creates a bitmap on memory and return its handle
 */
 bitmap bitmap_create(uint32 width, uint32 height, bitmap_format_t format, bool hasPal) {
-    bitmap  bmp = (bitmap) malloc(sizeof(bitmap_t));    /* allocates bitmap handle */
-    uint32  linew = width;
+    bitmap  bmp;
 
+    /* sizes are kept in 32 bits */
+    if ((uint64) height * bitmap_line(width, format) > 0xFFFFFFFFu)
+        return NULL;
+    bmp = (bitmap) malloc(sizeof(bitmap_t));    /* allocates bitmap handle */
     if (!bmp) return NULL;  /* not enough memory ? */
+    stats_alloc(sizeof(bitmap_t));
 
     bmp->format = format;   /* update the bitmap format */
     bmp->width = width;     /* update the bitmap's width in pixels */
@@ -22,37 +43,86 @@ bitmap bitmap_create(uint32 width, uint32 height, bitmap_format_t format, bool h
             free(bmp);      /* releases the bitmap handle */
             return NULL;    /* and returns nothing */
         }
+        stats_alloc(768);
     }
     else
         bmp->pal = NULL;    /* no color palette requested */
 
     /* calculates the correct bitmap storage size and the width of each
        scanline */
-    switch (format) {
-    case BMF_BINARY:    linew = (linew+7)/8; break;
-    case BMF_INDEXED2:  linew = (linew+3)/4; break;
-    case BMF_INDEXED4:  linew = (linew+1)/2; break;
-    case BMF_INDEXED8:  break;  /* nothing to do here, it's already there */
-    case BMF_RGB24:     linew *= 3; break;
-    case BMF_RGB32:     linew *= 4; break;
-    }
-    bmp->size = height * linew;   /* update the correct size */
-    bmp->rowsize = linew;
+    bmp->rowsize = bitmap_line(width, format);
+    bmp->size = height * bmp->rowsize;  /* update the correct size */
+    bmp->capacity = bmp->size;
 
     /* allocates the bitmap bits */
     bmp->data = (uint8 *) malloc(bmp->size);
-    if (!bmp) {          /* not enough memory */
+    if (!bmp->data) {       /* not enough memory */
         /* releases the color palette if present */
         if (bmp->pal)
             free(bmp->pal);
+        free(bmp);
         /* and returns nothing */
         return NULL;
     }
+    stats_alloc(bmp->size);
 
     /* everything is ok for now, return the created bitmap */
     return  bmp;
 }
 
+/*  bitmap_recreate()
+*   reshapes the bitmap [bmp] in place, keeping its memory whenever it is
+*   large enough, so repeated images of similar size allocate nothing.
+*   Creates the bitmap when [bmp] is NULL. On failure the bitmap is
+*   destroyed and NULL is returned.
+*/
+bitmap bitmap_recreate(bitmap * bmp, uint32 width, uint32 height,
+                       bitmap_format_t format, bool hasPal) {
+    if (!(*bmp))
+        return (*bmp) = bitmap_create(width, height, format, hasPal);
+
+    uint32  linew;
+
+    /* sizes are kept in 32 bits */
+    if ((uint64) height * bitmap_line(width, format) > 0xFFFFFFFFu) {
+        bitmap_destroy(bmp);
+        return NULL;
+    }
+    linew = bitmap_line(width, format);
+
+    /* grows the bitmap bits, the old contents need not survive */
+    if (height * linew > (*bmp)->capacity) {
+        free((*bmp)->data);
+        (*bmp)->capacity = height * linew;
+        if (!((*bmp)->data = (uint8 *) malloc((*bmp)->capacity))) {
+            bitmap_destroy(bmp);
+            return NULL;
+        }
+        stats_alloc((*bmp)->capacity);
+    }
+
+    /* adds or drops the color palette */
+    if (hasPal && !(*bmp)->pal) {
+        if (!((*bmp)->pal = (rgb_t *) malloc(768))) {
+            bitmap_destroy(bmp);
+            return NULL;
+        }
+        stats_alloc(768);
+    }
+    else
+    if (!hasPal && (*bmp)->pal) {
+        free((*bmp)->pal);
+        (*bmp)->pal = NULL;
+    }
+
+    (*bmp)->format = format;
+    (*bmp)->width = width;
+    (*bmp)->height = height;
+    (*bmp)->rowsize = linew;
+    (*bmp)->size = height * linew;
+    return (*bmp);
+}
+
 /*  bitmap_destroy()
 *   destroys a bitmap and releases all it occuppied memory
 */
@@ -83,3 +153,228 @@ uint32 bitmap_row_size(const bitmap * bmp) {
 bool bitmap_has_pal(const bitmap * bmp) {
     return ((*bmp)->pal != NULL);
 }
+
+/*------------------------- EASY LOADERS/WRITERS -----------------------------*/
+
+/* header field access, the formats disagree on byte order */
+static uint32 image_le16(const uint8 * p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32 image_le32(const uint8 * p) {
+    return (uint32) p[0] | ((uint32) p[1] << 8) |
+           ((uint32) p[2] << 16) | ((uint32) p[3] << 24);
+}
+
+static uint32 image_be16(const uint8 * p) {
+    return (p[0] << 8) | p[1];
+}
+
+static uint32 image_be32(const uint8 * p) {
+    return ((uint32) p[0] << 24) | ((uint32) p[1] << 16) |
+           ((uint32) p[2] << 8) | (uint32) p[3];
+}
+
+/* reads the first bytes of a file in a single call, returns their count */
+static uint32 image_probe(const char * filename, uint8 * buf) {
+    FILE    * fp = fopen(filename, "rb");
+    size_t  len;
+
+    if (!fp) return 0;
+    len = fread(buf, 1, IMAGE_PROBE_SIZE, fp);
+    fclose(fp);
+    return (uint32) len;
+}
+
+/* recognizes a format from its signature */
+static bitmap_type_t image_signature(const uint8 * p, uint32 len) {
+    if (len >= 2 && p[0] == 'B' && p[1] == 'M')
+        return BFM_BMP;
+    if (len >= 8 && !memcmp(p, "\x89PNG\r\n\x1a\n", 8))
+        return BFM_PNG;
+    if (len >= 6 && (!memcmp(p, "GIF87a", 6) || !memcmp(p, "GIF89a", 6)))
+        return BFM_GIF;
+    if (len >= 4 && (!memcmp(p, "II*\0", 4) || !memcmp(p, "MM\0*", 4)))
+        return BFM_TIF;
+    if (len >= 2 && image_be16(p) == 474)
+        return BFM_SGI;
+    if (len >= 3 && p[0] == 0x0A && p[1] <= 5 && p[2] <= 1)
+        return BFM_PCX;
+    if (len >= 3 && p[0] == 'P' && p[1] >= '1' && p[1] <= '6' && isspace(p[2]))
+        return BFM_PNM;
+    return BFM_UNKNOWN;
+}
+
+/* decodes the dimensions from the probed header bytes */
+static bool image_header(const uint8 * p, uint32 len, bitmap_info_t * info) {
+    memset(info, 0, sizeof(*info));
+    info->type = image_signature(p, len);
+    info->compress = BCF_NONE;
+
+    switch (info->type) {
+    case BFM_BMP: {
+        uint32  size;
+        int32_t height;
+
+        if (len < 26) return false;
+        size = image_le32(p + 14);
+        if (size == 12) {           /* OS/2 core header, 16-bit fields */
+            info->version = 2;
+            info->width = image_le16(p + 18);
+            info->height = image_le16(p + 20);
+            info->bitcount = image_le16(p + 24);
+            return true;
+        }
+        if (size < 40 || len < 34) return false;
+        info->version = size >= 124 ? 5 : size >= 108 ? 4 : 3;
+        info->width = image_le32(p + 18);
+        height = (int32_t) image_le32(p + 22);
+        info->height = height < 0 ? -height : height;   /* top-down rows */
+        info->bitcount = image_le16(p + 28);
+        if (image_le32(p + 30) == 1 || image_le32(p + 30) == 2)
+            info->compress = BCF_RLE;
+        return true;
+    }
+    case BFM_PNG: {
+        /* IHDR always comes first: channels and allowed bit depths (bit n
+           set for depth n) per color type, types 1 and 5 do not exist */
+        static const uint8 channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+        static const uint32 depths[7] = { 0x10116, 0, 0x10100, 0x116,
+                                          0x10100, 0, 0x10100 };
+
+        if (len < 26 || memcmp(p + 12, "IHDR", 4) || p[25] > 6 ||
+            p[24] > 16 || !(depths[p[25]] >> p[24] & 1)) return false;
+        info->width = image_be32(p + 16);
+        info->height = image_be32(p + 20);
+        info->bitcount = p[24] * channels[p[25]];
+        info->compress = BCF_DEFLATE;
+        return true;
+    }
+    case BFM_GIF:
+        if (len < 11) return false;
+        info->version = p[4] == '9' ? 89 : 87;
+        info->width = image_le16(p + 6);
+        info->height = image_le16(p + 8);
+        info->bitcount = (p[10] & 0x80) ? (p[10] & 7) + 1 : 8;
+        info->compress = BCF_LZW;
+        return true;
+    case BFM_SGI:
+        if (len < 12) return false;
+        info->compress = p[2] ? BCF_RLE : BCF_NONE;
+        info->width = image_be16(p + 6);
+        info->height = image_be16(p + 8);
+        info->bitcount = p[3] * 8 * (image_be16(p + 4) < 3 ? 1 : image_be16(p + 10));
+        return true;
+    case BFM_PCX:
+        if (len < 66) return false;
+        info->version = p[1];
+        info->width = image_le16(p + 8) - image_le16(p + 4) + 1;
+        info->height = image_le16(p + 10) - image_le16(p + 6) + 1;
+        info->bitcount = p[3] * p[65];
+        info->compress = p[2] ? BCF_RLE : BCF_NONE;
+        return true;
+    case BFM_PNM: {
+        PNM_HEADER  hdr;
+
+        if (!pnm_parse(p, len, &hdr)) return false;
+        info->version = hdr.type + 1;
+        info->width = hdr.width;
+        info->height = hdr.height;
+        info->bitcount = hdr.bitcount;
+        return true;
+    }
+    default:                        /* TIFF keeps its sizes in the IFD */
+        return false;
+    }
+}
+
+/*  image_detect()
+*   recognizes the format of an image file from its first bytes
+*/
+bitmap_type_t image_detect(const char * filename) {
+    uint8   buf[IMAGE_PROBE_SIZE];
+    uint32  len = image_probe(filename, buf);
+
+    return image_signature(buf, len);
+}
+
+/*  image_info()
+*   reads the format, dimensions and depth of an image file from its header
+*   alone, without decoding any pixel. False for unknown formats and
+*   truncated headers.
+*/
+bool image_info(const char * filename, bitmap_info_t * info) {
+    uint8   buf[IMAGE_PROBE_SIZE];
+    uint32  len = image_probe(filename, buf);
+
+    return image_header(buf, len, info);
+}
+
+/*  image_load()
+*   loads an image file in any supported format
+*/
+bitmap image_load(const char * filename) {
+    switch (image_detect(filename)) {
+    case BFM_BMP:   return bmp_load(filename);
+    case BFM_PNM:   return pnm_load(filename);
+    default:        return NULL;
+    }
+}
+
+/*  image_reload()
+*   loads an image file in any supported format into an existing bitmap,
+*   whose memory is reused when large enough
+*/
+bitmap image_reload(const char * filename, bitmap * bmp) {
+    switch (image_detect(filename)) {
+    case BFM_BMP:   return bmp_reload(filename, bmp);
+    case BFM_PNM:   return pnm_reload(filename, bmp);
+    default:        return NULL;
+    }
+}
+
+/*  image_decode()
+*   loads an image file held in memory into an existing bitmap
+*/
+bitmap image_decode(const uint8 * data, uint32 size, bitmap * bmp) {
+    switch (image_signature(data, size)) {
+    case BFM_BMP:   return bmp_decode(data, size, bmp);
+    case BFM_PNM:   return pnm_decode(data, size, bmp);
+    default:        return NULL;
+    }
+}
+
+/*  image_type()
+*   format named by the extension of [filename], Windows BMP for any name
+*   without a known one
+*/
+bitmap_type_t image_type(const char * filename) {
+    const char  * dot = strrchr(filename, '.');
+    const char  * sep = strrchr(filename, '/');
+    char        ext[8] = "";
+
+    if (dot && (!sep || dot > sep) && strlen(dot + 1) < sizeof(ext))
+        for (int i = 0; dot[i + 1]; i++)
+            ext[i] = tolower((uint8) dot[i + 1]);
+
+    if (!strcmp(ext, "ppm") || !strcmp(ext, "pnm") || !strcmp(ext, "pgm") ||
+        !strcmp(ext, "pbm"))
+        return BFM_PNM;
+    if (!strcmp(ext, "gif"))
+        return BFM_GIF;
+    if (!strcmp(ext, "png"))
+        return BFM_PNG;
+    return BFM_BMP;
+}
+
+/*  image_save()
+*   saves a bitmap in the format named by the file extension
+*/
+bool image_save(const char * filename, const bitmap * bmp) {
+    switch (image_type(filename)) {
+    case BFM_PNM:   return pnm_save(filename, bmp);
+    case BFM_GIF:   return gif_save(filename, bmp);
+    case BFM_PNG:   return png_save(filename, bmp);
+    default:        return bmp_save(filename, bmp);
+    }
+}
@@ -34,6 +34,10 @@ extern "C" {
     #endif
 #endif
 
+#ifndef uint64
+    typedef unsigned long long uint64;
+#endif
+
 typedef enum {  IMR_OK = 0,
                 IMR_FILE_NOT_FOUND,
                 IMR_FILE_CREATE_ERROR,
@@ -73,17 +77,20 @@ typedef enum {  BFM_BMP,
                 BFM_PCX,
                 BFM_PIC,
                 BFM_PNG,
+                BFM_PNM,
                 BFM_RAW,
                 BFM_RIX,
                 BFM_SGI,
                 BFM_TGA,
-                BFM_TIF} bitmap_type_t;
+                BFM_TIF,
+                BFM_UNKNOWN} bitmap_type_t;
 
 typedef enum {  BCF_NONE,
                 BCF_RLE,
                 BCF_LZW,
                 BCF_HUFFMAN,
-                BCF_PACKBITS} bitmap_compress_t;
+                BCF_PACKBITS,
+                BCF_DEFLATE} bitmap_compress_t;
 
 typedef struct _bitmap_info
 {
@@ -109,11 +116,14 @@ typedef struct _bitmap
     uint32  height;             /* bitmap's height in pixels */
     uint32  size;               /* bitmap's size = width x height */
     uint32  rowsize;            /* width in bytes of each scanline */
+    uint32  capacity;           /* bytes allocated for the bits */
     rgb_t   * pal;              /* accompanied color palette */
     uint8   * data;             /* bitmap's bits */
 } * bitmap, bitmap_t;
 
 bitmap  bitmap_create (uint32 width, uint32 height, bitmap_format_t format, bool hasPal);
+bitmap  bitmap_recreate(bitmap * bmp, uint32 width, uint32 height,
+                        bitmap_format_t format, bool hasPal);
 void    bitmap_destroy(bitmap * bmp);
 uint32  bitmap_row_size(const bitmap * bmp);
 bool    bitmap_has_pal(const bitmap * bmp);
@@ -185,24 +195,45 @@ typedef struct _PNM_HEADER
     uint32   width;
     uint32   height;
     uint16   bitcount;
-    uint32   pixelsize;
+    uint16   maxval;        /* largest sample value */
+    uint32   pixelsize;     /* bytes of a binary raster, 0 if plain text */
     PNM_TYPE type;
 } PNM_HEADER;
 
 #define PNM_HEADER_SIZE (16)
+#define PNM_HEADER_MAX  (1024)  /* longest header read, comments included */
 
 /*------------------------- EASY LOADERS/WRITERS -----------------------------*/
 bitmap	image_load(const char * filename);
+bitmap	image_reload(const char * filename, bitmap * bmp);
+bitmap	image_decode(const uint8 * data, uint32 size, bitmap * bmp);
 bool	image_save(const char * filename, const bitmap * bmp);
+bitmap_type_t image_type(const char * filename);
 bool    image_info(const char * filename, bitmap_info_t * info);
 bitmap_type_t image_detect(const char * filename);
 
+/* header bytes read by image_detect() and image_info(), in one go */
+#define IMAGE_PROBE_SIZE (128)
+
 /*--------------------- SPECIFIC TYPE LOADERS/WRITERS ------------------------*/
 bitmap	bmp_load(const char * filename);
+bitmap	bmp_reload(const char * filename, bitmap * bmp);
+bitmap	bmp_decode(const uint8 * data, uint32 size, bitmap * bmp);
+uint32	bmp_encode(const bitmap * bmp, uint8 ** buf, uint32 * capacity);
 bool	bmp_save(const char * filename, const bitmap * bmp);
+uint32	bmp_encode_rle(const bitmap * bmp, uint8 ** buf, uint32 * capacity);
+bool	bmp_save_rle(const char * filename, const bitmap * bmp);
 
 bitmap  pnm_load(const char * filename);
+bitmap  pnm_reload(const char * filename, bitmap * bmp);
+bitmap  pnm_decode(const uint8 * data, uint32 size, bitmap * bmp);
 bool    pnm_save(const char * filename, const bitmap * bmp);
+uint32  pnm_parse(const uint8 * data, uint32 size, PNM_HEADER * hdr);
+
+bool    gif_save(const char * filename, const bitmap * bmp);
+
+bool    png_save(const char * filename, const bitmap * bmp);
+bool    png_save_level(const char * filename, const bitmap * bmp, int level);
 
 #ifdef __cplusplus
 }
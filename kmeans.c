@@ -0,0 +1,372 @@
+/* KMEANS.C: k-means palette refinement with vectorized distance kernels */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kmeans.h"
+#include "median.h"
+#include "simd.h"
+#include "thread.h"
+
+#if defined(SIMD_X86)
+    #include <immintrin.h>
+#elif defined(SIMD_ARM)
+    #include <arm_neon.h>
+#endif
+
+/* fewest points handed to an assignment thread */
+#define KMEANS_BAND_MIN     (4096)
+
+/* one unique color and its pixel count */
+typedef struct {
+    uint8   r, g, b;
+    uint32  w;
+} kmeans_point_t;
+
+/* centroids laid out for the distance kernels. Entries past [count] up to
+   a multiple of 8 repeat entry 0, so they can never win over it. */
+typedef struct {
+    short   rg[512];            /* r, g pairs */
+    short   b0[512];            /* b, 0 pairs */
+    short   r[256], g[256], b[256];
+    int     index[256];
+    uint32  count;
+    uint32  lanes;              /* padded count */
+} kmeans_centroids_t;
+
+/* shared state of a banded assignment run */
+typedef struct {
+    const kmeans_point_t        * point;
+    uint32                      count;
+    const kmeans_centroids_t    * c;
+    uint32                      * key;      /* distance << 8 | centroid */
+    uint64                      * sum;      /* r, g, b, w per centroid, band */
+    int                         bands;
+} kmeans_job_t;
+
+static void kmeans_pack(kmeans_centroids_t * c, const rgb_t * pal,
+                        uint32 colors) {
+    c->count = colors;
+    c->lanes = (colors + 7) & ~7;
+    for (uint32 k = 0; k < c->lanes; k++) {
+        const rgb_t * p = &pal[k < colors ? k : 0];
+
+        c->r[k] = c->rg[2 * k] = p->r;
+        c->g[k] = c->rg[2 * k + 1] = p->g;
+        c->b[k] = c->b0[2 * k] = p->b;
+        c->b0[2 * k + 1] = 0;
+        c->index[k] = k < colors ? k : 0;
+    }
+}
+
+/* reference kernel: squared distance and index packed into one key, so the
+   minimum key is the nearest centroid with ties going to the lowest index */
+static void kmeans_assign_scalar(const kmeans_centroids_t * c,
+                                 const kmeans_point_t * p, uint32 n,
+                                 uint32 * key) {
+    for (uint32 i = 0; i < n; i++) {
+        int best = 0x7FFFFFFF;
+
+        for (uint32 k = 0; k < c->count; k++) {
+            int dr = p[i].r - c->r[k], dg = p[i].g - c->g[k];
+            int db = p[i].b - c->b[k];
+            int d = (((dr * dr) + (dg * dg) + (db * db)) << 8) | k;
+            best = d < best ? d : best;
+        }
+        key[i] = best;
+    }
+}
+
+#if defined(SIMD_X86)
+
+/* 4 centroids per step: the r, g and b, 0 pairs are squared and summed by
+   two multiply-adds, SSE2 has no 32-bit minimum so it is a compare and
+   select */
+SIMD_TARGET("sse2")
+static void kmeans_assign_sse2(const kmeans_centroids_t * c,
+                               const kmeans_point_t * p, uint32 n,
+                               uint32 * key) {
+    for (uint32 i = 0; i < n; i++) {
+        const __m128i prg = _mm_set1_epi32(p[i].r | (p[i].g << 16));
+        const __m128i pb  = _mm_set1_epi32(p[i].b);
+        __m128i best = _mm_set1_epi32(0x7FFFFFFF);
+        int     lane[4];
+
+        for (uint32 k = 0; k < c->lanes; k += 4) {
+            __m128i drg = _mm_sub_epi16(prg,
+                            _mm_loadu_si128((const __m128i *) (c->rg + 2 * k)));
+            __m128i db  = _mm_sub_epi16(pb,
+                            _mm_loadu_si128((const __m128i *) (c->b0 + 2 * k)));
+            __m128i d   = _mm_add_epi32(_mm_madd_epi16(drg, drg),
+                                        _mm_madd_epi16(db, db));
+            __m128i v   = _mm_or_si128(_mm_slli_epi32(d, 8),
+                            _mm_loadu_si128((const __m128i *) (c->index + k)));
+            __m128i lt  = _mm_cmplt_epi32(v, best);
+            best = _mm_or_si128(_mm_and_si128(lt, v), _mm_andnot_si128(lt, best));
+        }
+
+        _mm_storeu_si128((__m128i *) lane, best);
+        if (lane[1] < lane[0]) lane[0] = lane[1];
+        if (lane[3] < lane[2]) lane[2] = lane[3];
+        key[i] = lane[2] < lane[0] ? lane[2] : lane[0];
+    }
+}
+
+SIMD_TARGET("avx2")
+static void kmeans_assign_avx2(const kmeans_centroids_t * c,
+                               const kmeans_point_t * p, uint32 n,
+                               uint32 * key) {
+    for (uint32 i = 0; i < n; i++) {
+        const __m256i prg = _mm256_set1_epi32(p[i].r | (p[i].g << 16));
+        const __m256i pb  = _mm256_set1_epi32(p[i].b);
+        __m256i best = _mm256_set1_epi32(0x7FFFFFFF);
+
+        for (uint32 k = 0; k < c->lanes; k += 8) {
+            __m256i drg = _mm256_sub_epi16(prg,
+                        _mm256_loadu_si256((const __m256i *) (c->rg + 2 * k)));
+            __m256i db  = _mm256_sub_epi16(pb,
+                        _mm256_loadu_si256((const __m256i *) (c->b0 + 2 * k)));
+            __m256i d   = _mm256_add_epi32(_mm256_madd_epi16(drg, drg),
+                                           _mm256_madd_epi16(db, db));
+            best = _mm256_min_epi32(best, _mm256_or_si256(_mm256_slli_epi32(d, 8),
+                        _mm256_loadu_si256((const __m256i *) (c->index + k))));
+        }
+
+        /* fold the eight lanes */
+        __m128i m = _mm_min_epi32(_mm256_castsi256_si128(best),
+                                  _mm256_extracti128_si256(best, 1));
+        m = _mm_min_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+        m = _mm_min_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+        key[i] = _mm_cvtsi128_si32(m);
+    }
+}
+
+#endif
+
+#if defined(SIMD_ARM)
+
+static void kmeans_assign_neon(const kmeans_centroids_t * c,
+                               const kmeans_point_t * p, uint32 n,
+                               uint32 * key) {
+    for (uint32 i = 0; i < n; i++) {
+        const int16x4_t pr = vdup_n_s16(p[i].r);
+        const int16x4_t pg = vdup_n_s16(p[i].g);
+        const int16x4_t pb = vdup_n_s16(p[i].b);
+        int32x4_t best = vdupq_n_s32(0x7FFFFFFF);
+
+        for (uint32 k = 0; k < c->lanes; k += 4) {
+            int16x4_t dr = vsub_s16(pr, vld1_s16(c->r + k));
+            int16x4_t dg = vsub_s16(pg, vld1_s16(c->g + k));
+            int16x4_t db = vsub_s16(pb, vld1_s16(c->b + k));
+            int32x4_t d = vmlal_s16(vmlal_s16(vmull_s16(dr, dr), dg, dg), db, db);
+            best = vminq_s32(best, vorrq_s32(vshlq_n_s32(d, 8),
+                                             vld1q_s32(c->index + k)));
+        }
+
+        int32x2_t m = vpmin_s32(vget_low_s32(best), vget_high_s32(best));
+        m = vpmin_s32(m, m);
+        key[i] = vget_lane_s32(m, 0);
+    }
+}
+
+#endif
+
+/* dispatches the assignment to the fastest kernel available */
+static void kmeans_assign(const kmeans_centroids_t * c,
+                          const kmeans_point_t * p, uint32 n, uint32 * key) {
+    switch (simd_level()) {
+#if defined(SIMD_X86)
+    case SIMD_AVX2:
+        kmeans_assign_avx2(c, p, n, key);
+        return;
+    case SIMD_SSE2:
+        kmeans_assign_sse2(c, p, n, key);
+        return;
+#endif
+#if defined(SIMD_ARM)
+    case SIMD_NEON:
+        kmeans_assign_neon(c, p, n, key);
+        return;
+#endif
+    default:
+        kmeans_assign_scalar(c, p, n, key);
+    }
+}
+
+/* assigns one band of points and sums them per centroid */
+static void kmeans_band(void * arg, int band) {
+    kmeans_job_t * job = (kmeans_job_t *) arg;
+    uint32  rows = job->count / job->bands;
+    uint32  rest = job->count % job->bands;
+    uint32  p0 = band * rows + (band < rest ? band : rest);
+    uint32  p1 = p0 + rows + (band < rest ? 1 : 0);
+    uint64  * sum = job->sum + band * 256 * 4;
+
+    kmeans_assign(job->c, job->point + p0, p1 - p0, job->key + p0);
+
+    memset(sum, 0, 256 * 4 * sizeof(uint64));
+    for (uint32 i = p0; i < p1; i++) {
+        const kmeans_point_t * p = &job->point[i];
+        uint64 * s = sum + (job->key[i] & 0xFF) * 4;
+
+        s[0] += (uint64) p->r * p->w;
+        s[1] += (uint64) p->g * p->w;
+        s[2] += (uint64) p->b * p->w;
+        s[3] += p->w;
+    }
+}
+
+/* collects the unique colors of a bitmap, read on a grid of at most
+   KMEANS_PIXELS pixels, then every n-th color when there are more than
+   KMEANS_POINTS. Hash order is well mixed, so this is an even sample of
+   the color space. */
+static kmeans_point_t * kmeans_points(const bitmap bmp, uint32 * count) {
+    median_t        * hist = median_create();
+    kmeans_point_t  * point = NULL;
+    uint8           * row = NULL;
+    uint32          grid = 1, step, n = 0, seen = 0;
+
+    while ((uint64) (bmp->width / grid) * (bmp->height / grid) > KMEANS_PIXELS)
+        grid++;
+    if (grid > 1 && !(row = (uint8 *) malloc(bmp->width / grid * 3)))
+        median_destroy(&hist);
+
+    for (uint32 y = 0; hist && y < bmp->height; y += grid) {
+        const uint8 * src = bmp->data + y * bmp->rowsize;
+        uint32      width = bmp->width;
+
+        if (row) {
+            /* gather every [grid]-th pixel of the row */
+            for (width = 0; width < bmp->width / grid; width++)
+                memcpy(row + width * 3, src + width * grid * 3, 3);
+            src = row;
+        }
+        if (!median_add_row(hist, src, width))
+            median_destroy(&hist);
+    }
+    free(row);
+    if (!hist)
+        return NULL;
+
+    step = (hist->used + KMEANS_POINTS - 1) / KMEANS_POINTS;
+    if (step < 1)
+        step = 1;
+    if ((point = (kmeans_point_t *) malloc((hist->used / step + 1) *
+                                           sizeof(kmeans_point_t))))
+        for (uint32 i = 0; i < hist->size; i++)
+            if (hist->slot[i].key && !(seen++ % step)) {
+                point[n].r = hist->slot[i].key >> 16;
+                point[n].g = hist->slot[i].key >> 8;
+                point[n].b = hist->slot[i].key;
+                point[n++].w = hist->slot[i].count;
+            }
+
+    median_destroy(&hist);
+    *count = n;
+    return point;
+}
+
+/*  kmeans_refine()
+*   runs Lloyd iterations: every sampled color goes to its nearest entry,
+*   then each entry moves to the weighted mean of its colors. Entries left
+*   without colors are moved onto the worst served colors. Stops after
+*   [params->iterations], once no entry moves farther than the tolerance,
+*   or when another iteration would overrun the time budget.
+*/
+int kmeans_refine(const bitmap bmp, rgb_t * pal, uint32 colors,
+                  const kmeans_t * params, int threads) {
+    double              start = thread_clock(), last = start;
+    kmeans_centroids_t  c;
+    kmeans_job_t        job = { NULL, 0, &c, NULL, NULL, 1 };
+    int                 it = 0;
+
+    if (!bmp || !pal || !params) return -1;
+    if (bmp->format != BMF_RGB24) return -1;
+    if (colors < 1)   return -1;
+    if (colors > 256) colors = 256;
+
+    kmeans_point_t * point = kmeans_points(bmp, &job.count);
+    if (!point) return -1;
+    job.point = point;
+
+    job.bands = thread_count(threads);
+    if (job.bands > job.count / KMEANS_BAND_MIN)
+        job.bands = job.count / KMEANS_BAND_MIN;
+    if (job.bands < 1)
+        job.bands = 1;
+
+    job.key = (uint32 *) malloc(job.count * sizeof(uint32));
+    job.sum = (uint64 *) malloc(job.bands * 256 * 4 * sizeof(uint64));
+    if (!job.key || !job.sum) {
+        free(job.key);
+        free(job.sum);
+        free(point);
+        return -1;
+    }
+
+    while (job.count && it < params->iterations) {
+        double  moved = 0.0;
+
+        kmeans_pack(&c, pal, colors);
+        thread_parallel(job.bands, kmeans_band, &job);
+
+        /* reduce the bands, integer sums keep this order independent */
+        for (int t = 1; t < job.bands; t++)
+            for (int i = 0; i < 256 * 4; i++)
+                job.sum[i] += job.sum[t * 256 * 4 + i];
+
+        for (uint32 k = 0; k < colors; k++) {
+            uint64 * s = job.sum + k * 4;
+            rgb_t   p;
+
+            if (!s[3])
+                continue;
+            p.r = (s[0] + s[3] / 2) / s[3];
+            p.g = (s[1] + s[3] / 2) / s[3];
+            p.b = (s[2] + s[3] / 2) / s[3];
+
+            int dr = p.r - pal[k].r, dg = p.g - pal[k].g, db = p.b - pal[k].b;
+            if (dr * dr + dg * dg + db * db > moved)
+                moved = dr * dr + dg * dg + db * db;
+            pal[k] = p;
+        }
+
+        /* reseed empty entries on the colors with the largest error */
+        for (uint32 k = 0; k < colors; k++) {
+            uint64  worst = 0;
+            uint32  pick = job.count;
+
+            if (job.sum[k * 4 + 3])
+                continue;
+            for (uint32 i = 0; i < job.count; i++)
+                if ((uint64) (job.key[i] >> 8) * point[i].w > worst) {
+                    worst = (uint64) (job.key[i] >> 8) * point[i].w;
+                    pick = i;
+                }
+            if (pick == job.count)
+                break;          /* every color already has an exact entry */
+
+            pal[k].r = point[pick].r;
+            pal[k].g = point[pick].g;
+            pal[k].b = point[pick].b;
+            job.key[pick] &= 0xFF;
+            moved = 1e30;
+        }
+
+        it++;
+        if (moved <= params->tolerance * params->tolerance)
+            break;
+
+        /* stop unless one more iteration like the last fits the budget */
+        double now = thread_clock();
+        if (params->budget > 0 &&
+            (now - start + now - last) * 1000.0 > params->budget)
+            break;
+        last = now;
+    }
+
+    free(job.key);
+    free(job.sum);
+    free(point);
+    return it;
+}
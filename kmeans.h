@@ -0,0 +1,36 @@
+#ifndef __KMEANS_H__
+#define __KMEANS_H__ (1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "image.h"
+
+/*------------------------ K-MEANS PALETTE REFINEMENT ------------------------*/
+
+/* larger images are sampled on a regular pixel grid */
+#define KMEANS_PIXELS   (1 << 20)
+/* images with more unique colors are refined on an even sample of them */
+#define KMEANS_POINTS   (1 << 18)
+/* default convergence threshold, in RGB units */
+#define KMEANS_TOLERANCE    (1.0)
+
+typedef struct kmeans_params {
+    int     iterations;         /* Lloyd iterations at most */
+    double  tolerance;          /* converged once no centroid moves farther,
+                                   in RGB units */
+    double  budget;             /* milliseconds for the whole refinement,
+                                   0 = unlimited */
+} kmeans_t;
+
+/* refines the first [colors] entries of [pal] toward the colors of an
+   RGB24 bitmap, returns the iterations run or -1 on failure */
+int     kmeans_refine(const bitmap bmp, rgb_t * pal, uint32 colors,
+                      const kmeans_t * params, int threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
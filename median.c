@@ -0,0 +1,339 @@
+/* MEDIAN.C: median cut color quantizer over a histogram of unique colors */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "median.h"
+#include "thread.h"
+#include "stats.h"
+
+/* fewest rows handed to a mapping thread */
+#define MEDIAN_BAND_MIN     (16)
+/* initial hash size, grown by doubling past half load */
+#define MEDIAN_HASH_BITS    (12)
+
+/* a box is a range of the compacted histogram */
+typedef struct {
+    uint32  lo, hi;             /* colors [lo, hi) */
+    uint64  count;              /* pixels */
+    uint64  score;              /* split priority, 0 = cannot be split */
+    int     axis;               /* longest side */
+} median_box_t;
+
+static inline uint32 median_key(uint8 r, uint8 g, uint8 b) {
+    return 0x01000000 | (r << 16) | (g << 8) | b;
+}
+
+static inline uint32 median_hash(uint32 key, uint32 size) {
+    uint32 h = key * 0x9E3779B1u;
+
+    return (h ^ h >> 15) & (size - 1);
+}
+
+/* slot holding [key], or the empty slot where it belongs */
+static inline uint32 median_find(const median_t * hist, uint32 key) {
+    uint32 i = median_hash(key, hist->size);
+
+    while (hist->slot[i].key && hist->slot[i].key != key)
+        i = (i + 1) & (hist->size - 1);
+    return i;
+}
+
+/*  median_create()
+*   allocates an empty unique colors histogram
+*/
+median_t * median_create(void) {
+    median_t * hist = (median_t *) calloc(1, sizeof(median_t));
+
+    if (!hist) return NULL;
+
+    hist->size = 1 << MEDIAN_HASH_BITS;
+    hist->slot = (median_slot_t *) calloc(hist->size, sizeof(median_slot_t));
+    if (!hist->slot)
+        median_destroy(&hist);
+    return hist;
+}
+
+void median_destroy(median_t ** hist) {
+    if (*hist) {
+        free((*hist)->slot);
+        free(*hist);
+        *hist = NULL;
+    }
+}
+
+/* doubles the hash table */
+static bool median_grow(median_t * hist) {
+    median_slot_t   * old = hist->slot;
+    uint32          size = hist->size;
+
+    hist->slot = (median_slot_t *) calloc(size * 2, sizeof(median_slot_t));
+    if (!hist->slot) {
+        hist->slot = old;
+        return false;
+    }
+    hist->size = size * 2;
+    for (uint32 i = 0; i < size; i++)
+        if (old[i].key)
+            hist->slot[median_find(hist, old[i].key)] = old[i];
+    free(old);
+    return true;
+}
+
+/*  median_add_row()
+*   counts the colors of an RGB24 scanline, false when out of memory
+*/
+bool median_add_row(median_t * hist, const uint8 * src, uint32 width) {
+    for (uint32 x = 0; x < width; x++, src += 3) {
+        uint32 key = median_key(src[0], src[1], src[2]);
+
+        /* runs of one color skip the hashing */
+        if (hist->slot[hist->last].key != key) {
+            hist->last = median_find(hist, key);
+            if (!hist->slot[hist->last].key) {
+                if (hist->used >= hist->size / 2) {
+                    if (!median_grow(hist))
+                        return false;
+                    hist->last = median_find(hist, key);
+                }
+                hist->slot[hist->last].key = key;
+                hist->used++;
+            }
+        }
+        hist->slot[hist->last].count++;
+    }
+    return true;
+}
+
+/* finds the longest side of a box and its split priority */
+static void median_measure(median_box_t * box, const median_color_t * color) {
+    uint8   lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 };
+
+    box->count = 0;
+    for (uint32 i = box->lo; i < box->hi; i++) {
+        for (int a = 0; a < 3; a++) {
+            if (color[i].c[a] < lo[a]) lo[a] = color[i].c[a];
+            if (color[i].c[a] > hi[a]) hi[a] = color[i].c[a];
+        }
+        box->count += color[i].count;
+    }
+
+    box->axis = 0;
+    for (int a = 1; a < 3; a++)
+        if (hi[a] - lo[a] > hi[box->axis] - lo[box->axis])
+            box->axis = a;
+
+    /* favor boxes both wide and heavily populated */
+    box->score = (uint64) (hi[box->axis] - lo[box->axis]) * box->count;
+}
+
+static inline void median_swap(median_color_t * a, median_color_t * b) {
+    median_color_t t = *a;
+    *a = *b;
+    *b = t;
+}
+
+/* partitions the box at the weighted median of its longest side. Like
+   nth_element the colors are only split into a lower and an upper part,
+   never sorted: channels are 8-bit, so the median is found by counting
+   pixels per level and one pass moves the colors below the cut down.
+   Returns the first color of the upper box. */
+static uint32 median_split(median_color_t * color, const median_box_t * box) {
+    uint64  level[256] = { 0 };
+    uint64  below = 0;
+    uint32  lo = box->lo, hi = box->hi;
+    int     a = box->axis, cut = 0;
+
+    for (uint32 i = lo; i < hi; i++)
+        level[color[i].c[a]] += color[i].count;
+
+    /* first level holding the middle pixel */
+    while (below + level[cut] <= box->count / 2)
+        below += level[cut++];
+
+    /* cut on the nearest side of that level, keeping both parts non-empty */
+    if (!below || (below + level[cut] < box->count &&
+                   box->count / 2 - below >= below + level[cut] - box->count / 2))
+        below += level[cut++];
+
+    /* colors below [cut] go to the lower box */
+    while (lo < hi) {
+        if (color[lo].c[a] < cut)
+            lo++;
+        else
+            median_swap(&color[lo], &color[--hi]);
+    }
+    return lo;
+}
+
+/*  median_palette()
+*   cuts the unique colors into at most [colors] boxes (2..256), always
+*   splitting the box with the highest priority at its median, and averages
+*   each box into [pal]. Unused entries are black. The histogram then maps
+*   colors to palette indices, so no pixels can be added afterwards.
+*   Returns the number of colors, 0 when out of memory.
+*/
+uint32 median_palette(median_t * hist, uint32 colors, rgb_t * pal) {
+    median_box_t    box[256];
+    median_color_t  * color;
+    uint32          count = 1, n = 0;
+
+    if (colors < 2)   colors = 2;
+    if (colors > 256) colors = 256;
+
+    memset(pal, 0, 256 * sizeof(rgb_t));
+    if (!hist->used)
+        return 0;
+
+    /* compact the histogram */
+    color = (median_color_t *) malloc(hist->used * sizeof(median_color_t));
+    if (!color)
+        return 0;
+    for (uint32 i = 0; i < hist->size; i++)
+        if (hist->slot[i].key) {
+            color[n].c[0] = hist->slot[i].key >> 16;
+            color[n].c[1] = hist->slot[i].key >> 8;
+            color[n].c[2] = hist->slot[i].key;
+            color[n].count = hist->slot[i].count;
+            color[n++].slot = i;
+        }
+
+    box[0].lo = 0;
+    box[0].hi = n;
+    median_measure(&box[0], color);
+
+    while (count < colors) {
+        uint32 next = 0;
+
+        for (uint32 k = 1; k < count; k++)
+            if (box[k].score > box[next].score)
+                next = k;
+        if (!box[next].score)
+            break;              /* every box holds a single color */
+
+        box[count].hi = box[next].hi;
+        box[count].lo = box[next].hi = median_split(color, &box[next]);
+        median_measure(&box[next], color);
+        median_measure(&box[count++], color);
+    }
+
+    /* average the boxes, the hash remembers where each color went */
+    for (uint32 k = 0; k < count; k++) {
+        uint64 r = 0, g = 0, b = 0;
+
+        for (uint32 i = box[k].lo; i < box[k].hi; i++) {
+            r += (uint64) color[i].c[0] * color[i].count;
+            g += (uint64) color[i].c[1] * color[i].count;
+            b += (uint64) color[i].c[2] * color[i].count;
+            hist->slot[color[i].slot].count = k;
+        }
+        pal[k].r = (r + box[k].count / 2) / box[k].count;
+        pal[k].g = (g + box[k].count / 2) / box[k].count;
+        pal[k].b = (b + box[k].count / 2) / box[k].count;
+    }
+
+    free(color);
+    return count;
+}
+
+/*  median_index()
+*   palette index of a color, valid after median_palette(). Colors that were
+*   never added map to entry 0.
+*/
+uint8 median_index(const median_t * hist, uint8 r, uint8 g, uint8 b) {
+    uint32 i = median_find(hist, median_key(r, g, b));
+
+    return hist->slot[i].key ? hist->slot[i].count : 0;
+}
+
+/* shared state of a banded mapping run */
+typedef struct {
+    const median_t  * hist;
+    const bitmap    src;
+    bitmap          dst;
+    int             bands;
+} median_job_t;
+
+static void median_band(void * arg, int band) {
+    median_job_t * job = (median_job_t *) arg;
+    uint32  rows = job->src->height / job->bands;
+    uint32  rest = job->src->height % job->bands;
+    uint32  y0 = band * rows + (band < rest ? band : rest);
+    uint32  y1 = y0 + rows + (band < rest ? 1 : 0);
+
+    for (uint32 y = y0; y < y1; y++) {
+        const uint8 * src = job->src->data + y * job->src->rowsize;
+        uint8       * dst = job->dst->data + y * job->dst->rowsize;
+        uint32      last = 0xFFFFFFFF;
+        uint8       k = 0;
+
+        for (uint32 x = 0; x < job->src->width; x++, src += 3) {
+            uint32 color = (src[0] << 16) | (src[1] << 8) | src[2];
+            if (color != last) {
+                k = median_index(job->hist, src[0], src[1], src[2]);
+                last = color;
+            }
+            dst[x] = k;
+        }
+    }
+}
+
+/* counts the unique colors of an RGB24 bitmap, NULL when out of memory */
+static median_t * median_histogram(const bitmap bmp) {
+    median_t * hist = median_create();
+
+    for (uint32 y = 0; hist && y < bmp->height; y++)
+        if (!median_add_row(hist, bmp->data + y * bmp->rowsize, bmp->width))
+            median_destroy(&hist);
+    return hist;
+}
+
+/*  palette_median()
+*   computes the median cut palette of an RGB24 bitmap without mapping it,
+*   returns the number of colors or 0 on failure
+*/
+uint32 palette_median(const bitmap bmp, uint32 colors, rgb_t * pal) {
+    if (!bmp) return 0;
+    if (bmp->format != BMF_RGB24) return 0;
+
+    median_t * hist = median_histogram(bmp);
+    if (!hist) return 0;
+
+    double start = stats_start();
+    colors = median_palette(hist, colors, pal);
+    stats_stop(STATS_CLUT, start);
+    median_destroy(&hist);
+    return colors;
+}
+
+/* RGB quantization using median cut with a palette of [colors] entries,
+   the mapping pass runs on [threads] threads (0 = every processor) */
+bitmap quantize_median(const bitmap bmp, uint32 colors, int threads) {
+    if (!bmp) return NULL;
+    if (bmp->format != BMF_RGB24) return NULL;
+
+    /* create output indexed bitmap */
+    bitmap res = bitmap_create(bmp->width, bmp->height, BMF_INDEXED8, true);
+    if (!res) return NULL;
+
+    /* histogram and palette building phase */
+    median_t * hist = median_histogram(bmp);
+    double start = stats_start();
+    if (!hist || !median_palette(hist, colors, res->pal)) {
+        median_destroy(&hist);
+        bitmap_destroy(&res);
+        return NULL;
+    }
+    stats_stop(STATS_CLUT, start);
+
+    /* mapping phase, the histogram is read-only from now on */
+    median_job_t job = { hist, bmp, res, thread_count(threads) };
+    if (job.bands > bmp->height / MEDIAN_BAND_MIN)
+        job.bands = bmp->height / MEDIAN_BAND_MIN;
+    if (job.bands < 1)
+        job.bands = 1;
+    thread_parallel(job.bands, median_band, &job);
+
+    median_destroy(&hist);
+    return res;
+}
@@ -0,0 +1,45 @@
+#ifndef __MEDIAN_H__
+#define __MEDIAN_H__ (1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "image.h"
+
+/*-------------------------- MEDIAN CUT QUANTIZER ----------------------------*/
+
+/* hash slot of the unique colors histogram */
+typedef struct median_slot {
+    uint32  key;                /* 0x01RRGGBB, 0 = empty slot */
+    uint32  count;              /* pixels, palette index after median_palette() */
+} median_slot_t;
+
+/* one unique color of the compacted histogram */
+typedef struct median_color {
+    uint8   c[3];               /* r, g, b */
+    uint32  count;
+    uint32  slot;               /* hash slot of the color */
+} median_color_t;
+
+typedef struct median_context {
+    median_slot_t   * slot;
+    uint32          size;       /* slots, a power of two */
+    uint32          used;       /* unique colors */
+    uint32          last;       /* slot of the last color added */
+} median_t;
+
+median_t *  median_create(void);
+void        median_destroy(median_t ** hist);
+bool        median_add_row(median_t * hist, const uint8 * src, uint32 width);
+uint32      median_palette(median_t * hist, uint32 colors, rgb_t * pal);
+uint8       median_index(const median_t * hist, uint8 r, uint8 g, uint8 b);
+
+uint32      palette_median(const bitmap bmp, uint32 colors, rgb_t * pal);
+bitmap      quantize_median(const bitmap bmp, uint32 colors, int threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,564 @@
+/* METRIC.C: MSE, PSNR and SSIM of a quantized image against its source,
+   computed in strips of rows with vectorized kernels */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "metric.h"
+#include "simd.h"
+#include "thread.h"
+
+#if defined(SIMD_X86)
+    #include <immintrin.h>
+#elif defined(SIMD_ARM)
+    #include <arm_neon.h>
+#endif
+
+/* SSIM windows are 8x8 pixels every 4 pixels, so a window spans two
+   consecutive strips of 4 rows and 4 columns */
+#define METRIC_STRIP        (4)
+#define METRIC_WINDOW       (2 * METRIC_STRIP)
+/* fewest strips handed to a thread */
+#define METRIC_BAND_MIN     (8)
+/* vector blocks summed before the 32-bit lanes may overflow */
+#define METRIC_FLUSH        (4096)
+
+/* SSIM stabilizers: (0.01 * 255)^2 and (0.03 * 255)^2 */
+#define METRIC_C1           (6.5025)
+#define METRIC_C2           (58.5225)
+
+/* luma sums of the columns of a strip */
+enum { SUM_A, SUM_B, SUM_AA, SUM_BB, SUM_AB, SUMS };
+
+/* BT.601 luma in 8 bits, the same in every kernel */
+static inline uint8 metric_luma(uint32 r, uint32 g, uint32 b) {
+    return (77 * r + 150 * g + 29 * b + 128) >> 8;
+}
+
+/* reference kernel for pixels [x, width): adds the squared errors of [a]
+   against [b] to [sse], and the luma of both to the column sums [sums]
+   (SUMS arrays of [width] entries) unless it is NULL */
+static void metric_row_scalar(const uint8 * a, const uint8 * b, uint32 x,
+                              uint32 width, uint64 * sse, uint32 * sums) {
+    uint64  s[3] = { 0, 0, 0 };
+
+    for (; x < width; x++) {
+        const uint8 * p = a + x * 3, * q = b + x * 3;
+        int dr = p[0] - q[0], dg = p[1] - q[1], db = p[2] - q[2];
+
+        s[0] += dr * dr;
+        s[1] += dg * dg;
+        s[2] += db * db;
+        if (sums) {
+            uint32  la = metric_luma(p[0], p[1], p[2]);
+            uint32  lb = metric_luma(q[0], q[1], q[2]);
+
+            sums[SUM_A * width + x]  += la;
+            sums[SUM_B * width + x]  += lb;
+            sums[SUM_AA * width + x] += la * la;
+            sums[SUM_BB * width + x] += lb * lb;
+            sums[SUM_AB * width + x] += la * lb;
+        }
+    }
+    sse[0] += s[0];
+    sse[1] += s[1];
+    sse[2] += s[2];
+}
+
+#if defined(SIMD_X86)
+
+/* squared differences of 16 byte pairs, summed pairwise into 32 bits */
+SIMD_TARGET("sse2")
+static inline __m128i metric_sq_sse2(__m128i a, __m128i b) {
+    __m128i z = _mm_setzero_si128();
+    __m128i d = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+    __m128i lo = _mm_unpacklo_epi8(d, z), hi = _mm_unpackhi_epi8(d, z);
+
+    return _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi));
+}
+
+/* luma of 8 planar pixels held in 16-bit lanes */
+SIMD_TARGET("sse2")
+static inline __m128i metric_luma_sse2(__m128i r, __m128i g, __m128i b) {
+    __m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(77)),
+                              _mm_mullo_epi16(g, _mm_set1_epi16(150)));
+
+    y = _mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(29)));
+    return _mm_srli_epi16(_mm_add_epi16(y, _mm_set1_epi16(128)), 8);
+}
+
+/* adds 8 16-bit lanes to 8 column sums */
+SIMD_TARGET("sse2")
+static inline void metric_add_sse2(uint32 * p, __m128i v) {
+    __m128i z = _mm_setzero_si128();
+    __m128i * q = (__m128i *) p;
+
+    _mm_storeu_si128(q, _mm_add_epi32(_mm_loadu_si128(q),
+                                      _mm_unpacklo_epi16(v, z)));
+    _mm_storeu_si128(q + 1, _mm_add_epi32(_mm_loadu_si128(q + 1),
+                                          _mm_unpackhi_epi16(v, z)));
+}
+
+/* adds the luma of 16 planar pixel pairs to the column sums at [x] */
+SIMD_TARGET("sse2")
+static inline void metric_sums_sse2(uint32 * sums, uint32 width, uint32 x,
+                                    __m128i ar, __m128i ag, __m128i ab,
+                                    __m128i br, __m128i bg, __m128i bb) {
+    __m128i z = _mm_setzero_si128();
+
+    for (int h = 0; h < 2; h++, x += 8) {
+        __m128i la = metric_luma_sse2(
+                        h ? _mm_unpackhi_epi8(ar, z) : _mm_unpacklo_epi8(ar, z),
+                        h ? _mm_unpackhi_epi8(ag, z) : _mm_unpacklo_epi8(ag, z),
+                        h ? _mm_unpackhi_epi8(ab, z) :
+                            _mm_unpacklo_epi8(ab, z));
+        __m128i lb = metric_luma_sse2(
+                        h ? _mm_unpackhi_epi8(br, z) : _mm_unpacklo_epi8(br, z),
+                        h ? _mm_unpackhi_epi8(bg, z) : _mm_unpacklo_epi8(bg, z),
+                        h ? _mm_unpackhi_epi8(bb, z) :
+                            _mm_unpacklo_epi8(bb, z));
+
+        /* squares of 8-bit values still fit 16-bit lanes */
+        metric_add_sse2(sums + SUM_A * width + x, la);
+        metric_add_sse2(sums + SUM_B * width + x, lb);
+        metric_add_sse2(sums + SUM_AA * width + x, _mm_mullo_epi16(la, la));
+        metric_add_sse2(sums + SUM_BB * width + x, _mm_mullo_epi16(lb, lb));
+        metric_add_sse2(sums + SUM_AB * width + x, _mm_mullo_epi16(la, lb));
+    }
+}
+
+SIMD_TARGET("sse2")
+static void metric_row_sse2(const uint8 * a, const uint8 * b, uint32 width,
+                            uint64 * sse, uint32 * sums) {
+    uint32  x = 0, lanes[4];
+
+    while (x + 16 <= width) {
+        __m128i acc[3] = { _mm_setzero_si128(), _mm_setzero_si128(),
+                           _mm_setzero_si128() };
+
+        for (int n = 0; n < METRIC_FLUSH && x + 16 <= width; n++, x += 16) {
+            const uint8 * p = a + x * 3, * q = b + x * 3;
+            __m128i ar = _mm_loadu_si128((const __m128i *) (p + 0));
+            __m128i ag = _mm_loadu_si128((const __m128i *) (p + 16));
+            __m128i ab = _mm_loadu_si128((const __m128i *) (p + 32));
+            __m128i br = _mm_loadu_si128((const __m128i *) (q + 0));
+            __m128i bg = _mm_loadu_si128((const __m128i *) (q + 16));
+            __m128i bb = _mm_loadu_si128((const __m128i *) (q + 32));
+
+            DEINTERLEAVE3(_mm_unpacklo_epi8, _mm_unpackhi_epi64, ar, ag, ab);
+            DEINTERLEAVE3(_mm_unpacklo_epi8, _mm_unpackhi_epi64, br, bg, bb);
+            acc[0] = _mm_add_epi32(acc[0], metric_sq_sse2(ar, br));
+            acc[1] = _mm_add_epi32(acc[1], metric_sq_sse2(ag, bg));
+            acc[2] = _mm_add_epi32(acc[2], metric_sq_sse2(ab, bb));
+            if (sums)
+                metric_sums_sse2(sums, width, x, ar, ag, ab, br, bg, bb);
+        }
+        for (int c = 0; c < 3; c++) {
+            _mm_storeu_si128((__m128i *) lanes, acc[c]);
+            sse[c] += (uint64) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        }
+    }
+    metric_row_scalar(a, b, x, width, sse, sums);
+}
+
+SIMD_TARGET("avx2")
+static inline __m256i metric_sq_avx2(__m256i a, __m256i b) {
+    __m256i z = _mm256_setzero_si256();
+    __m256i d = _mm256_or_si256(_mm256_subs_epu8(a, b),
+                                _mm256_subs_epu8(b, a));
+    __m256i lo = _mm256_unpacklo_epi8(d, z), hi = _mm256_unpackhi_epi8(d, z);
+
+    return _mm256_add_epi32(_mm256_madd_epi16(lo, lo),
+                            _mm256_madd_epi16(hi, hi));
+}
+
+/* luma of 16 planar pixels taken from 16 bytes each, in order */
+SIMD_TARGET("avx2")
+static inline __m256i metric_luma_avx2(__m128i r, __m128i g, __m128i b) {
+    __m256i y = _mm256_add_epi16(
+                    _mm256_mullo_epi16(_mm256_cvtepu8_epi16(r),
+                                       _mm256_set1_epi16(77)),
+                    _mm256_mullo_epi16(_mm256_cvtepu8_epi16(g),
+                                       _mm256_set1_epi16(150)));
+
+    y = _mm256_add_epi16(y, _mm256_mullo_epi16(_mm256_cvtepu8_epi16(b),
+                                               _mm256_set1_epi16(29)));
+    return _mm256_srli_epi16(_mm256_add_epi16(y, _mm256_set1_epi16(128)), 8);
+}
+
+/* adds 16 16-bit lanes to 16 column sums */
+SIMD_TARGET("avx2")
+static inline void metric_add_avx2(uint32 * p, __m256i v) {
+    __m256i * q = (__m256i *) p;
+
+    _mm256_storeu_si256(q, _mm256_add_epi32(_mm256_loadu_si256(q),
+                        _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v))));
+    _mm256_storeu_si256(q + 1, _mm256_add_epi32(_mm256_loadu_si256(q + 1),
+                        _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1))));
+}
+
+/* adds the luma of 32 planar pixel pairs to the column sums at [x] */
+SIMD_TARGET("avx2")
+static inline void metric_sums_avx2(uint32 * sums, uint32 width, uint32 x,
+                                    __m256i ar, __m256i ag, __m256i ab,
+                                    __m256i br, __m256i bg, __m256i bb) {
+    for (int h = 0; h < 2; h++, x += 16) {
+        __m256i la = metric_luma_avx2(
+                        h ? _mm256_extracti128_si256(ar, 1) :
+                            _mm256_castsi256_si128(ar),
+                        h ? _mm256_extracti128_si256(ag, 1) :
+                            _mm256_castsi256_si128(ag),
+                        h ? _mm256_extracti128_si256(ab, 1) :
+                            _mm256_castsi256_si128(ab));
+        __m256i lb = metric_luma_avx2(
+                        h ? _mm256_extracti128_si256(br, 1) :
+                            _mm256_castsi256_si128(br),
+                        h ? _mm256_extracti128_si256(bg, 1) :
+                            _mm256_castsi256_si128(bg),
+                        h ? _mm256_extracti128_si256(bb, 1) :
+                            _mm256_castsi256_si128(bb));
+
+        metric_add_avx2(sums + SUM_A * width + x, la);
+        metric_add_avx2(sums + SUM_B * width + x, lb);
+        metric_add_avx2(sums + SUM_AA * width + x,
+                        _mm256_mullo_epi16(la, la));
+        metric_add_avx2(sums + SUM_BB * width + x,
+                        _mm256_mullo_epi16(lb, lb));
+        metric_add_avx2(sums + SUM_AB * width + x,
+                        _mm256_mullo_epi16(la, lb));
+    }
+}
+
+/* loads 32 packed RGB pixels, pixels 0..15 in the low lanes */
+#define METRIC_LOAD_AVX2(p, k) \
+    _mm256_inserti128_si256(_mm256_castsi128_si256( \
+        _mm_loadu_si128((const __m128i *) ((p) + (k)))), \
+        _mm_loadu_si128((const __m128i *) ((p) + (k) + 48)), 1)
+
+SIMD_TARGET("avx2")
+static void metric_row_avx2(const uint8 * a, const uint8 * b, uint32 width,
+                            uint64 * sse, uint32 * sums) {
+    uint32  x = 0, lanes[8];
+
+    while (x + 32 <= width) {
+        __m256i acc[3] = { _mm256_setzero_si256(), _mm256_setzero_si256(),
+                           _mm256_setzero_si256() };
+
+        for (int n = 0; n < METRIC_FLUSH && x + 32 <= width; n++, x += 32) {
+            const uint8 * p = a + x * 3, * q = b + x * 3;
+            __m256i ar = METRIC_LOAD_AVX2(p, 0);
+            __m256i ag = METRIC_LOAD_AVX2(p, 16);
+            __m256i ab = METRIC_LOAD_AVX2(p, 32);
+            __m256i br = METRIC_LOAD_AVX2(q, 0);
+            __m256i bg = METRIC_LOAD_AVX2(q, 16);
+            __m256i bb = METRIC_LOAD_AVX2(q, 32);
+
+            DEINTERLEAVE3(_mm256_unpacklo_epi8, _mm256_unpackhi_epi64,
+                          ar, ag, ab);
+            DEINTERLEAVE3(_mm256_unpacklo_epi8, _mm256_unpackhi_epi64,
+                          br, bg, bb);
+            acc[0] = _mm256_add_epi32(acc[0], metric_sq_avx2(ar, br));
+            acc[1] = _mm256_add_epi32(acc[1], metric_sq_avx2(ag, bg));
+            acc[2] = _mm256_add_epi32(acc[2], metric_sq_avx2(ab, bb));
+            if (sums)
+                metric_sums_avx2(sums, width, x, ar, ag, ab, br, bg, bb);
+        }
+        for (int c = 0; c < 3; c++) {
+            _mm256_storeu_si256((__m256i *) lanes, acc[c]);
+            for (int i = 0; i < 8; i++)
+                sse[c] += lanes[i];
+        }
+    }
+    metric_row_scalar(a, b, x, width, sse, sums);
+}
+
+#endif
+
+#if defined(SIMD_ARM)
+
+/* luma of 8 planar pixels */
+static inline uint16x8_t metric_luma_neon(uint8x8_t r, uint8x8_t g,
+                                          uint8x8_t b) {
+    uint16x8_t y = vmull_u8(r, vdup_n_u8(77));
+
+    y = vmlal_u8(y, g, vdup_n_u8(150));
+    y = vmlal_u8(y, b, vdup_n_u8(29));
+    /* rounding shift: (y + 128) >> 8 */
+    return vrshrq_n_u16(y, 8);
+}
+
+/* adds 8 16-bit lanes to 8 column sums */
+static inline void metric_add_neon(uint32 * p, uint16x8_t v) {
+    vst1q_u32(p, vaddw_u16(vld1q_u32(p), vget_low_u16(v)));
+    vst1q_u32(p + 4, vaddw_u16(vld1q_u32(p + 4), vget_high_u16(v)));
+}
+
+static void metric_row_neon(const uint8 * a, const uint8 * b, uint32 width,
+                            uint64 * sse, uint32 * sums) {
+    uint32  x = 0;
+
+    while (x + 16 <= width) {
+        uint32x4_t acc[3] = { vdupq_n_u32(0), vdupq_n_u32(0), vdupq_n_u32(0) };
+
+        for (int n = 0; n < METRIC_FLUSH && x + 16 <= width; n++, x += 16) {
+            uint8x16x3_t p = vld3q_u8(a + x * 3), q = vld3q_u8(b + x * 3);
+
+            for (int c = 0; c < 3; c++) {
+                uint8x16_t d = vabdq_u8(p.val[c], q.val[c]);
+                acc[c] = vpadalq_u16(acc[c], vmull_u8(vget_low_u8(d),
+                                                      vget_low_u8(d)));
+                acc[c] = vpadalq_u16(acc[c], vmull_u8(vget_high_u8(d),
+                                                      vget_high_u8(d)));
+            }
+            if (!sums)
+                continue;
+            for (int h = 0; h < 2; h++) {
+                uint32  at = x + h * 8;
+                uint16x8_t la = metric_luma_neon(
+                    h ? vget_high_u8(p.val[0]) : vget_low_u8(p.val[0]),
+                    h ? vget_high_u8(p.val[1]) : vget_low_u8(p.val[1]),
+                    h ? vget_high_u8(p.val[2]) : vget_low_u8(p.val[2]));
+                uint16x8_t lb = metric_luma_neon(
+                    h ? vget_high_u8(q.val[0]) : vget_low_u8(q.val[0]),
+                    h ? vget_high_u8(q.val[1]) : vget_low_u8(q.val[1]),
+                    h ? vget_high_u8(q.val[2]) : vget_low_u8(q.val[2]));
+
+                metric_add_neon(sums + SUM_A * width + at, la);
+                metric_add_neon(sums + SUM_B * width + at, lb);
+                metric_add_neon(sums + SUM_AA * width + at, vmulq_u16(la, la));
+                metric_add_neon(sums + SUM_BB * width + at, vmulq_u16(lb, lb));
+                metric_add_neon(sums + SUM_AB * width + at, vmulq_u16(la, lb));
+            }
+        }
+        for (int c = 0; c < 3; c++) {
+            uint64x2_t t = vpaddlq_u32(acc[c]);
+            sse[c] += vgetq_lane_u64(t, 0) + vgetq_lane_u64(t, 1);
+        }
+    }
+    metric_row_scalar(a, b, x, width, sse, sums);
+}
+
+#endif
+
+/* dispatches a row pair to the fastest kernel available */
+static void metric_row(const uint8 * a, const uint8 * b, uint32 width,
+                       uint64 * sse, uint32 * sums) {
+    switch (simd_level()) {
+#if defined(SIMD_X86)
+    case SIMD_AVX2:
+        metric_row_avx2(a, b, width, sse, sums);
+        return;
+    case SIMD_SSE2:
+        metric_row_sse2(a, b, width, sse, sums);
+        return;
+#endif
+#if defined(SIMD_ARM)
+    case SIMD_NEON:
+        metric_row_neon(a, b, width, sse, sums);
+        return;
+#endif
+    default:
+        break;
+    }
+    metric_row_scalar(a, b, 0, width, sse, sums);
+}
+
+/* SSIM of one window from its luma sums over [n] pixels */
+static double metric_ssim(const uint64 * s, double n) {
+    double  ma = s[SUM_A] / n, mb = s[SUM_B] / n;
+    double  va = s[SUM_AA] / n - ma * ma, vb = s[SUM_BB] / n - mb * mb;
+    double  cov = s[SUM_AB] / n - ma * mb;
+
+    return ((2 * ma * mb + METRIC_C1) * (2 * cov + METRIC_C2)) /
+           ((ma * ma + mb * mb + METRIC_C1) * (va + vb + METRIC_C2));
+}
+
+/* sum of the SSIM of the windows starting in the strip whose column
+   sums are [top], the next strip being [bottom] */
+static double metric_strip(const uint32 * top, const uint32 * bottom,
+                           uint32 width) {
+    uint64  prev[SUMS] = { 0 }, cur[SUMS], win[SUMS];
+    double  sum = 0;
+
+    /* a window is made of two consecutive 4x4 blocks of the strip pair */
+    for (uint32 x = 0; x + METRIC_STRIP <= width; x += METRIC_STRIP) {
+        for (int k = 0; k < SUMS; k++) {
+            const uint32 * t = top + k * width + x;
+            const uint32 * b = bottom + k * width + x;
+
+            cur[k] = (uint64) t[0] + t[1] + t[2] + t[3] +
+                     b[0] + b[1] + b[2] + b[3];
+            win[k] = prev[k] + cur[k];
+            prev[k] = cur[k];
+        }
+        if (x)
+            sum += metric_ssim(win, METRIC_WINDOW * METRIC_WINDOW);
+    }
+    return sum;
+}
+
+/* shared state of a banded comparison */
+typedef struct {
+    const bitmap    src;
+    const bitmap    res;
+    int             bands;
+    uint32          strips;     /* full strips of METRIC_STRIP rows */
+    bool            windows;    /* image holds at least one SSIM window */
+    uint64          * sse;      /* 3 per band */
+    uint64          * whole;    /* SUMS per band, images without windows */
+    double          * ssim;     /* per strip, summed in order afterwards */
+    int             failed;
+} metric_job_t;
+
+/* compares one band of strips, plus the rows past the last strip for the
+   last band. The column sums of the strip after the band are taken as
+   well, its windows need them. */
+static void metric_band(void * arg, int band) {
+    metric_job_t * job = (metric_job_t *) arg;
+    const bitmap src = job->src, res = job->res;
+    uint32  width = src->width;
+    uint32  per = job->strips / job->bands, rest = job->strips % job->bands;
+    uint32  s0 = band * per + (band < rest ? band : rest);
+    uint32  s1 = s0 + per + (band < rest ? 1 : 0);
+    uint32  y0 = s0 * METRIC_STRIP;
+    uint32  y1 = band == job->bands - 1 ? src->height : s1 * METRIC_STRIP;
+    uint32  yend = y1;
+    uint64  * sse = job->sse + band * 3, * whole = job->whole + band * SUMS;
+
+    if (job->windows && s1 < job->strips)
+        yend = (s1 + 1) * METRIC_STRIP;
+
+    /* one expanded row and the column sums of two strips, the one being
+       summed and the one before it */
+    uint8   * rgb = (uint8 *) malloc(width * 3);
+    uint32  * sums = (uint32 *) calloc(2 * SUMS * width, sizeof(uint32));
+    if (!rgb || !sums) {
+        free(rgb);
+        free(sums);
+        thread_store(&job->failed, 1);
+        return;
+    }
+
+    for (uint32 y = y0; y < yend; y++) {
+        const uint8 * idx = res->data + y * res->rowsize;
+        uint64  skip[3] = { 0, 0, 0 };
+        uint32  s = y / METRIC_STRIP;
+
+        for (uint32 x = 0; x < width; x++)
+            memcpy(rgb + x * 3, &res->pal[idx[x]], 3);
+
+        /* without windows the sums of every row go to the whole image */
+        if (!job->windows) {
+            metric_row(src->data + y * src->rowsize, rgb, width, sse, sums);
+            for (int k = 0; k < SUMS; k++)
+                for (uint32 x = 0; x < width; x++) {
+                    whole[k] += sums[k * width + x];
+                    sums[k * width + x] = 0;
+                }
+            continue;
+        }
+
+        /* strips alternate between the two sets of sums, rows below the
+           last strip only add to the error */
+        uint32  * cur = sums + (s & 1) * SUMS * width;
+        uint32  * prev = sums + (~s & 1) * SUMS * width;
+
+        metric_row(src->data + y * src->rowsize, rgb, width,
+                   y < y1 ? sse : skip, s < job->strips ? cur : NULL);
+        if (y % METRIC_STRIP == METRIC_STRIP - 1 && s > s0 &&
+            s < job->strips) {
+            job->ssim[s - 1] = metric_strip(prev, cur, width);
+            memset(prev, 0, SUMS * width * sizeof(uint32));
+        }
+    }
+
+    free(rgb);
+    free(sums);
+}
+
+/* PSNR of a mean squared error of 8-bit samples */
+static double metric_psnr(double mse) {
+    double  psnr = METRIC_PSNR_MAX;
+
+    if (mse > 0)
+        psnr = 10 * log10(255.0 * 255.0 / mse);
+    return psnr < METRIC_PSNR_MAX ? psnr : METRIC_PSNR_MAX;
+}
+
+/*  metric_compare()
+*   measures the error of the BMF_INDEXED8 bitmap [res] against the RGB24
+*   bitmap [src] it was quantized from: MSE and PSNR of every channel and
+*   of all three, and the mean SSIM of the luma over 8x8 windows placed
+*   every 4 pixels (a single window covering images smaller than that).
+*   Rows are compared in strips of 4, so memory stays proportional to the
+*   width, and the result does not depend on the thread count.
+*/
+bool metric_compare(const bitmap src, const bitmap res, metric_t * m,
+                    int threads) {
+    if (!src || !res || src->format != BMF_RGB24 ||
+        res->format != BMF_INDEXED8 || !res->pal ||
+        src->width != res->width || src->height != res->height ||
+        !src->width || !src->height)
+        return false;
+
+    metric_job_t job = { .src = src, .res = res,
+                         .bands = thread_count(threads),
+                         .strips = src->height / METRIC_STRIP,
+                         .windows = src->width >= METRIC_WINDOW &&
+                                    src->height >= METRIC_WINDOW };
+    if (job.bands > job.strips / METRIC_BAND_MIN)
+        job.bands = job.strips / METRIC_BAND_MIN;
+    if (job.bands < 1)
+        job.bands = 1;
+
+    job.sse = (uint64 *) calloc(job.bands * (3 + SUMS), sizeof(uint64));
+    job.ssim = (double *) calloc(job.strips + 1, sizeof(double));
+    if (!job.sse || !job.ssim) {
+        free(job.sse);
+        free(job.ssim);
+        return false;
+    }
+    job.whole = job.sse + job.bands * 3;
+
+    thread_parallel(job.bands, metric_band, &job);
+    if (job.failed) {
+        free(job.sse);
+        free(job.ssim);
+        return false;
+    }
+
+    /* reductions in a fixed order */
+    double  pixels = (double) src->width * src->height, sum = 0;
+    uint64  total = 0;
+    for (int c = 0; c < 3; c++) {
+        uint64  e = 0;
+
+        for (int b = 0; b < job.bands; b++)
+            e += job.sse[b * 3 + c];
+        total += e;
+        m->mse[c] = e / pixels;
+        m->psnr[c] = metric_psnr(m->mse[c]);
+    }
+    m->mseAll = total / (3 * pixels);
+    m->psnrAll = metric_psnr(m->mseAll);
+
+    if (job.windows) {
+        for (uint32 s = 0; s + 1 < job.strips; s++)
+            sum += job.ssim[s];
+        m->ssim = sum / ((job.strips - 1) *
+                         (src->width / METRIC_STRIP - 1));
+    }
+    else {
+        uint64  whole[SUMS] = { 0 };
+
+        for (int b = 0; b < job.bands; b++)
+            for (int k = 0; k < SUMS; k++)
+                whole[k] += job.whole[b * SUMS + k];
+        m->ssim = metric_ssim(whole, pixels);
+    }
+
+    free(job.sse);
+    free(job.ssim);
+    return true;
+}
@@ -0,0 +1,34 @@
+#ifndef __METRIC_H__
+#define __METRIC_H__ (1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "image.h"
+
+/*------------------------------ QUALITY METRICS -----------------------------*/
+
+/* PSNR reported for channels without any error */
+#define METRIC_PSNR_MAX     (100.0)
+
+/* error of a quantized image against its source */
+typedef struct metric {
+    double  mse[3];             /* mean squared error of R, G and B */
+    double  psnr[3];            /* dB */
+    double  mseAll;             /* over the three channels */
+    double  psnrAll;
+    double  ssim;               /* mean SSIM of the luma, 0 to 1 */
+} metric_t;
+
+/* compares an RGB24 [src] with the BMF_INDEXED8 [res] expanded through
+   its palette, on [threads] threads (0 = every processor). False when
+   the bitmaps do not match or memory runs out. */
+bool    metric_compare(const bitmap src, const bitmap res, metric_t * m,
+                       int threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
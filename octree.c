@@ -0,0 +1,300 @@
+/* OCTREE.C: adaptive palette using an octree over a bounded node pool */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "octree.h"
+#include "thread.h"
+#include "stats.h"
+
+/* fewest rows handed to a mapping thread */
+#define OCTREE_BAND_MIN (16)
+
+/* number of bits set in a child slot */
+static const uint8 octreeBits[8] = { 0, 1, 1, 2, 1, 2, 2, 3 };
+
+/* child slot of a color at [level] */
+static inline int octree_slot(uint8 r, uint8 g, uint8 b, int level) {
+    int shift = 7 - level;
+    return (((r >> shift) & 1) << 2) | (((g >> shift) & 1) << 1) |
+            ((b >> shift) & 1);
+}
+
+/* takes a cleared node from the free list or the untouched pool */
+static uint32 octree_alloc(octree_t * tree, int level) {
+    uint32 n;
+
+    if (tree->free) {
+        n = tree->free;
+        tree->free = tree->pool[n].next;
+        tree->spare--;
+    }
+    else
+        n = tree->used++;
+
+    memset(&tree->pool[n], 0, sizeof(octree_node_t));
+    tree->pool[n].level = level;
+    if (level == OCTREE_DEPTH) {
+        tree->pool[n].leaf = 1;
+        tree->leaves++;
+    }
+    else {
+        /* internal nodes are candidates for reduction */
+        tree->pool[n].next = tree->reducible[level];
+        tree->reducible[level] = n;
+    }
+    return n;
+}
+
+/* folds the children of the deepest reducible node into it, returns false
+   when there is nothing left to reduce */
+static bool octree_reduce(octree_t * tree) {
+    int     level = OCTREE_DEPTH - 1;
+    uint32  n;
+
+    while (level > 0 && !tree->reducible[level])
+        level--;
+    if (!(n = tree->reducible[level]))
+        return false;
+    tree->reducible[level] = tree->pool[n].next;
+
+    octree_node_t * node = &tree->pool[n];
+    for (int i = 0; i < 8; i++) {
+        uint32 c = node->child[i];
+        if (!c)
+            continue;
+        /* deeper levels are fully reduced, so every child is a leaf */
+        node->r     += tree->pool[c].r;
+        node->g     += tree->pool[c].g;
+        node->b     += tree->pool[c].b;
+        node->count += tree->pool[c].count;
+        tree->pool[c].next = tree->free;
+        tree->free = c;
+        tree->spare++;
+        node->child[i] = 0;
+        tree->leaves--;
+    }
+    node->leaf = 1;
+    node->next = 0;
+    tree->leaves++;
+    tree->last = 0;             /* the cached leaf may be gone */
+    return true;
+}
+
+/*  octree_create()
+*   creates an octree reducing to at most [colors] leaves (2..256)
+*/
+octree_t * octree_create(uint32 colors) {
+    octree_t * tree = (octree_t *) calloc(1, sizeof(octree_t));
+
+    if (!tree) return NULL;
+    if (colors < 2)   colors = 2;
+    if (colors > 256) colors = 256;
+
+    /* a tree of L leaves has at most L paths of OCTREE_DEPTH nodes, and an
+       insertion adds one path before the tree is reduced again */
+    tree->colors = colors;
+    tree->size = (colors + 2) * OCTREE_DEPTH + 1;
+    tree->pool = (octree_node_t *) malloc(tree->size * sizeof(octree_node_t));
+    if (!tree->pool) {
+        free(tree);
+        return NULL;
+    }
+
+    /* node 0 is the root, it never goes on a reducible list */
+    memset(&tree->pool[0], 0, sizeof(octree_node_t));
+    tree->used = 1;
+    return tree;
+}
+
+void octree_destroy(octree_t ** tree) {
+    if (*tree) {
+        free((*tree)->pool);
+        free(*tree);
+        *tree = NULL;
+    }
+}
+
+/* accumulates one color, reducing the tree whenever it grows too big */
+static void octree_add(octree_t * tree, uint8 r, uint8 g, uint8 b) {
+    uint32  color = (r << 16) | (g << 8) | b;
+    uint32  n = 0;
+
+    /* runs of the same color hit the cached leaf directly */
+    if (tree->last && tree->lastColor == color)
+        n = tree->last;
+    else {
+        /* make room for a complete new path first */
+        while (tree->size - tree->used + tree->spare < OCTREE_DEPTH &&
+               octree_reduce(tree));
+
+        for (int level = 0; !tree->pool[n].leaf && level < OCTREE_DEPTH; level++) {
+            int slot = octree_slot(r, g, b, level);
+            if (!tree->pool[n].child[slot]) {
+                uint32 c = octree_alloc(tree, level + 1);
+                tree->pool[n].child[slot] = c;
+            }
+            n = tree->pool[n].child[slot];
+        }
+    }
+
+    tree->pool[n].r += r;
+    tree->pool[n].g += g;
+    tree->pool[n].b += b;
+    tree->pool[n].count++;
+    tree->last = n;
+    tree->lastColor = color;
+
+    while (tree->leaves > tree->colors && octree_reduce(tree));
+}
+
+/*  octree_add_row()
+*   feeds an RGB24 scanline into the tree
+*/
+void octree_add_row(octree_t * tree, const uint8 * src, uint32 width) {
+    for (uint32 x = 0; x < width; x++, src += 3)
+        octree_add(tree, src[0], src[1], src[2]);
+}
+
+/* numbers the leaves depth first and averages their colors */
+static void octree_collect(octree_t * tree, uint32 n, rgb_t * pal,
+                           uint32 * count) {
+    octree_node_t * node = &tree->pool[n];
+
+    if (node->leaf) {
+        node->index = *count;
+        if (node->count) {
+            pal[*count].r = node->r / node->count;
+            pal[*count].g = node->g / node->count;
+            pal[*count].b = node->b / node->count;
+        }
+        (*count)++;
+        return;
+    }
+    for (int i = 0; i < 8; i++)
+        if (node->child[i])
+            octree_collect(tree, node->child[i], pal, count);
+}
+
+/*  octree_palette()
+*   builds the palette from the leaves, unused entries are black
+*   returns the number of colors
+*/
+uint32 octree_palette(octree_t * tree, rgb_t * pal) {
+    uint32 count = 0;
+
+    memset(pal, 0, 256 * sizeof(rgb_t));
+    octree_collect(tree, 0, pal, &count);
+    return count;
+}
+
+/*  octree_index()
+*   palette index of a color, valid after octree_palette(). Colors that
+*   were never added descend into the closest existing child.
+*/
+uint8 octree_index(const octree_t * tree, uint8 r, uint8 g, uint8 b) {
+    uint32 n = 0;
+
+    for (int level = 0; !tree->pool[n].leaf; level++) {
+        int slot = octree_slot(r, g, b, level);
+        uint32 c = tree->pool[n].child[slot];
+
+        /* fall back to the child differing in the fewest bits */
+        for (int d = 1; !c && d < 8; d++)
+            for (int i = 0; !c && i < 8; i++)
+                if (octreeBits[i ^ slot] == d)
+                    c = tree->pool[n].child[i];
+        if (!c)
+            break;
+        n = c;
+    }
+    return tree->pool[n].index;
+}
+
+/* shared state of a banded mapping run */
+typedef struct {
+    const octree_t  * tree;
+    const bitmap    src;
+    bitmap          dst;
+    int             bands;
+} octree_job_t;
+
+static void octree_band(void * arg, int band) {
+    octree_job_t * job = (octree_job_t *) arg;
+    uint32  rows = job->src->height / job->bands;
+    uint32  rest = job->src->height % job->bands;
+    uint32  y0 = band * rows + (band < rest ? band : rest);
+    uint32  y1 = y0 + rows + (band < rest ? 1 : 0);
+
+    for (uint32 y = y0; y < y1; y++) {
+        const uint8 * src = job->src->data + y * job->src->rowsize;
+        uint8       * dst = job->dst->data + y * job->dst->rowsize;
+        uint32      last = 0xFFFFFFFF;
+        uint8       k = 0;
+
+        for (uint32 x = 0; x < job->src->width; x++, src += 3) {
+            uint32 color = (src[0] << 16) | (src[1] << 8) | src[2];
+            if (color != last) {
+                k = octree_index(job->tree, src[0], src[1], src[2]);
+                last = color;
+            }
+            dst[x] = k;
+        }
+    }
+}
+
+/*  palette_octree()
+*   computes the octree palette of an RGB24 bitmap without mapping it,
+*   returns the number of colors or 0 on failure
+*/
+uint32 palette_octree(const bitmap bmp, uint32 colors, rgb_t * pal) {
+    if (!bmp) return 0;
+    if (bmp->format != BMF_RGB24) return 0;
+
+    octree_t * tree = octree_create(colors);
+    if (!tree) return 0;
+
+    for (uint32 y = 0; y < bmp->height; y++)
+        octree_add_row(tree, bmp->data + y * bmp->rowsize, bmp->width);
+    double start = stats_start();
+    colors = octree_palette(tree, pal);
+    stats_stop(STATS_CLUT, start);
+
+    octree_destroy(&tree);
+    return colors;
+}
+
+/* RGB quantization using an adaptive octree palette of [colors] entries,
+   the mapping pass runs on [threads] threads (0 = every processor) */
+bitmap quantize_octree(const bitmap bmp, uint32 colors, int threads) {
+    if (!bmp) return NULL;
+    if (bmp->format != BMF_RGB24) return NULL;
+
+    octree_t * tree = octree_create(colors);
+    if (!tree) return NULL;
+
+    /* create output indexed bitmap */
+    bitmap res = bitmap_create(bmp->width, bmp->height, BMF_INDEXED8, true);
+    if (!res) {
+        octree_destroy(&tree);
+        return NULL;
+    }
+
+    /* palette building phase */
+    for (uint32 y = 0; y < bmp->height; y++)
+        octree_add_row(tree, bmp->data + y * bmp->rowsize, bmp->width);
+    double start = stats_start();
+    octree_palette(tree, res->pal);
+    stats_stop(STATS_CLUT, start);
+
+    /* mapping phase, the tree is read-only from now on */
+    octree_job_t job = { tree, bmp, res, thread_count(threads) };
+    if (job.bands > bmp->height / OCTREE_BAND_MIN)
+        job.bands = bmp->height / OCTREE_BAND_MIN;
+    if (job.bands < 1)
+        job.bands = 1;
+    thread_parallel(job.bands, octree_band, &job);
+
+    octree_destroy(&tree);
+    return res;
+}
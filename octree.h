@@ -0,0 +1,50 @@
+#ifndef __OCTREE_H__
+#define __OCTREE_H__ (1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "image.h"
+
+/*---------------------------- OCTREE QUANTIZER ------------------------------*/
+#define OCTREE_DEPTH    (8)     /* leaves hold full 24-bit colors */
+
+typedef struct octree_node {
+    uint64  r, g, b;            /* color sums of a leaf */
+    uint32  count;              /* pixels in a leaf */
+    uint32  child[8];           /* pool indices, 0 = none */
+    uint32  next;               /* reducible list or free list link */
+    uint8   level;
+    uint8   leaf;
+    uint8   index;              /* palette entry of a leaf */
+} octree_node_t;
+
+/* octree over a preallocated node pool, never more than [colors] leaves */
+typedef struct octree_context {
+    octree_node_t   * pool;     /* node 0 is the root */
+    uint32          size;       /* nodes in the pool */
+    uint32          used;       /* nodes ever taken from the pool */
+    uint32          free;       /* head of the recycled nodes list */
+    uint32          spare;      /* nodes on the recycled list */
+    uint32          leaves;
+    uint32          colors;     /* target palette size */
+    uint32          reducible[OCTREE_DEPTH];
+    uint32          last;       /* leaf of the last color added, 0 = none */
+    uint32          lastColor;
+} octree_t;
+
+octree_t *  octree_create(uint32 colors);
+void        octree_destroy(octree_t ** tree);
+void        octree_add_row(octree_t * tree, const uint8 * src, uint32 width);
+uint32      octree_palette(octree_t * tree, rgb_t * pal);
+uint8       octree_index(const octree_t * tree, uint8 r, uint8 g, uint8 b);
+
+uint32      palette_octree(const bitmap bmp, uint32 colors, rgb_t * pal);
+bitmap      quantize_octree(const bitmap bmp, uint32 colors, int threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
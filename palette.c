@@ -0,0 +1,198 @@
+/* PALETTE.C: palette files, union histograms and drift signatures for
+   palettes shared by a set of images */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "palette.h"
+#include "quantize.h"
+
+/* width of the bitmap holding a union histogram */
+#define PALETTE_UNION_WIDTH (1024)
+
+/*  palette_signature()
+*   counts the colors of an RGB24 or BMF_INDEXED8 bitmap into a coarse
+*   histogram, on a regular grid of at most PALETTE_SIG_PIXELS pixels
+*/
+void palette_signature(const bitmap bmp, palette_sig_t * sig) {
+    const int   shift = 8 - PALETTE_SIG_BITS;
+    uint32      grid = 1;
+
+    memset(sig, 0, sizeof(*sig));
+    if (!bmp) return;
+    if (bmp->format != BMF_RGB24 &&
+        (bmp->format != BMF_INDEXED8 || !bmp->pal)) return;
+
+    while ((uint64) ((bmp->width + grid - 1) / grid) *
+                    ((bmp->height + grid - 1) / grid) > PALETTE_SIG_PIXELS)
+        grid++;
+
+    for (uint32 y = grid / 2; y < bmp->height; y += grid) {
+        const uint8 * row = bmp->data + y * bmp->rowsize;
+        for (uint32 x = grid / 2; x < bmp->width; x += grid) {
+            const uint8 * c = bmp->format == BMF_INDEXED8 ?
+                              (const uint8 *) &bmp->pal[row[x]] : row + x * 3;
+            sig->bin[((c[0] >> shift) << (2 * PALETTE_SIG_BITS)) |
+                     ((c[1] >> shift) << PALETTE_SIG_BITS) |
+                      (c[2] >> shift)]++;
+            sig->pixels++;
+        }
+    }
+}
+
+/*  palette_drift()
+*   total variation distance of two signatures: 0 for the same color
+*   distribution, 1 when they share no histogram bin at all
+*/
+double palette_drift(const palette_sig_t * a, const palette_sig_t * b) {
+    double  sum = 0;
+
+    if (!a->pixels || !b->pixels)
+        return 1.0;
+    for (int i = 0; i < PALETTE_SIG_BINS; i++) {
+        double d = (double) a->bin[i] / a->pixels -
+                   (double) b->bin[i] / b->pixels;
+        sum += d < 0 ? -d : d;
+    }
+    return sum / 2;
+}
+
+/*  palette_save()
+*   writes the first [colors] entries of [pal] as a JASC-PAL file, followed
+*   by [sig] when it is not NULL
+*/
+image_result_t palette_save(const char * filename, const rgb_t * pal,
+                            uint32 colors, const palette_sig_t * sig) {
+    FILE    * fp;
+
+    if (!colors || colors > 256) return IMR_FORMAT_INVALID;
+    if (!(fp = fopen(filename, "w"))) return IMR_FILE_CREATE_ERROR;
+
+    fprintf(fp, "JASC-PAL\n0100\n%u\n", colors);
+    for (uint32 i = 0; i < colors; i++)
+        fprintf(fp, "%d %d %d\n", pal[i].r, pal[i].g, pal[i].b);
+
+    if (sig && sig->pixels) {
+        fprintf(fp, "# signature %u\n", sig->pixels);
+        for (int i = 0; i < PALETTE_SIG_BINS; i++)
+            fprintf(fp, "%s%u%s", i % 16 ? " " : "#", sig->bin[i],
+                    i % 16 == 15 ? "\n" : "");
+    }
+
+    if (fclose(fp)) return IMR_FILE_CREATE_ERROR;
+    return IMR_OK;
+}
+
+/*  palette_load()
+*   reads a JASC-PAL file into [pal] and its entry count into [colors].
+*   [sig] receives the stored signature, or none if the file has none.
+*/
+image_result_t palette_load(const char * filename, rgb_t * pal,
+                            uint32 * colors, palette_sig_t * sig) {
+    FILE    * fp;
+    char    magic[16], version[16], hash[2];
+    uint32  count, pixels;
+
+    memset(sig, 0, sizeof(*sig));
+    if (!(fp = fopen(filename, "r"))) return IMR_FILE_NOT_FOUND;
+
+    if (fscanf(fp, "%15s %15s %u", magic, version, &count) != 3 ||
+        strcmp(magic, "JASC-PAL") || strcmp(version, "0100") ||
+        count < 1 || count > 256) {
+        fclose(fp);
+        return IMR_FORMAT_INVALID;
+    }
+    for (uint32 i = 0; i < count; i++) {
+        uint32  r, g, b;
+        if (fscanf(fp, "%u %u %u", &r, &g, &b) != 3 ||
+            r > 255 || g > 255 || b > 255) {
+            fclose(fp);
+            return IMR_FILE_CORRUPTED;
+        }
+        pal[i].r = r;
+        pal[i].g = g;
+        pal[i].b = b;
+    }
+    *colors = count;
+
+    /* the signature is optional, a damaged one is dropped */
+    if (fscanf(fp, " # signature %u", &pixels) == 1) {
+        int i;
+        for (i = 0; i < PALETTE_SIG_BINS; i++) {
+            while (fscanf(fp, " %1[#]", hash) == 1)
+                ;
+            if (fscanf(fp, "%u", &sig->bin[i]) != 1)
+                break;
+        }
+        if (i == PALETTE_SIG_BINS)
+            sig->pixels = pixels;
+        else
+            memset(sig, 0, sizeof(*sig));
+    }
+
+    fclose(fp);
+    return IMR_OK;
+}
+
+/*  palette_union()
+*   samples an even share of [samples] pixels (PALETTE_UNION_PIXELS when 0)
+*   from [bmp] and from each of the [count] bitmap files, and packs them
+*   all into one RGB24 bitmap for the palette generators. NULL when a file
+*   cannot be loaded or memory runs out.
+*/
+bitmap palette_union(const bitmap bmp, const char * const * files, int count,
+                     uint32 samples) {
+    int     parts = count + (bmp != NULL);
+    uint8   * pool = NULL;
+    uint64  used = 0, size = 0;
+
+    if (parts < 1) return NULL;
+    if (!samples) samples = PALETTE_UNION_PIXELS;
+    uint32  share = samples / parts ? samples / parts : 1;
+
+    for (int i = bmp ? -1 : 0; i < count; i++) {
+        bitmap  src = i < 0 ? bmp : image_load(files[i]);
+        bitmap  part = src ? palette_sample(src, share) : NULL;
+
+        if (src != bmp)
+            bitmap_destroy(&src);
+        if (!part) {
+            free(pool);
+            return NULL;
+        }
+
+        /* append the sampled pixels, growing the pool geometrically */
+        uint64  bytes = (uint64) part->width * part->height * 3;
+        if (used + bytes > size) {
+            uint8   * grown;
+            while (used + bytes > size)
+                size = size ? size * 2 : bytes;
+            if (!(grown = (uint8 *) realloc(pool, size))) {
+                bitmap_destroy(&part);
+                free(pool);
+                return NULL;
+            }
+            pool = grown;
+        }
+        for (uint32 y = 0; y < part->height; y++) {
+            memcpy(pool + used, part->data + y * part->rowsize,
+                   part->width * 3);
+            used += part->width * 3;
+        }
+        bitmap_destroy(&part);
+    }
+
+    uint64  pixels = used / 3;
+    uint32  width = pixels < PALETTE_UNION_WIDTH ? pixels : PALETTE_UNION_WIDTH;
+    bitmap  res = width ? bitmap_create(width, (pixels + width - 1) / width,
+                                        BMF_RGB24, false) : NULL;
+    if (res) {
+        /* the short last row is filled up from the start of the pool */
+        for (uint32 y = 0; y < res->height; y++)
+            for (uint32 x = 0; x < width; x++)
+                memcpy(res->data + y * res->rowsize + x * 3,
+                       pool + ((y * (uint64) width + x) % pixels) * 3, 3);
+    }
+    free(pool);
+    return res;
+}
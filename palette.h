@@ -0,0 +1,46 @@
+#ifndef __PALETTE_H__
+#define __PALETTE_H__ (1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "image.h"
+
+/*----------------------------- SHARED PALETTES ------------------------------*/
+
+/* color histogram resolution of a signature, 3 bits per channel */
+#define PALETTE_SIG_BITS    (3)
+#define PALETTE_SIG_BINS    (1 << (3 * PALETTE_SIG_BITS))
+/* pixels looked at for a signature, larger images are sampled */
+#define PALETTE_SIG_PIXELS  (1 << 16)
+/* pixels gathered for a union histogram when no budget is given */
+#define PALETTE_UNION_PIXELS    (1 << 20)
+
+/* coarse color histogram of an image, used to tell when a shared palette
+   no longer fits the images it is applied to */
+typedef struct palette_signature {
+    uint32  pixels;             /* pixels counted, 0 = no signature */
+    uint32  bin[PALETTE_SIG_BINS];
+} palette_sig_t;
+
+void            palette_signature(const bitmap bmp, palette_sig_t * sig);
+double          palette_drift(const palette_sig_t * a, const palette_sig_t * b);
+
+/* palette files are JASC-PAL text files, the signature of the images the
+   palette was built from follows the entries as comment lines */
+image_result_t  palette_save(const char * filename, const rgb_t * pal,
+                             uint32 colors, const palette_sig_t * sig);
+image_result_t  palette_load(const char * filename, rgb_t * pal,
+                             uint32 * colors, palette_sig_t * sig);
+
+/* pools about [samples] pixels of [bmp] (optional) and of every image in
+   [files] into one RGB24 bitmap, the union histogram of the set */
+bitmap          palette_union(const bitmap bmp, const char * const * files,
+                              int count, uint32 samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,202 @@
+/* PNG.C: indexed PNG writer, compressed with the built-in deflate */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+#include "deflate.h"
+#include "stats.h"
+
+typedef enum {  PNG_NONE, PNG_SUB, PNG_UP, PNG_AVERAGE, PNG_PAETH,
+                PNG_FILTERS } png_filter_t;
+
+static void png_put32(uint8 * p, uint32 v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* writes a chunk: length, type, data and the CRC of type and data */
+static bool png_chunk(FILE * fp, const char * type, const uint8 * data,
+                      uint32 len) {
+    uint8   head[8], tail[4];
+
+    png_put32(head, len);
+    memcpy(head + 4, type, 4);
+    png_put32(tail, deflate_crc32(deflate_crc32(0, head + 4, 4), data, len));
+    return fwrite(head, 8, 1, fp) == 1 &&
+           (!len || fwrite(data, len, 1, fp) == 1) &&
+           fwrite(tail, 4, 1, fp) == 1;
+}
+
+static inline uint8 png_paeth(uint8 a, uint8 b, uint8 c) {
+    int     p = a + b - c;
+    int     pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+/* filters [n] bytes of [row] against the row above [up] (zeros for the
+   first one) into [dst], returns the sum of the residuals taken as signed
+   bytes: the smaller, the better it tends to compress */
+static uint32 png_filter(png_filter_t type, const uint8 * row,
+                         const uint8 * up, uint32 n, uint8 * dst) {
+    uint32  sum = 0;
+
+    for (uint32 i = 0; i < n; i++) {
+        uint8   a = i ? row[i - 1] : 0, b = up[i], c = i ? up[i - 1] : 0;
+        uint8   v = row[i];
+
+        switch (type) {
+        case PNG_SUB:       v -= a; break;
+        case PNG_UP:        v -= b; break;
+        case PNG_AVERAGE:   v -= (a + b) >> 1; break;
+        case PNG_PAETH:     v -= png_paeth(a, b, c); break;
+        default:            break;
+        }
+        dst[i] = v;
+        sum += v < 128 ? v : 256 - v;
+    }
+    return sum;
+}
+
+/* packs the indices of a bitmap row at [depth] bits each, leftmost pixel
+   in the high bits */
+static void png_pack(const uint8 * src, uint32 width, uint32 depth,
+                     uint8 * dst) {
+    uint32  per = 8 / depth;
+
+    if (depth == 8) {
+        memcpy(dst, src, width);
+        return;
+    }
+    for (uint32 x = 0; x < width; x += per) {
+        uint32  v = 0;
+
+        for (uint32 k = 0; k < per; k++)
+            v = (v << depth) | (x + k < width ? src[x + k] : 0);
+        *dst++ = v;
+    }
+}
+
+/* builds the filtered scanlines of [b], each one led by its filter type.
+   With [adaptive] set every row gets the filter of least residuals, else
+   rows are left unfiltered. */
+static uint8 * png_scanlines(const bitmap b, uint32 depth, bool adaptive,
+                             uint32 * size) {
+    uint32  n = (b->width * depth + 7) / 8;
+    uint8   * raw, * rows;
+
+    *size = (n + 1) * b->height;
+    raw = (uint8 *) malloc(*size);
+    rows = (uint8 *) calloc(4 * n, 1);      /* above, current, best, trial */
+    if (!raw || !rows) {
+        free(raw);
+        free(rows);
+        return NULL;
+    }
+
+    uint8   * up = rows, * cur = rows + n, * best = rows + 2 * n;
+    uint8   * trial = rows + 3 * n, * t;
+    for (uint32 y = 0; y < b->height; y++) {
+        uint8   * dst = raw + y * (n + 1);
+        uint32  least = ~0u;
+
+        if (!adaptive) {
+            dst[0] = PNG_NONE;
+            png_pack(b->data + y * b->rowsize, b->width, depth, dst + 1);
+            continue;
+        }
+        png_pack(b->data + y * b->rowsize, b->width, depth, cur);
+        for (png_filter_t f = PNG_NONE; f < PNG_FILTERS; f++) {
+            uint32  sum = png_filter(f, cur, up, n, trial);
+
+            if (sum < least) {
+                least = sum;
+                dst[0] = f;
+                t = best; best = trial; trial = t;
+            }
+        }
+        memcpy(dst + 1, best, n);
+        t = up; up = cur; cur = t;
+    }
+    free(rows);
+    return raw;
+}
+
+/*  png_save_level()
+*   indexed PNG writer for BMF_INDEXED8 bitmaps. Indices are packed at 1,
+*   2, 4 or 8 bits depending on the highest one used, the palette is cut
+*   after it, and the scanlines are deflated at [level] (0 to 9, see
+*   deflate_zlib()). Level 9 also tries per row filtering.
+*/
+bool png_save_level(const char * filename, const bitmap * bmp, int level) {
+    uint8   head[13], * raw, * z = NULL;
+    uint32  top = 0, depth = 1, size, cap = 0, len;
+    FILE    * fp;
+    bool    ok;
+    double  start = stats_start();
+
+    if (!bmp || !(*bmp) || (*bmp)->format != BMF_INDEXED8 || !(*bmp)->pal ||
+        !(*bmp)->width || !(*bmp)->height ||
+        (uint64) ((*bmp)->width + 1) * (*bmp)->height > 0x7FFFFFFFu)
+        return false;
+
+    bitmap  b = *bmp;
+    for (uint32 i = 0; i < b->size; i++)
+        top = b->data[i] > top ? b->data[i] : top;
+    while ((1u << depth) <= top)
+        depth <<= 1;
+
+    /* unfiltered rows compress best for most palette images, the best
+       level also tries the filters and keeps the smaller stream */
+    if (!(raw = png_scanlines(b, depth, false, &size)))
+        return false;
+    len = deflate_zlib(raw, size, level, &z, &cap);
+    free(raw);
+    if (len && level >= DEFLATE_BEST &&
+        (raw = png_scanlines(b, depth, true, &size))) {
+        uint8   * alt = NULL;
+        uint32  altcap = 0, altlen;
+
+        altlen = deflate_zlib(raw, size, level, &alt, &altcap);
+        free(raw);
+        if (altlen && altlen < len) {
+            free(z);
+            z = alt;
+            len = altlen;
+        }
+        else
+            free(alt);
+    }
+    if (!len || !(fp = fopen(filename, "wb"))) {
+        free(z);
+        return false;
+    }
+
+    png_put32(head, b->width);
+    png_put32(head + 4, b->height);
+    head[8] = depth;
+    head[9] = 3;                    /* color type: palette */
+    head[10] = head[11] = head[12] = 0;     /* deflate, adaptive, progressive */
+    ok = fwrite("\x89PNG\r\n\x1A\n", 8, 1, fp) == 1 &&
+         png_chunk(fp, "IHDR", head, 13) &&
+         png_chunk(fp, "PLTE", (const uint8 *) b->pal, 3 * (top + 1)) &&
+         png_chunk(fp, "IDAT", z, len) &&
+         png_chunk(fp, "IEND", NULL, 0);
+    free(z);
+    if (ok)
+        stats_write(ftell(fp));
+    if (fclose(fp))
+        ok = false;
+    stats_stop(STATS_ENCODE, start);
+    return ok;
+}
+
+/*  png_save()
+*   png_save_level() at the default level
+*/
+bool png_save(const char * filename, const bitmap * bmp) {
+    return png_save_level(filename, bmp, DEFLATE_DEFAULT);
+}
@@ -0,0 +1,349 @@
+/* PNM.C: Portable Any Map (PBM, PGM, PPM) loader and writer */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "image.h"
+#include "stats.h"
+
+/* skips blanks and comments, a comment runs up to the end of its line */
+static const uint8 * pnm_skip(const uint8 * p, const uint8 * end) {
+    while (p < end) {
+        if (*p == '#')
+            while (p < end && *p != '\n')
+                p++;
+        else
+        if (isspace(*p))
+            p++;
+        else
+            break;
+    }
+    return p;
+}
+
+/* reads the next decimal number, NULL when there is none */
+static const uint8 * pnm_number(const uint8 * p, const uint8 * end,
+                                uint32 * value) {
+    uint32  v = 0;
+
+    p = pnm_skip(p, end);
+    if (p == end || !isdigit(*p))
+        return NULL;
+    for (; p < end && isdigit(*p); p++) {
+        if (v >= 100000000)     /* way past any sane dimension */
+            return NULL;
+        v = v * 10 + (*p - '0');
+    }
+    *value = v;
+    return p;
+}
+
+/*  pnm_parse()
+*   decodes the PNM header at the start of [data], returns its size in bytes
+*   or 0 when it is invalid or does not fit in [size] bytes
+*/
+uint32 pnm_parse(const uint8 * data, uint32 size, PNM_HEADER * hdr) {
+    const uint8 * p = data + 2, * end = data + size;
+    uint32  maxval = 1, channels;
+    uint64  raster;
+
+    if (size < 3 || data[0] != 'P' || data[1] < '1' || data[1] > '6' ||
+        !isspace(data[2]))
+        return 0;
+
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->signature[0] = data[0];
+    hdr->signature[1] = data[1];
+    hdr->type = (PNM_TYPE) (PNM_P1 + data[1] - '1');
+    if (!(p = pnm_number(p, end, &hdr->width)) ||
+        !(p = pnm_number(p, end, &hdr->height)))
+        return 0;
+    if (hdr->type != PNM_P1 && hdr->type != PNM_P4 &&
+        !(p = pnm_number(p, end, &maxval)))
+        return 0;
+    /* a single blank separates the header from the raster */
+    if (!hdr->width || !hdr->height || !maxval || maxval > 65535 ||
+        p == end || !isspace(*p))
+        return 0;
+
+    channels = hdr->type == PNM_P3 || hdr->type == PNM_P6 ? 3 : 1;
+    hdr->maxval = maxval;
+    if (hdr->type == PNM_P1 || hdr->type == PNM_P4)
+        hdr->bitcount = 1;
+    else
+        hdr->bitcount = channels * (maxval > 255 ? 16 : 8);
+
+    if (hdr->type == PNM_P4)
+        raster = (uint64) ((hdr->width + 7) / 8) * hdr->height;
+    else
+    if (hdr->type == PNM_P5 || hdr->type == PNM_P6)
+        raster = (uint64) hdr->width * hdr->height * (hdr->bitcount / 8);
+    else
+        raster = 0;             /* plain variants have no fixed size */
+    if ((uint64) hdr->width * hdr->height * 3 > 0xFFFFFFFFu)
+        return 0;
+    hdr->pixelsize = (uint32) raster;
+    return p + 1 - data;
+}
+
+/* decodes the raster at [src] into RGB24 pixels. Pixels are produced in
+   order and never faster than the raster is consumed, so a raster of 8-bit
+   samples may sit at the end of [dst] itself. */
+static bool pnm_convert(const PNM_HEADER * hdr, const uint8 * src,
+                        const uint8 * end, uint8 * dst) {
+    uint32  count = hdr->width * hdr->height;
+    uint32  maxval = hdr->maxval;
+    bool    plain = hdr->type <= PNM_P3;
+    bool    wide = maxval > 255;
+    bool    ok = true;
+    uint8   * lut = NULL;
+
+    if (hdr->type == PNM_P1 || hdr->type == PNM_P4) {
+        uint32  rowsize = (hdr->width + 7) / 8;
+
+        for (uint32 y = 0; y < hdr->height; y++)
+            for (uint32 x = 0; x < hdr->width; x++) {
+                uint32  bit;
+
+                if (hdr->type == PNM_P4)
+                    bit = (src[y * rowsize + x / 8] >> (7 - x % 8)) & 1;
+                else {
+                    /* plain bits need no blank in between */
+                    src = pnm_skip(src, end);
+                    if (src == end || (*src != '0' && *src != '1'))
+                        return false;
+                    bit = *src++ - '0';
+                }
+                memset(dst, bit ? 0 : 255, 3);      /* 1 is black */
+                dst += 3;
+            }
+        return true;
+    }
+
+    /* samples are scaled to 8 bits through a table */
+    if (maxval != 255) {
+        if (!(lut = (uint8 *) malloc(maxval + 1)))
+            return false;
+        for (uint32 v = 0; v <= maxval; v++)
+            lut[v] = (v * 255 + maxval / 2) / maxval;
+    }
+
+    uint32  channels = hdr->type == PNM_P3 || hdr->type == PNM_P6 ? 3 : 1;
+    for (uint32 i = 0; ok && i < count * channels; i++) {
+        uint32  v;
+
+        if (plain)
+            ok = (src = pnm_number(src, end, &v)) != NULL;
+        else {
+            v = wide ? (src[0] << 8) | src[1] : src[0];     /* big-endian */
+            src += 1 + wide;
+        }
+        if (v > maxval)
+            v = maxval;
+        if (lut)
+            v = lut[v];
+        if (channels == 1) {
+            memset(dst, v, 3);
+            dst += 3;
+        }
+        else
+            *dst++ = v;
+    }
+    free(lut);
+    return ok;
+}
+
+/*  pnm_decode()
+*   PNM loader from a file image held in memory, into an existing bitmap
+*   like pnm_reload(). Every variant is decoded to BMF_RGB24.
+*/
+bitmap pnm_decode(const uint8 * data, uint32 size, bitmap * bmp) {
+    PNM_HEADER  hdr;
+    uint32      skip = pnm_parse(data, size, &hdr);
+
+    if (!skip || size - skip < hdr.pixelsize)
+        return NULL;
+    if (!bitmap_recreate(bmp, hdr.width, hdr.height, BMF_RGB24, false))
+        return NULL;
+    if (hdr.type == PNM_P6 && hdr.maxval == 255)
+        memcpy((*bmp)->data, data + skip, hdr.pixelsize);
+    else
+    if (!pnm_convert(&hdr, data + skip, data + size, (*bmp)->data))
+        return NULL;
+    return *bmp;
+}
+
+/* reads an open PNM file into [bmp] */
+static bitmap pnm_read(FILE * fp, bitmap * bmp) {
+    uint8       head[PNM_HEADER_MAX];
+    PNM_HEADER  hdr;
+    uint32      skip, size, len;
+    uint8       * raster;
+    bool        ok;
+    double      start = stats_start();
+
+    len = fread(head, 1, sizeof(head), fp);
+    if (!(skip = pnm_parse(head, len, &hdr)) ||
+        !bitmap_recreate(bmp, hdr.width, hdr.height, BMF_RGB24, false) ||
+        fseek(fp, skip, SEEK_SET))
+        return NULL;
+    stats_read(skip);
+    stats_stop(STATS_HEADER, start);
+    start = stats_start();
+
+    /* 8-bit rasters are fetched in one read straight into the bitmap: PPM
+       rows are top-down RGB already, PGM ones are expanded in place */
+    size = (*bmp)->size;
+    if ((hdr.type == PNM_P5 || hdr.type == PNM_P6) && hdr.maxval <= 255) {
+        raster = (*bmp)->data + size - hdr.pixelsize;
+        if (fread(raster, 1, hdr.pixelsize, fp) != hdr.pixelsize)
+            return NULL;
+        ok = (hdr.type == PNM_P6 && hdr.maxval == 255) ||
+             pnm_convert(&hdr, raster, raster + hdr.pixelsize, (*bmp)->data);
+        stats_read(hdr.pixelsize);
+        stats_stop(STATS_DECODE, start);
+        return ok ? *bmp : NULL;
+    }
+
+    /* the rest goes through a buffer: bits, 16-bit samples and text */
+    if (!(len = hdr.pixelsize)) {
+        long    end;
+
+        if (fseek(fp, 0, SEEK_END) || (end = ftell(fp)) < (long) skip ||
+            fseek(fp, skip, SEEK_SET))
+            return NULL;
+        len = end - skip;
+    }
+    if (!(raster = (uint8 *) malloc(len ? len : 1)))
+        return NULL;
+    ok = fread(raster, 1, len, fp) == len &&
+         pnm_convert(&hdr, raster, raster + len, (*bmp)->data);
+    free(raster);
+    stats_read(len);
+    stats_stop(STATS_DECODE, start);
+    return ok ? *bmp : NULL;
+}
+
+/*  pnm_load()
+*   PNM easy loader, reads the binary (P4, P5, P6) and plain (P1, P2, P3)
+*   variants with any maximum value into a BMF_RGB24 bitmap
+*/
+bitmap pnm_load(const char * filename) {
+    bitmap  bmp = NULL;
+
+    if (!pnm_reload(filename, &bmp))
+        bitmap_destroy(&bmp);
+    return bmp;
+}
+
+/*  pnm_reload()
+*   PNM loader into an existing bitmap, whose memory is reused when large
+*   enough (see bitmap_recreate())
+*/
+bitmap pnm_reload(const char * filename, bitmap * bmp) {
+    FILE    * fp = fopen(filename, "rb");
+    bitmap  res;
+
+    if (!fp)
+        return NULL;
+    res = pnm_read(fp, bmp);
+    fclose(fp);
+    return res;
+}
+
+/* red, green and blue of pixel [x] of a row of [b] */
+static const uint8 * pnm_pixel(const bitmap b, const uint8 * src, uint32 x) {
+    uint32  bits, at, index;
+
+    if (b->format == BMF_RGB24)
+        return src + x * 3;
+    if (b->format == BMF_RGB32)
+        return src + x * 4 + 1;                         /* ARGB */
+    /* packed indices, leftmost pixel in the high bits */
+    bits = b->format;
+    at = x * bits;
+    index = (src[at / 8] >> (8 - bits - at % 8)) & ((1 << bits) - 1);
+    return (const uint8 *) &b->pal[index];
+}
+
+/*  pnm_save()
+*   PNM easy writer, the extension picks the variant: a binary PGM (P5)
+*   for .pgm, a binary PBM (P4) for .pbm, a binary PPM (P6) otherwise.
+*   Fails when the image has colors a PGM cannot hold, or colors other
+*   than black and white for a PBM. RGB24 bitmaps go to a PPM in one go,
+*   the rest is converted row by row.
+*/
+bool pnm_save(const char * filename, const bitmap * bmp) {
+    const char  * dot = strrchr(filename, '.');
+    char    ext[5] = "";
+    FILE    * fp;
+    uint8   * row = NULL;
+    uint32  type = 6, line;
+    bool    ok;
+    double  start = stats_start();
+
+    if (!bmp || !(*bmp))
+        return false;
+
+    bitmap  b = *bmp;
+    if (b->format != BMF_RGB24 && b->format != BMF_RGB32 && !b->pal)
+        return false;
+    if (dot && strlen(dot) < sizeof(ext))
+        for (int i = 0; dot[i]; i++)
+            ext[i] = tolower((uint8) dot[i]);
+    if (!strcmp(ext, ".pgm"))
+        type = 5;
+    if (!strcmp(ext, ".pbm"))
+        type = 4;
+    line = type == 6 ? b->width * 3 : type == 5 ? b->width : (b->width + 7) / 8;
+
+    /* grey levels, or black and white, only */
+    for (uint32 y = 0; type != 6 && y < b->height; y++)
+        for (uint32 x = 0; x < b->width; x++) {
+            const uint8 * c = pnm_pixel(b, b->data + y * b->rowsize, x);
+
+            if (c[0] != c[1] || c[1] != c[2] ||
+                (type == 4 && c[0] != 0 && c[0] != 255))
+                return false;
+        }
+    if (!(fp = fopen(filename, "wb")))
+        return false;
+
+    ok = type == 4 ? fprintf(fp, "P4\n%u %u\n", b->width, b->height) > 0 :
+                     fprintf(fp, "P%u\n%u %u\n255\n", type, b->width,
+                             b->height) > 0;
+    if (type == 6 && b->format == BMF_RGB24)
+        ok = ok && fwrite(b->data, 1, b->size, fp) == b->size;
+    else
+    if (!(row = (uint8 *) malloc(line)))
+        ok = false;
+    else
+        for (uint32 y = 0; ok && y < b->height; y++) {
+            const uint8 * src = b->data + y * b->rowsize;
+
+            if (type == 4)
+                memset(row, 0, line);
+            for (uint32 x = 0; x < b->width; x++) {
+                const uint8 * c = pnm_pixel(b, src, x);
+
+                if (type == 6)
+                    memcpy(row + x * 3, c, 3);
+                else
+                if (type == 5)
+                    row[x] = c[0];
+                else
+                if (!c[0])                              /* 1 is black */
+                    row[x / 8] |= 0x80 >> (x % 8);
+            }
+            ok = fwrite(row, 1, line, fp) == line;
+        }
+
+    free(row);
+    if (ok)
+        stats_write(ftell(fp));
+    if (fclose(fp))
+        ok = false;
+    stats_stop(STATS_ENCODE, start);
+    return ok;
+}
@@ -0,0 +1,586 @@
+/* QUANTIZE.C: uniform 3-3-2 palette quantizer with vectorized kernels */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "quantize.h"
+#include "octree.h"
+#include "wu.h"
+#include "median.h"
+#include "simd.h"
+#include "thread.h"
+#include "stats.h"
+
+/* fewest rows handed to a quantization thread */
+#define UNIFORM_BAND_MIN    (16)
+
+#if defined(SIMD_X86)
+    #include <immintrin.h>
+#elif defined(SIMD_ARM)
+    #include <arm_neon.h>
+#endif
+
+/* for ordered dithering */
+const uint8 bayerMatrix[16] = { 0,  8,  2, 10,
+                               12,  4, 14,  6,
+                                3, 11,  1,  9,
+                               15,  7, 13,  5};
+
+/* palette generator names, in palette_t order */
+static const char * paletteNames[] = { "uniform", "octree", "wu", "median" };
+
+/*  palette_parse()
+*   looks up a palette generator by name
+*/
+bool palette_parse(const char * name, palette_t * palette) {
+    for (int i = 0; i < sizeof(paletteNames) / sizeof(paletteNames[0]); i++)
+        if (!strcmp(name, paletteNames[i])) {
+            *palette = (palette_t) i;
+            return true;
+        }
+    return false;
+}
+
+const char * palette_name(palette_t palette) {
+    return paletteNames[palette];
+}
+
+/*  palette_generate()
+*   builds the palette of an RGB24 bitmap without mapping it, for the
+*   remapper, error diffusion and k-means refinement. The uniform generator
+*   gives the same cube averages as quantize_uniform(). Returns the number
+*   of colors or 0 on failure.
+*/
+uint32 palette_generate(const bitmap bmp, palette_t palette, uint32 colors,
+                        rgb_t * pal, int threads) {
+    switch (palette) {
+    case PALETTE_OCTREE:    return palette_octree(bmp, colors, pal);
+    case PALETTE_WU:        return palette_wu(bmp, colors, pal, threads);
+    case PALETTE_MEDIAN:    return palette_median(bmp, colors, pal);
+    default:
+        break;
+    }
+
+    if (!bmp || bmp->format != BMF_RGB24) return 0;
+
+    cubes   hist = {{0}};
+    uint8   * row = (uint8 *) malloc(bmp->width ? bmp->width : 1);
+
+    if (!row) return 0;
+    for (uint32 y = 0; y < bmp->height; y++)
+        quantize_uniform_row(bmp->data + y * bmp->rowsize, row, bmp->width,
+                             y, false, hist);
+    free(row);
+
+    quantize_uniform_clut(hist, pal);
+    return 256;
+}
+
+/*  palette_sample()
+*   picks at most [samples] pixels of an RGB24 bitmap into a smaller RGB24
+*   bitmap, for palette statistics. The image is cut into a regular grid
+*   and one pixel is taken from every cell, at a pseudo-random spot so
+*   periodic patterns do not alias. BMF_INDEXED8 bitmaps are expanded
+*   through their palette. NULL when out of memory.
+*/
+bitmap palette_sample(const bitmap bmp, uint32 samples) {
+    uint32  grid = 1;
+
+    if (!bmp) return NULL;
+    if (bmp->format != BMF_RGB24 &&
+        (bmp->format != BMF_INDEXED8 || !bmp->pal)) return NULL;
+
+    if (samples < 1)
+        samples = 1;
+    while ((uint64) ((bmp->width + grid - 1) / grid) *
+                    ((bmp->height + grid - 1) / grid) > samples)
+        grid++;
+
+    bitmap res = bitmap_create((bmp->width + grid - 1) / grid,
+                               (bmp->height + grid - 1) / grid, BMF_RGB24,
+                               false);
+    if (!res) return NULL;
+
+    for (uint32 j = 0; j < res->height; j++)
+        for (uint32 i = 0; i < res->width; i++) {
+            /* spot inside the cell, clipped to the last partial cells */
+            uint32  h = (i * 0x9E3779B1u) ^ (j * 0x85EBCA77u);
+            uint32  x, y;
+
+            h ^= h >> 15;
+            h *= 0x2C1B3C6Du;
+            h ^= h >> 13;
+            x = i * grid + h % grid;
+            y = j * grid + (h >> 16) % grid;
+            if (x >= bmp->width)  x = bmp->width - 1;
+            if (y >= bmp->height) y = bmp->height - 1;
+            if (bmp->format == BMF_INDEXED8)
+                memcpy(res->data + j * res->rowsize + i * 3,
+                       &bmp->pal[bmp->data[y * bmp->rowsize + x]], 3);
+            else
+                memcpy(res->data + j * res->rowsize + i * 3,
+                       bmp->data + y * bmp->rowsize + x * 3, 3);
+        }
+    return res;
+}
+
+/* transfer curve of the cube averages, set once before any worker starts,
+   and its decoding table: 8-bit value to 16-bit linear light. Without a
+   curve the table is not used, the cubes sum the values themselves. */
+static gamma_t  gammaCurve = GAMMA_NONE;
+static uint16   gammaLinear[256];
+
+/*  gamma_parse()
+*   reads a transfer curve: none, srgb or the exponent of a power law
+*/
+bool gamma_parse(const char * name, gamma_t * curve, double * exponent) {
+    char    * end;
+
+    *exponent = 0;
+    if (!strcmp(name, "none"))
+        *curve = GAMMA_NONE;
+    else
+    if (!strcmp(name, "srgb"))
+        *curve = GAMMA_SRGB;
+    else {
+        *exponent = strtod(name, &end);
+        if (end == name || *end || *exponent < 0.1 || *exponent > 10)
+            return false;
+        *curve = GAMMA_POWER;
+    }
+    return true;
+}
+
+/*  gamma_set()
+*   builds the 256-entry decoding table of [curve] once, so the quantizer
+*   only looks values up
+*/
+void gamma_set(gamma_t curve, double exponent) {
+    gammaCurve = curve;
+    for (int i = 0; curve != GAMMA_NONE && i < 256; i++) {
+        double  c = i / 255.0;
+
+        if (curve == GAMMA_SRGB)
+            c = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+        else
+            c = pow(c, exponent);
+        gammaLinear[i] = (uint16) (c * 65535.0 + 0.5);
+    }
+}
+
+gamma_t gamma_get(void) {
+    return gammaCurve;
+}
+
+/* 8-bit value whose linear light is nearest to [v], by bisection of the
+   increasing decoding table */
+static uint8 gamma_encode(uint32 v) {
+    int     lo = 0, hi = 255;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (gammaLinear[mid] < v)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo && v - gammaLinear[lo - 1] < gammaLinear[lo] - v)
+        lo--;
+    return lo;
+}
+
+/* reference kernel, quantizes pixels [x, width) of a scanline */
+static void uniform_row_scalar(const uint8 * src, uint8 * dst, uint32 x,
+                               uint32 width, uint32 y, bool dither,
+                               cube * hist, bool bgr) {
+    /* channel offsets of red and blue inside a pixel */
+    const int ir = bgr ? 2 : 0, ib = bgr ? 0 : 2;
+
+    src += x * 3;
+    dst += x;
+    for (; x < width; x++, src += 3) {
+        /* dithering if needed */
+        int t = dither ? (bayerMatrix[((y & 3) << 2) + (x & 3)] - 8) : 0;
+        int r = clamp(src[ir] + (t << 1));
+        int g = clamp(src[1]  + (t << 1));
+        int b = clamp(src[ib] + (t << 1));
+
+        /* quantize */
+        uint8 k = ((b >> 5) << 5) + ((g >> 5) << 2) + (r >> 6);
+        (*dst++) = k;
+
+        /* preparing RGB cubes for CLUT, in linear light with a curve */
+        if (hist && gammaCurve != GAMMA_NONE) {
+            hist[k].r += gammaLinear[r];
+            hist[k].g += gammaLinear[g];
+            hist[k].b += gammaLinear[b];
+            hist[k].count++;
+        }
+        else
+        if (hist) {
+            hist[k].r += r;
+            hist[k].g += g;
+            hist[k].b += b;
+            hist[k].count++;
+        }
+    }
+}
+
+/* builds the per-lane dither offsets of scanline [y], split into the
+   positive and negative parts for the saturating add/subtract */
+static void uniform_row_offsets(uint32 y, bool dither, uint8 * add,
+                                uint8 * sub, int lanes) {
+    for (int i = 0; i < lanes; i++) {
+        int t = dither ? (bayerMatrix[((y & 3) << 2) + (i & 3)] - 8) * 2 : 0;
+        add[i] = t > 0 ?  t : 0;
+        sub[i] = t < 0 ? -t : 0;
+    }
+}
+
+/* feeds the clamped channels of a vector block into the color cubes,
+   through the decoding table when a curve is set */
+static inline void uniform_row_cubes(const uint8 * idx, const uint8 * r,
+                                     const uint8 * g, const uint8 * b,
+                                     int lanes, cube * hist) {
+    if (gammaCurve != GAMMA_NONE)
+        for (int i = 0; i < lanes; i++) {
+            cube * c = &hist[idx[i]];
+            c->r += gammaLinear[r[i]];
+            c->g += gammaLinear[g[i]];
+            c->b += gammaLinear[b[i]];
+            c->count++;
+        }
+    else
+        for (int i = 0; i < lanes; i++) {
+            cube * c = &hist[idx[i]];
+            c->r += r[i];
+            c->g += g[i];
+            c->b += b[i];
+            c->count++;
+        }
+}
+
+#if defined(SIMD_X86)
+
+SIMD_TARGET("sse2")
+static void uniform_row_sse2(const uint8 * src, uint8 * dst, uint32 width,
+                             uint32 y, bool dither, cube * hist, bool bgr) {
+    uint8   add[16], sub[16], r[16], g[16], b[16];
+    uint32  x = 0;
+
+    uniform_row_offsets(y, dither, add, sub, 16);
+    const __m128i vadd  = _mm_loadu_si128((const __m128i *) add);
+    const __m128i vsub  = _mm_loadu_si128((const __m128i *) sub);
+    const __m128i maskb = _mm_set1_epi8((char) 0xE0);
+    const __m128i maskg = _mm_set1_epi8(0x1C);
+    const __m128i maskr = _mm_set1_epi8(0x03);
+
+    for (; x + 16 <= width; x += 16) {
+        const uint8 * p = src + x * 3;
+        __m128i vr = _mm_loadu_si128((const __m128i *) (p + 0));
+        __m128i vg = _mm_loadu_si128((const __m128i *) (p + 16));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (p + 32));
+
+        DEINTERLEAVE3(_mm_unpacklo_epi8, _mm_unpackhi_epi64, vr, vg, vb);
+        if (bgr) {
+            __m128i t = vr; vr = vb; vb = t;
+        }
+
+        /* clamp(c + t) as a saturating add followed by a saturating sub */
+        vr = _mm_subs_epu8(_mm_adds_epu8(vr, vadd), vsub);
+        vg = _mm_subs_epu8(_mm_adds_epu8(vg, vadd), vsub);
+        vb = _mm_subs_epu8(_mm_adds_epu8(vb, vadd), vsub);
+
+        /* pack into (b >> 5) << 5 | (g >> 5) << 2 | r >> 6 */
+        __m128i k = _mm_or_si128(
+                        _mm_and_si128(vb, maskb),
+                        _mm_or_si128(
+                            _mm_and_si128(_mm_srli_epi16(vg, 3), maskg),
+                            _mm_and_si128(_mm_srli_epi16(vr, 6), maskr)));
+
+        _mm_storeu_si128((__m128i *) (dst + x), k);
+        if (hist) {
+            _mm_storeu_si128((__m128i *) r, vr);
+            _mm_storeu_si128((__m128i *) g, vg);
+            _mm_storeu_si128((__m128i *) b, vb);
+            uniform_row_cubes(dst + x, r, g, b, 16, hist);
+        }
+    }
+    uniform_row_scalar(src, dst, x, width, y, dither, hist, bgr);
+}
+
+SIMD_TARGET("avx2")
+static void uniform_row_avx2(const uint8 * src, uint8 * dst, uint32 width,
+                             uint32 y, bool dither, cube * hist, bool bgr) {
+    uint8   add[32], sub[32], r[32], g[32], b[32];
+    uint32  x = 0;
+
+    uniform_row_offsets(y, dither, add, sub, 32);
+    const __m256i vadd  = _mm256_loadu_si256((const __m256i *) add);
+    const __m256i vsub  = _mm256_loadu_si256((const __m256i *) sub);
+    const __m256i maskb = _mm256_set1_epi8((char) 0xE0);
+    const __m256i maskg = _mm256_set1_epi8(0x1C);
+    const __m256i maskr = _mm256_set1_epi8(0x03);
+
+    for (; x + 32 <= width; x += 32) {
+        const uint8 * p = src + x * 3;
+        /* the unpacks work within 128-bit lanes, so the low lane gets
+           pixels 0..15 and the high lane pixels 16..31 */
+        __m256i vr = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                        _mm_loadu_si128((const __m128i *) (p + 0))),
+                        _mm_loadu_si128((const __m128i *) (p + 48)), 1);
+        __m256i vg = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                        _mm_loadu_si128((const __m128i *) (p + 16))),
+                        _mm_loadu_si128((const __m128i *) (p + 64)), 1);
+        __m256i vb = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                        _mm_loadu_si128((const __m128i *) (p + 32))),
+                        _mm_loadu_si128((const __m128i *) (p + 80)), 1);
+
+        DEINTERLEAVE3(_mm256_unpacklo_epi8, _mm256_unpackhi_epi64, vr, vg, vb);
+        if (bgr) {
+            __m256i t = vr; vr = vb; vb = t;
+        }
+
+        vr = _mm256_subs_epu8(_mm256_adds_epu8(vr, vadd), vsub);
+        vg = _mm256_subs_epu8(_mm256_adds_epu8(vg, vadd), vsub);
+        vb = _mm256_subs_epu8(_mm256_adds_epu8(vb, vadd), vsub);
+
+        __m256i k = _mm256_or_si256(
+                        _mm256_and_si256(vb, maskb),
+                        _mm256_or_si256(
+                            _mm256_and_si256(_mm256_srli_epi16(vg, 3), maskg),
+                            _mm256_and_si256(_mm256_srli_epi16(vr, 6), maskr)));
+
+        _mm256_storeu_si256((__m256i *) (dst + x), k);
+        if (hist) {
+            _mm256_storeu_si256((__m256i *) r, vr);
+            _mm256_storeu_si256((__m256i *) g, vg);
+            _mm256_storeu_si256((__m256i *) b, vb);
+            uniform_row_cubes(dst + x, r, g, b, 32, hist);
+        }
+    }
+    uniform_row_scalar(src, dst, x, width, y, dither, hist, bgr);
+}
+
+#endif
+
+#if defined(SIMD_ARM)
+
+static void uniform_row_neon(const uint8 * src, uint8 * dst, uint32 width,
+                             uint32 y, bool dither, cube * hist, bool bgr) {
+    uint8   add[16], sub[16], r[16], g[16], b[16];
+    uint32  x = 0;
+
+    uniform_row_offsets(y, dither, add, sub, 16);
+    const uint8x16_t vadd  = vld1q_u8(add);
+    const uint8x16_t vsub  = vld1q_u8(sub);
+    const uint8x16_t maskb = vdupq_n_u8(0xE0);
+
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x3_t px = vld3q_u8(src + x * 3);
+        uint8x16_t vr = vqsubq_u8(vqaddq_u8(px.val[bgr ? 2 : 0], vadd), vsub);
+        uint8x16_t vg = vqsubq_u8(vqaddq_u8(px.val[1], vadd), vsub);
+        uint8x16_t vb = vqsubq_u8(vqaddq_u8(px.val[bgr ? 0 : 2], vadd), vsub);
+
+        uint8x16_t k = vorrq_u8(vandq_u8(vb, maskb),
+                                vorrq_u8(vshlq_n_u8(vshrq_n_u8(vg, 5), 2),
+                                         vshrq_n_u8(vr, 6)));
+
+        vst1q_u8(dst + x, k);
+        if (hist) {
+            vst1q_u8(r, vr);
+            vst1q_u8(g, vg);
+            vst1q_u8(b, vb);
+            uniform_row_cubes(dst + x, r, g, b, 16, hist);
+        }
+    }
+    uniform_row_scalar(src, dst, x, width, y, dither, hist, bgr);
+}
+
+#endif
+
+/* dispatches a scanline to the fastest kernel available */
+static void uniform_row(const uint8 * src, uint8 * dst, uint32 width,
+                        uint32 y, bool dither, cube * hist, bool bgr) {
+    switch (simd_level()) {
+#if defined(SIMD_X86)
+    case SIMD_AVX2:
+        uniform_row_avx2(src, dst, width, y, dither, hist, bgr);
+        return;
+    case SIMD_SSE2:
+        uniform_row_sse2(src, dst, width, y, dither, hist, bgr);
+        return;
+#endif
+#if defined(SIMD_ARM)
+    case SIMD_NEON:
+        uniform_row_neon(src, dst, width, y, dither, hist, bgr);
+        return;
+#endif
+    default:
+        break;
+    }
+    uniform_row_scalar(src, dst, 0, width, y, dither, hist, bgr);
+}
+
+/*  quantize_uniform_row()
+*   quantizes a single RGB24 scanline using the fastest kernel available
+*/
+void quantize_uniform_row(const uint8 * src, uint8 * dst, uint32 width,
+                          uint32 y, bool dither, cube * hist) {
+    uniform_row(src, dst, width, y, dither, hist, false);
+}
+
+/*  quantize_uniform_row_bgr()
+*   same as quantize_uniform_row() for scanlines in the B, G, R order of
+*   the BMP file itself, e.g. read in place from a mapping
+*/
+void quantize_uniform_row_bgr(const uint8 * src, uint8 * dst, uint32 width,
+                              uint32 y, bool dither, cube * hist) {
+    uniform_row(src, dst, width, y, dither, hist, true);
+}
+
+/*  quantize_uniform_clut()
+*   generates a uniform CLUT based on the quantized colors. Cubes summed
+*   in linear light are averaged there, rounded, and encoded back.
+*/
+void quantize_uniform_clut(const cube * hist, rgb_t * pal) {
+    double  start = stats_start();
+
+    for (int i = 0; i < 256; i++)
+        if (hist[i].count && gammaCurve != GAMMA_NONE) {
+            uint64  n = hist[i].count;
+
+            pal[i].r = gamma_encode((hist[i].r + n / 2) / n);
+            pal[i].g = gamma_encode((hist[i].g + n / 2) / n);
+            pal[i].b = gamma_encode((hist[i].b + n / 2) / n);
+        }
+        else
+        if (hist[i].count) {
+            pal[i].r = (hist[i].r / hist[i].count);
+            pal[i].g = (hist[i].g / hist[i].count);
+            pal[i].b = (hist[i].b / hist[i].count);
+        }
+        else {
+            pal[i].r = 0;
+            pal[i].g = 0;
+            pal[i].b = 0;
+        }
+    stats_stop(STATS_CLUT, start);
+}
+
+/* shared state of a banded quantization run */
+typedef struct {
+    const bitmap    src;
+    bitmap          dst;
+    bool            dither;
+    int             bands;
+    cube            * hist;     /* one set of cubes per band */
+} uniform_job_t;
+
+/* quantizes one horizontal band of rows into its own cubes, if any */
+static void uniform_band(void * arg, int band) {
+    uniform_job_t * job = (uniform_job_t *) arg;
+    uint32  rows = job->src->height / job->bands;
+    uint32  rest = job->src->height % job->bands;
+    uint32  y0 = band * rows + (band < rest ? band : rest);
+    uint32  y1 = y0 + rows + (band < rest ? 1 : 0);
+    uint8   * src = job->src->data + y0 * job->src->rowsize;
+    uint8   * dst = job->dst->data + y0 * job->dst->rowsize;
+    cube    * hist = job->hist ? job->hist + band * 256 : NULL;
+
+    for (uint32 y = y0; y < y1; y++) {
+        quantize_uniform_row(src, dst, job->src->width, y, job->dither, hist);
+        src += job->src->rowsize;
+        dst += job->dst->rowsize;
+    }
+}
+
+/* splits into row bands, small images are not worth a thread */
+static int uniform_bands(const bitmap bmp, int threads) {
+    int bands = thread_count(threads);
+
+    if (bands > bmp->height / UNIFORM_BAND_MIN)
+        bands = bmp->height / UNIFORM_BAND_MIN;
+    return bands < 1 ? 1 : bands;
+}
+
+/* fast RGB quantization, [threads] = 0 uses every processor */
+bitmap quantize_uniform(const bitmap bmp, bool dither, int threads) {
+    if (!bmp) return NULL;
+    if (bmp->format != BMF_RGB24) return NULL;
+
+    /* create output indexed bitmap */
+    bitmap res = bitmap_create(bmp->width, bmp->height, BMF_INDEXED8, true);
+    if (!res) return NULL;
+
+    cubes uniCubes = {{0}};     /* RGB cubes */
+    uniform_job_t job = { bmp, res, dither, uniform_bands(bmp, threads),
+                          uniCubes };
+
+    if (job.bands > 1 &&
+        !(job.hist = (cube *) calloc(job.bands * 256, sizeof(cube)))) {
+        job.bands = 1;
+        job.hist = uniCubes;
+    }
+
+    /* quantization phase */
+    thread_parallel(job.bands, uniform_band, &job);
+
+    /* reduce the per-band cubes, integer sums keep this order independent */
+    if (job.hist != uniCubes) {
+        for (int t = 0; t < job.bands; t++)
+            for (int i = 0; i < 256; i++) {
+                uniCubes[i].r     += job.hist[t * 256 + i].r;
+                uniCubes[i].g     += job.hist[t * 256 + i].g;
+                uniCubes[i].b     += job.hist[t * 256 + i].b;
+                uniCubes[i].count += job.hist[t * 256 + i].count;
+            }
+        free(job.hist);
+    }
+
+    quantize_uniform_clut(uniCubes, res->pal);
+    return res;
+}
+
+/*  quantize_uniform_sampled()
+*   same quantization as quantize_uniform(), but the CLUT is averaged over
+*   [sample] only (see palette_sample()), so the full image is mapped in a
+*   single pass that gathers no statistics
+*/
+bitmap quantize_uniform_sampled(const bitmap bmp, const bitmap sample,
+                                bool dither, int threads) {
+    if (!bmp || !sample) return NULL;
+    if (bmp->format != BMF_RGB24 || sample->format != BMF_RGB24) return NULL;
+
+    /* create output indexed bitmap */
+    bitmap res = bitmap_create(bmp->width, bmp->height, BMF_INDEXED8, true);
+    if (!res) return NULL;
+
+    /* CLUT from the sample */
+    cubes   uniCubes = {{0}};
+    uint8   * row = (uint8 *) malloc(sample->width ? sample->width : 1);
+    if (!row) {
+        bitmap_destroy(&res);
+        return NULL;
+    }
+    for (uint32 y = 0; y < sample->height; y++)
+        quantize_uniform_row(sample->data + y * sample->rowsize, row,
+                             sample->width, y, dither, uniCubes);
+    free(row);
+    quantize_uniform_clut(uniCubes, res->pal);
+
+    /* the full image may fall into cubes the sample missed, they get the
+       centre of their cube rather than black */
+    for (int i = 0; i < 256; i++)
+        if (!uniCubes[i].count) {
+            res->pal[i].r = (i & 3) * 64 + 32;
+            res->pal[i].g = (i >> 2 & 7) * 32 + 16;
+            res->pal[i].b = (i >> 5) * 32 + 16;
+        }
+
+    uniform_job_t job = { bmp, res, dither, uniform_bands(bmp, threads), NULL };
+    thread_parallel(job.bands, uniform_band, &job);
+    return res;
+}
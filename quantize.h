@@ -0,0 +1,72 @@
+#ifndef __QUANTIZE_H__
+#define __QUANTIZE_H__ (1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "image.h"
+
+/*--------------------------- COLOR ACCUMULATORS -----------------------------*/
+
+/* sums of 8-bit or, in linear light, 16-bit values: 64 bits do not
+   overflow on any image size, and four equal fields update as one vector */
+typedef struct cube_t {
+    uint64  r, g, b;
+    uint64  count;
+} cube, cubes[256];
+
+/* for ordered dithering */
+extern const uint8 bayerMatrix[16];
+
+/* slightly fast color clamping */
+static inline uint8 clamp(int n) {
+    n &= -(n >= 0);
+    return n | ((255 - n) >> 31);
+}
+
+/*------------------------------ TRANSFER CURVES -----------------------------*/
+typedef enum {  GAMMA_NONE,         /* average the 8-bit values themselves */
+                GAMMA_SRGB,         /* IEC 61966-2-1 curve */
+                GAMMA_POWER         /* pure power law */
+            } gamma_t;
+
+/* "none", "srgb" or an exponent such as 2.2 */
+bool            gamma_parse(const char * name, gamma_t * curve,
+                            double * exponent);
+/* makes the uniform quantizer average colors in linear light through
+   [curve], building its tables. Call before any quantization starts. */
+void            gamma_set(gamma_t curve, double exponent);
+gamma_t         gamma_get(void);
+
+/*---------------------------- PALETTE GENERATORS ----------------------------*/
+typedef enum {  PALETTE_UNIFORM,    /* fixed 3-3-2 partitioning */
+                PALETTE_OCTREE,     /* adaptive, octree reduction */
+                PALETTE_WU,         /* adaptive, Wu's variance minimization */
+                PALETTE_MEDIAN      /* adaptive, median cut */
+            } palette_t;
+
+bool            palette_parse(const char * name, palette_t * palette);
+const char *    palette_name(palette_t palette);
+uint32          palette_generate(const bitmap bmp, palette_t palette,
+                                 uint32 colors, rgb_t * pal, int threads);
+bitmap          palette_sample(const bitmap bmp, uint32 samples);
+
+/*--------------------------- UNIFORM QUANTIZER ------------------------------*/
+
+/* quantizes one RGB24 scanline [y] into 3-3-2 indices, accumulating the
+   colors of every index into [hist] unless it is NULL */
+void    quantize_uniform_row(const uint8 * src, uint8 * dst, uint32 width,
+                             uint32 y, bool dither, cube * hist);
+void    quantize_uniform_row_bgr(const uint8 * src, uint8 * dst, uint32 width,
+                                 uint32 y, bool dither, cube * hist);
+void    quantize_uniform_clut(const cube * hist, rgb_t * pal);
+bitmap  quantize_uniform(const bitmap bmp, bool dither, int threads);
+bitmap  quantize_uniform_sampled(const bitmap bmp, const bitmap sample,
+                                 bool dither, int threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,299 @@
+/* REMAP.C: nearest palette color mapping through an inverse colormap */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "remap.h"
+#include "quantize.h"
+#include "thread.h"
+
+/* fewest rows handed to a mapping thread */
+#define REMAP_BAND_MIN  (16)
+
+#define REMAP_SHIFT     (8 - REMAP_BITS)
+/* cell values: 0 = not filled yet, REMAP_ONE | index for cells with a
+   single candidate, otherwise 1 + offset of the candidate list */
+#define REMAP_ONE       (0x80000000)
+
+/* squared distance from a channel value to a palette channel */
+static inline int remap_sq(int a, int b) {
+    return (a - b) * (a - b);
+}
+
+/*  remap_create()
+*   prepares the mapping onto the first [colors] entries of [pal]
+*/
+remap_t * remap_create(const rgb_t * pal, uint32 colors) {
+    remap_t * map = (remap_t *) calloc(1, sizeof(remap_t));
+
+    if (!map) return NULL;
+    if (colors < 1)   colors = 1;
+    if (colors > 256) colors = 256;
+
+    memcpy(map->pal, pal, colors * sizeof(rgb_t));
+    map->colors = colors;
+    map->cell = (uint32 *) calloc(REMAP_CELLS, sizeof(uint32));
+    map->near = (uint16 *) malloc(3 * REMAP_SIDE * 256 * sizeof(uint16));
+    map->far  = (uint16 *) malloc(3 * REMAP_SIDE * 256 * sizeof(uint16));
+    if (!map->cell || !map->near || !map->far) {
+        remap_destroy(&map);
+        return NULL;
+    }
+
+    /* distances from each side of a cell to every entry, per channel, so
+       bounding a cell against the palette needs only additions */
+    for (int c = 0; c < 3; c++)
+        for (int s = 0; s < REMAP_SIDE; s++) {
+            int lo = s << REMAP_SHIFT, hi = lo + (1 << REMAP_SHIFT) - 1;
+            uint16 * n = map->near + (c * REMAP_SIDE + s) * 256;
+            uint16 * f = map->far  + (c * REMAP_SIDE + s) * 256;
+
+            for (uint32 p = 0; p < colors; p++) {
+                int v = c == 0 ? pal[p].r : (c == 1 ? pal[p].g : pal[p].b);
+                int dl = remap_sq(v, lo), dh = remap_sq(v, hi);
+
+                n[p] = v < lo ? dl : (v > hi ? dh : 0);
+                f[p] = dl > dh ? dl : dh;
+            }
+        }
+    return map;
+}
+
+void remap_destroy(remap_t ** map) {
+    if (*map) {
+        free((*map)->cell);
+        free((*map)->pool);
+        free((*map)->near);
+        free((*map)->far);
+        free(*map);
+        *map = NULL;
+    }
+}
+
+/*  remap_exact()
+*   nearest entry by searching the whole palette, ties go to the lowest
+*   index
+*/
+uint8 remap_exact(const remap_t * map, uint8 r, uint8 g, uint8 b) {
+    int best = 0x7FFFFFFF, k = 0;
+
+    for (uint32 p = 0; p < map->colors; p++) {
+        int d = remap_sq(r, map->pal[p].r) + remap_sq(g, map->pal[p].g) +
+                remap_sq(b, map->pal[p].b);
+        if (d < best) {
+            best = d;
+            k = p;
+        }
+    }
+    return k;
+}
+
+/* lists the entries that may be nearest to a color of cell [i]: none can
+   beat the smallest farthest-corner distance of the cell, so entries whose
+   nearest point lies beyond it are dropped. Returns 0 when out of memory. */
+static uint32 remap_fill(remap_t * map, uint32 i) {
+    const int       s = REMAP_SIDE;
+    const uint32    cr = i >> (2 * REMAP_BITS), cg = (i >> REMAP_BITS) & (s - 1);
+    const uint32    cb = i & (s - 1);
+    const uint16    * nr = map->near + cr * 256;
+    const uint16    * ng = map->near + (s + cg) * 256;
+    const uint16    * nb = map->near + (2 * s + cb) * 256;
+    const uint16    * fr = map->far + cr * 256;
+    const uint16    * fg = map->far + (s + cg) * 256;
+    const uint16    * fb = map->far + (2 * s + cb) * 256;
+    uint32          bound = 0xFFFFFFFF, n = 0, first = 0;
+
+    for (uint32 p = 0; p < map->colors; p++) {
+        uint32 d = fr[p] + fg[p] + fb[p];
+        if (d < bound)
+            bound = d;
+    }
+    for (uint32 p = 0; p < map->colors; p++)
+        if (nr[p] + ng[p] + nb[p] <= bound && !n++)
+            first = p;
+
+    if (n == 1)
+        return map->cell[i] = REMAP_ONE | first;
+
+    /* append the list to the pool */
+    if (map->used + n + 1 > map->size) {
+        uint32  size = map->size ? map->size * 2 : 4096;
+        uint8   * pool;
+
+        while (map->used + n + 1 > size)
+            size *= 2;
+        if (size >= REMAP_ONE || !(pool = (uint8 *) realloc(map->pool, size)))
+            return 0;
+        map->pool = pool;
+        map->size = size;
+    }
+
+    uint8 * list = map->pool + map->used;
+    *list++ = n - 1;
+    for (uint32 p = 0; p < map->colors; p++)
+        if (nr[p] + ng[p] + nb[p] <= bound)
+            *list++ = p;
+
+    map->cell[i] = map->used + 1;
+    map->used += n + 1;
+    return map->cell[i];
+}
+
+/*  remap_index()
+*   nearest palette entry of a color, same result as remap_exact()
+*/
+uint8 remap_index(remap_t * map, uint8 r, uint8 g, uint8 b) {
+    uint32 i = ((r >> REMAP_SHIFT) << (2 * REMAP_BITS)) |
+               ((g >> REMAP_SHIFT) << REMAP_BITS) | (b >> REMAP_SHIFT);
+    uint32 c = map->cell[i];
+
+    if (!c && !(c = remap_fill(map, i)))
+        return remap_exact(map, r, g, b);
+    if (c & REMAP_ONE)
+        return c & 0xFF;
+
+    /* search the candidates: distance and index packed in one key, so the
+       minimum is branch-free and ties go to the lowest index */
+    const uint8 * list = map->pool + c - 1;
+    int     best = 0x7FFFFFFF;
+
+    for (int n = list[0] + 1; n > 0; n--) {
+        const rgb_t * p = &map->pal[*++list];
+        int d = remap_sq(r, p->r) + remap_sq(g, p->g) + remap_sq(b, p->b);
+        int key = (d << 8) | *list;
+        best = key < best ? key : best;
+    }
+    return best & 0xFF;
+}
+
+/*  remap_row()
+*   maps an RGB24 scanline [y], with the same ordered dithering as the
+*   uniform quantizer
+*/
+void remap_row(remap_t * map, const uint8 * src, uint8 * dst, uint32 width,
+               uint32 y, bool dither) {
+    uint32  last = 0xFFFFFFFF;
+    uint8   k = 0;
+
+    for (uint32 x = 0; x < width; x++, src += 3) {
+        int t = dither ? (bayerMatrix[((y & 3) << 2) + (x & 3)] - 8) << 1 : 0;
+        int r = clamp(src[0] + t), g = clamp(src[1] + t), b = clamp(src[2] + t);
+        uint32 color = (r << 16) | (g << 8) | b;
+
+        if (color != last) {
+            k = remap_index(map, r, g, b);
+            last = color;
+        }
+        dst[x] = k;
+    }
+}
+
+/* shared state of a banded mapping run */
+typedef struct {
+    const rgb_t     * pal;
+    uint32          colors;
+    const bitmap    src;
+    bitmap          dst;
+    bool            dither;
+    int             bands;
+    uint32          failed;     /* bands out of memory */
+} remap_job_t;
+
+/* every band fills its own cache, so the threads share nothing */
+static void remap_band(void * arg, int band) {
+    remap_job_t * job = (remap_job_t *) arg;
+    uint32  rows = job->src->height / job->bands;
+    uint32  rest = job->src->height % job->bands;
+    uint32  y0 = band * rows + (band < rest ? band : rest);
+    uint32  y1 = y0 + rows + (band < rest ? 1 : 0);
+    remap_t * map = remap_create(job->pal, job->colors);
+
+    if (!map) {
+        thread_fetch_add(&job->failed, 1);
+        return;
+    }
+    for (uint32 y = y0; y < y1; y++)
+        remap_row(map, job->src->data + y * job->src->rowsize,
+                  job->dst->data + y * job->dst->rowsize, job->src->width,
+                  y, job->dither);
+    remap_destroy(&map);
+}
+
+/* creates the indexed output of [bmp] carrying [pal] */
+static bitmap remap_output(const bitmap bmp, const rgb_t * pal, uint32 colors) {
+    bitmap res = bitmap_create(bmp->width, bmp->height, BMF_INDEXED8, true);
+    if (!res) return NULL;
+    memset(res->pal, 0, 256 * sizeof(rgb_t));
+    memcpy(res->pal, pal, colors * sizeof(rgb_t));
+    return res;
+}
+
+/* an indexed image only needs its palette translated */
+static void remap_indexed(remap_t * map, const bitmap bmp, bitmap res) {
+    uint8   lut[256];
+
+    for (int i = 0; i < 256; i++)
+        lut[i] = remap_index(map, bmp->pal[i].r, bmp->pal[i].g, bmp->pal[i].b);
+
+    for (uint32 y = 0; y < bmp->height; y++) {
+        const uint8 * src = bmp->data + y * bmp->rowsize;
+        uint8       * dst = res->data + y * res->rowsize;
+        for (uint32 x = 0; x < bmp->width; x++)
+            dst[x] = lut[src[x]];
+    }
+}
+
+bitmap remap_bitmap(const bitmap bmp, const rgb_t * pal, uint32 colors,
+                    bool dither, int threads) {
+    if (!bmp || !pal) return NULL;
+    if (bmp->format != BMF_RGB24 && bmp->format != BMF_INDEXED8) return NULL;
+
+    if (colors > 256)
+        colors = 256;
+    bitmap res = remap_output(bmp, pal, colors);
+    if (!res) return NULL;
+
+    if (bmp->format == BMF_INDEXED8) {
+        remap_t * map = remap_create(pal, colors);
+
+        if (!map) {
+            bitmap_destroy(&res);
+            return NULL;
+        }
+        remap_indexed(map, bmp, res);
+        remap_destroy(&map);
+        return res;
+    }
+
+    remap_job_t job = { pal, colors, bmp, res, dither, thread_count(threads),
+                        0 };
+    if (job.bands > bmp->height / REMAP_BAND_MIN)
+        job.bands = bmp->height / REMAP_BAND_MIN;
+    if (job.bands < 1)
+        job.bands = 1;
+    thread_parallel(job.bands, remap_band, &job);
+
+    if (job.failed)
+        bitmap_destroy(&res);
+    return res;
+}
+
+/*  remap_bitmap_with()
+*   same as remap_bitmap() on the calling thread, through a long-lived
+*   context whose inverse colormap stays filled for the next image
+*/
+bitmap remap_bitmap_with(const bitmap bmp, remap_t * map, bool dither) {
+    if (!bmp || !map) return NULL;
+    if (bmp->format != BMF_RGB24 && bmp->format != BMF_INDEXED8) return NULL;
+
+    bitmap res = remap_output(bmp, map->pal, map->colors);
+    if (!res) return NULL;
+
+    if (bmp->format == BMF_INDEXED8)
+        remap_indexed(map, bmp, res);
+    else
+        for (uint32 y = 0; y < bmp->height; y++)
+            remap_row(map, bmp->data + y * bmp->rowsize,
+                      res->data + y * res->rowsize, bmp->width, y, dither);
+    return res;
+}
@@ -0,0 +1,51 @@
+#ifndef __REMAP_H__
+#define __REMAP_H__ (1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "image.h"
+
+/*-------------------------- NEAREST COLOR REMAPPING -------------------------*/
+
+/* inverse colormap resolution in bits per channel, 5 gives 32x32x32 cells */
+#ifndef REMAP_BITS
+    #define REMAP_BITS  (5)
+#endif
+#define REMAP_SIDE      (1 << REMAP_BITS)
+#define REMAP_CELLS     (REMAP_SIDE * REMAP_SIDE * REMAP_SIDE)
+
+/* palette with a lazily filled inverse colormap. Every cell lists the
+   entries that can be nearest to some color inside it: cells with one
+   candidate are a table lookup, the others search their short list.
+   The cache is filled on use, so a context must not be shared by threads. */
+typedef struct remap_context {
+    rgb_t   pal[256];
+    uint32  colors;
+    uint32  * cell;             /* 0 = unknown, see remap.c */
+    uint8   * pool;             /* candidate lists: count - 1, then indices */
+    uint32  used, size;         /* pool bytes */
+    uint16  * near;             /* per channel and cell side, squared */
+    uint16  * far;              /* distances to every palette entry */
+} remap_t;
+
+remap_t *   remap_create(const rgb_t * pal, uint32 colors);
+void        remap_destroy(remap_t ** map);
+uint8       remap_index(remap_t * map, uint8 r, uint8 g, uint8 b);
+uint8       remap_exact(const remap_t * map, uint8 r, uint8 g, uint8 b);
+void        remap_row(remap_t * map, const uint8 * src, uint8 * dst,
+                      uint32 width, uint32 y, bool dither);
+
+/* maps an RGB24 or BMF_INDEXED8 bitmap onto the first [colors] entries
+   of [pal], optionally with ordered dithering (RGB24 only) */
+bitmap      remap_bitmap(const bitmap bmp, const rgb_t * pal, uint32 colors,
+                         bool dither, int threads);
+/* single threaded, reusing the inverse colormap cached in [map] */
+bitmap      remap_bitmap_with(const bitmap bmp, remap_t * map, bool dither);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,377 @@
+/* SERVER.C: long running quantization server over a Unix domain socket */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "server.h"
+#include "thread.h"
+
+#ifdef USE_SERVER
+    #include <errno.h>
+    #include <signal.h>
+    #include <unistd.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/time.h>
+    #include <sys/un.h>
+#endif
+
+#ifdef USE_SERVER
+
+/* listening socket, shut down by QUIT or a signal to wake every worker */
+static int              serverSocket = -1;
+static int              serverStop = 0;     /* lock-free, set by signals */
+
+/* connection state and buffers of a worker, kept across requests */
+typedef struct {
+    int         fd;
+    uint8       line[SERVER_LINE];      /* received, not consumed yet */
+    uint32      pos, used;
+    uint8       * data;                 /* inline image of a request */
+    uint32      dataCap;
+    uint8       * out;                  /* encoded reply */
+    uint32      outCap;
+    bitmap      input;                  /* decoded request image */
+} server_worker_t;
+
+typedef struct {
+    server_job_t    job;
+    void            * arg;
+    server_worker_t * workers;
+} server_t;
+
+static void server_signal(int sig) {
+    (void) sig;
+    thread_store(&serverStop, 1);
+    if (serverSocket >= 0)
+        shutdown(serverSocket, SHUT_RDWR);
+}
+
+/* writes the whole buffer, false once the peer is gone */
+static bool server_send(int fd, const void * buf, size_t len) {
+    const uint8 * p = (const uint8 *) buf;
+
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* refills the line buffer, false at the end of the connection */
+static bool server_fill(server_worker_t * w) {
+    ssize_t n;
+
+    if (w->pos == w->used)
+        w->pos = w->used = 0;
+    else
+    if (w->pos) {
+        memmove(w->line, w->line + w->pos, w->used - w->pos);
+        w->used -= w->pos;
+        w->pos = 0;
+    }
+    if (w->used == SERVER_LINE)
+        return false;
+    do
+        n = read(w->fd, w->line + w->used, SERVER_LINE - w->used);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return false;
+    w->used += n;
+    return true;
+}
+
+/* receives one request line, without its end, as a C string */
+static char * server_read_line(server_worker_t * w) {
+    for (;;) {
+        uint8 * end = (uint8 *) memchr(w->line + w->pos, '\n',
+                                       w->used - w->pos);
+        if (end) {
+            char * line = (char *) w->line + w->pos;
+            *end = 0;
+            if (end > w->line + w->pos && end[-1] == '\r')
+                end[-1] = 0;
+            w->pos = end + 1 - w->line;
+            return line;
+        }
+        if (!server_fill(w))
+            return NULL;
+    }
+}
+
+/* receives [size] payload bytes into [dst], buffered ones first */
+static bool server_read(server_worker_t * w, uint8 * dst, uint32 size) {
+    uint32  have = w->used - w->pos;
+
+    if (have > size)
+        have = size;
+    memcpy(dst, w->line + w->pos, have);
+    w->pos += have;
+    while (have < size) {
+        ssize_t n = read(w->fd, dst + have, size - have);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        have += n;
+    }
+    return true;
+}
+
+static bool server_error(server_worker_t * w, const char * message) {
+    char    reply[SERVER_ERROR + 16];
+    int     len = snprintf(reply, sizeof(reply), "ERROR %s\n", message);
+    return server_send(w->fd, reply, len);
+}
+
+/* answers the requests of one connection, false on QUIT */
+static bool server_connection(server_t * srv, server_worker_t * w, int index) {
+    char    * line;
+
+    w->pos = w->used = 0;
+    while ((line = server_read_line(w))) {
+        server_request_t req;
+        char    * token, * save = NULL;
+        unsigned long size;
+
+        memset(&req, 0, sizeof(req));
+        if (!(token = strtok_r(line, " \t", &save)))
+            continue;
+        if (!strcmp(token, "QUIT")) {
+            server_send(w->fd, "OK 0\n", 5);
+            return false;
+        }
+        if (strcmp(token, "QUANTIZE") ||
+            !(token = strtok_r(NULL, " \t", &save)) ||
+            (size = strtoul(token, NULL, 10)) > SERVER_DATA_MAX) {
+            server_error(w, "malformed request");
+            return true;        /* the stream cannot be trusted anymore */
+        }
+        while ((token = strtok_r(NULL, " \t", &save)) &&
+               req.argc < SERVER_ARGS)
+            req.argv[req.argc++] = token;
+        if (token) {
+            server_error(w, "too many arguments");
+            return true;
+        }
+
+        /* the inline image goes to a buffer kept by the worker */
+        if (size > w->dataCap) {
+            uint8 * grown = (uint8 *) realloc(w->data, size);
+            if (!grown) {
+                server_error(w, "not enough memory");
+                return true;
+            }
+            w->data = grown;
+            w->dataCap = size;
+        }
+        if (size && !server_read(w, w->data, size))
+            return true;
+        req.data = size ? w->data : NULL;
+        req.size = size;
+        req.worker = index;
+        req.input = &w->input;
+
+        bitmap  res = srv->job(srv->arg, &req);
+        uint32  len = !res ? 0 : req.compress ?
+                      bmp_encode_rle(&res, &w->out, &w->outCap) :
+                      bmp_encode(&res, &w->out, &w->outCap);
+        bitmap_destroy(&res);
+        if (!len) {
+            if (!server_error(w, req.error[0] ? req.error : "cannot encode output"))
+                return true;
+            continue;
+        }
+
+        char    head[32];
+        int     n = snprintf(head, sizeof(head), "OK %u\n", len);
+        if (!server_send(w->fd, head, n) || !server_send(w->fd, w->out, len))
+            return true;
+    }
+    return true;
+}
+
+/* drops a client that stalls a read or a write for SERVER_TIMEOUT */
+static void server_timeout(int fd) {
+    struct timeval tv;
+
+    tv.tv_sec = SERVER_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/* every worker waits on the listening socket itself */
+static void server_worker(void * arg, int index) {
+    server_t        * srv = (server_t *) arg;
+    server_worker_t * w = &srv->workers[index];
+
+    while (!thread_load(&serverStop)) {
+        if ((w->fd = accept(serverSocket, NULL, NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;              /* shut down */
+        }
+        server_timeout(w->fd);
+        if (!server_connection(srv, w, index)) {
+            thread_store(&serverStop, 1);
+            shutdown(serverSocket, SHUT_RDWR);
+        }
+        close(w->fd);
+    }
+}
+
+/* fills a socket address, false if [path] is too long */
+static bool server_address(struct sockaddr_un * addr, const char * path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+        return false;
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+#endif
+
+/*  server_run()
+*   listens on [path] and runs [job] for every request. The socket file
+*   of a previous run is replaced, any other file is left alone. Clients
+*   silent for SERVER_TIMEOUT seconds are disconnected.
+*/
+bool server_run(const char * path, int workers, server_job_t job, void * arg) {
+#ifdef USE_SERVER
+    struct sockaddr_un  addr;
+    struct sigaction    sa;
+    struct stat         st;
+    server_t            srv;
+
+    if (!server_address(&addr, path))
+        return false;
+    if (!stat(path, &st)) {
+        if (!S_ISSOCK(st.st_mode))
+            return false;
+        unlink(path);
+    }
+    if ((serverSocket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return false;
+    if (bind(serverSocket, (struct sockaddr *) &addr, sizeof(addr))) {
+        close(serverSocket);
+        serverSocket = -1;
+        return false;
+    }
+    /* any client may QUIT or name server-side files: owner only, and
+       before listen() so nobody connects under the caller's umask */
+    if (chmod(path, S_IRUSR | S_IWUSR) || listen(serverSocket, 64)) {
+        close(serverSocket);
+        serverSocket = -1;
+        unlink(path);
+        return false;
+    }
+
+    workers = thread_count(workers);
+    srv.job = job;
+    srv.arg = arg;
+    if (!(srv.workers = (server_worker_t *) calloc(workers,
+                                                   sizeof(server_worker_t)))) {
+        close(serverSocket);
+        serverSocket = -1;
+        unlink(path);
+        return false;
+    }
+
+    /* a client hanging up must not kill the server */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+    sa.sa_handler = server_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    thread_store(&serverStop, 0);
+    thread_parallel(workers, server_worker, &srv);
+
+    for (int i = 0; i < workers; i++) {
+        free(srv.workers[i].data);
+        free(srv.workers[i].out);
+        bitmap_destroy(&srv.workers[i].input);
+    }
+    free(srv.workers);
+    close(serverSocket);
+    serverSocket = -1;
+    unlink(path);
+    return true;
+#else
+    (void) path; (void) workers; (void) job; (void) arg;
+    return false;
+#endif
+}
+
+/*  server_call()
+*   client side of one request, the connection is closed afterwards
+*/
+bool server_call(const char * path, const char * args, const uint8 * data,
+                 uint32 size, uint8 ** reply, uint32 * length,
+                 char * error, uint32 len) {
+#ifdef USE_SERVER
+    struct sockaddr_un  addr;
+    server_worker_t     w;
+    struct sigaction    sa;
+    char                head[SERVER_LINE], * line;
+    bool                ok = false;
+    int                 n;
+
+    memset(&w, 0, sizeof(w));
+    snprintf(error, len, "cannot connect to [%s]", path);
+    if (!server_address(&addr, path) ||
+        (w.fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return false;
+    if (connect(w.fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        close(w.fd);
+        return false;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    snprintf(error, len, "connection lost");
+    n = snprintf(head, sizeof(head), "QUANTIZE %u %s\n", data ? size : 0, args);
+    if (n >= (int) sizeof(head))
+        snprintf(error, len, "request too long");
+    else
+    if (server_send(w.fd, head, n) && (!data || server_send(w.fd, data, size)) &&
+        (line = server_read_line(&w))) {
+        unsigned long bytes;
+
+        if (!strncmp(line, "ERROR ", 6))
+            snprintf(error, len, "%s", line + 6);
+        else
+        if (strncmp(line, "OK ", 3) ||
+            (bytes = strtoul(line + 3, NULL, 10)) > 0xFFFFFFFFul)
+            snprintf(error, len, "malformed reply");
+        else {
+            uint8 * grown = (uint8 *) realloc(*reply, bytes ? bytes : 1);
+            if (!grown)
+                snprintf(error, len, "not enough memory");
+            else {
+                *reply = grown;
+                *length = bytes;
+                ok = server_read(&w, *reply, bytes);
+            }
+        }
+    }
+    close(w.fd);
+    return ok;
+#else
+    (void) args; (void) data; (void) size; (void) reply; (void) length;
+    snprintf(error, len, "cannot connect to [%s], no socket support", path);
+    return false;
+#endif
+}
@@ -0,0 +1,63 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__ (1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "image.h"
+
+/*---------------------------- QUANTIZATION SERVER ---------------------------*/
+
+/* Unix domain sockets are only available on POSIX systems */
+#if !defined(_WIN32) && !defined(MSDOS) && !defined(__DJGPP__)
+    #define USE_SERVER
+#endif
+
+#define SERVER_ARGS     (64)            /* tokens of a request line */
+#define SERVER_LINE     (4096)          /* bytes of a request line */
+#define SERVER_ERROR    (256)           /* bytes of an error message */
+#define SERVER_DATA_MAX (1u << 29)      /* bytes of an inline image */
+#define SERVER_TIMEOUT  (30)            /* seconds a client may stall */
+
+/* Requests, any number per connection:
+       QUANTIZE <bytes> [options] [path]\n  followed by <bytes> of a BMP
+                                            file, 0 to load [path] instead
+       QUIT\n                               stops the server
+   Replies:
+       OK <bytes>\n                         followed by the 8-bit BMP file,
+                                            RLE compressed with -z
+       ERROR <message>\n                                                   */
+
+typedef struct server_request {
+    int         argc;                   /* options and path */
+    char        * argv[SERVER_ARGS];
+    const uint8 * data;                 /* inline BMP file, NULL if none */
+    uint32      size;
+    int         worker;                 /* serving worker, for its caches */
+    bitmap      * input;                /* worker bitmap to load into */
+    bool        compress;               /* reply with an RLE bitmap */
+    char        error[SERVER_ERROR];    /* set when the job fails */
+} server_request_t;
+
+/* answers a request with the quantized bitmap, or NULL with [error] set.
+   Runs on every worker at once. */
+typedef bitmap (*server_job_t)(void * arg, server_request_t * req);
+
+/* serves requests on the socket [path] with [workers] threads (0 = one
+   per processor) until QUIT, SIGINT or SIGTERM. The socket is only open
+   to its owner (mode 0600). False if it cannot listen. */
+bool    server_run(const char * path, int workers, server_job_t job,
+                   void * arg);
+
+/* sends one request, [args] being its options and path. The reply is
+   stored into [reply] (realloc'ed), false with [error] set on failure. */
+bool    server_call(const char * path, const char * args, const uint8 * data,
+                    uint32 size, uint8 ** reply, uint32 * length,
+                    char * error, uint32 len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,60 @@
+/* SIMD.C: runtime CPU feature detection for the vectorized kernels */
+
+#include <stdio.h>
+#include "simd.h"
+
+static simd_level_t simd_detected = SIMD_NONE;
+static simd_level_t simd_current  = SIMD_NONE;
+static int          simd_probed   = 0;
+
+/*  simd_detect()
+*   returns the best instruction set supported by the running CPU
+*/
+simd_level_t simd_detect(void) {
+    if (simd_probed)
+        return simd_detected;
+
+    simd_detected = SIMD_NONE;
+#if defined(SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        simd_detected = SIMD_AVX2;
+    else
+    if (__builtin_cpu_supports("sse2"))
+        simd_detected = SIMD_SSE2;
+#elif defined(SIMD_ARM)
+    simd_detected = SIMD_NEON;
+#endif
+    simd_current = simd_detected;
+    simd_probed = 1;
+    return simd_detected;
+}
+
+/*  simd_level()
+*   returns the instruction set the kernels should dispatch to
+*/
+simd_level_t simd_level(void) {
+    if (!simd_probed)
+        simd_detect();
+    return simd_current;
+}
+
+/*  simd_limit()
+*   caps the dispatched instruction set, SIMD_NONE forces the C reference
+*   code. Levels the CPU does not support are ignored.
+*/
+void simd_limit(simd_level_t level) {
+    simd_detect();
+    if (level == SIMD_NONE || level == simd_detected ||
+        (simd_detected == SIMD_AVX2 && level == SIMD_SSE2))
+        simd_current = level;
+}
+
+const char * simd_name(simd_level_t level) {
+    switch (level) {
+    case SIMD_SSE2: return "sse2";
+    case SIMD_AVX2: return "avx2";
+    case SIMD_NEON: return "neon";
+    default:        return "none";
+    }
+}
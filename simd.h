@@ -0,0 +1,58 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__ (1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*------------------------- SIMD FEATURE DETECTION ---------------------------*/
+
+/* x86 kernels are compiled per function using target attributes, so the
+   whole program still runs on CPUs lacking the newer instruction sets */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    !defined(MSDOS) && !defined(__DJGPP__)
+    #define SIMD_X86
+    #define SIMD_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+#if defined(SIMD_X86)
+/* splits 16 packed RGB pixels held in [a], [b], [c] into planar R, G and B
+   vectors, in place. With 256-bit unpacks each 128-bit lane is split on
+   its own. */
+#define DEINTERLEAVE3(UNPACKLO8, UNPACKHI64, a, b, c) do {                  \
+    __typeof__(a) t10 = UNPACKLO8(a, UNPACKHI64(b, b));                     \
+    __typeof__(a) t11 = UNPACKLO8(UNPACKHI64(a, a), c);                     \
+    __typeof__(a) t12 = UNPACKLO8(b, UNPACKHI64(c, c));                     \
+    __typeof__(a) t20 = UNPACKLO8(t10, UNPACKHI64(t11, t11));               \
+    __typeof__(a) t21 = UNPACKLO8(UNPACKHI64(t10, t10), t12);               \
+    __typeof__(a) t22 = UNPACKLO8(t11, UNPACKHI64(t12, t12));               \
+    __typeof__(a) t30 = UNPACKLO8(t20, UNPACKHI64(t21, t21));               \
+    __typeof__(a) t31 = UNPACKLO8(UNPACKHI64(t20, t20), t22);               \
+    __typeof__(a) t32 = UNPACKLO8(t21, UNPACKHI64(t22, t22));               \
+    a = UNPACKLO8(t30, UNPACKHI64(t31, t31));                               \
+    b = UNPACKLO8(UNPACKHI64(t30, t30), t32);                               \
+    c = UNPACKLO8(t31, UNPACKHI64(t32, t32));                               \
+} while (0)
+#endif
+
+/* NEON is part of the AArch64 baseline, no runtime check is needed there */
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #define SIMD_ARM
+#endif
+
+typedef enum {  SIMD_NONE = 0,  /* plain C reference code */
+                SIMD_SSE2,      /* x86: 16 pixels per step */
+                SIMD_AVX2,      /* x86: 32 pixels per step */
+                SIMD_NEON       /* ARM: 16 pixels per step */
+            } simd_level_t;
+
+simd_level_t    simd_detect(void);
+simd_level_t    simd_level(void);
+void            simd_limit(simd_level_t level);
+const char *    simd_name(simd_level_t level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
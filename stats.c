@@ -0,0 +1,110 @@
+/* STATS.C: per image stage timers and byte and allocation counters */
+
+#include <stdio.h>
+#include <string.h>
+#include "stats.h"
+
+#ifdef USE_THREADS
+__thread stats_t * stats_current = NULL;
+#else
+stats_t * stats_current = NULL;
+#endif
+
+/* set once before any worker starts, tells the drivers to keep records */
+static bool statsOn = false;
+
+/* JSON names of the stages, in stats_stage_t order */
+static const char * stageNames[STATS_STAGES] = {
+    "load", "header", "decode", "quantize", "clut", "save", "encode",
+    "metric", "tune" };
+
+/*  stats_enable()
+*   switches recording on for the whole process, drivers such as
+*   batch_run() then keep a record per image
+*/
+void stats_enable(bool on) {
+    statsOn = on;
+}
+
+bool stats_enabled(void) {
+    return statsOn;
+}
+
+/*  stats_reset()
+*   clears every counter of [st]
+*/
+void stats_reset(stats_t * st) {
+    memset(st, 0, sizeof(stats_t));
+}
+
+/*  stats_attach()
+*   makes [st] the record the hooks of this thread update, NULL stops
+*   recording
+*/
+void stats_attach(stats_t * st) {
+    stats_current = st;
+}
+
+/* copies [s] into [dst] as the body of a JSON string */
+static void stats_escape(char * dst, uint32 size, const char * s) {
+    uint32  n = 0;
+
+    for (; *s && n + 7 < size; s++) {
+        uint8   c = (uint8) *s;
+
+        if (c == '"' || c == '\\') {
+            dst[n++] = '\\';
+            dst[n++] = c;
+        }
+        else
+        if (c < 0x20)
+            n += sprintf(dst + n, "\\u%04x", c);
+        else
+            dst[n++] = c;
+    }
+    dst[n] = 0;
+}
+
+/*  stats_print()
+*   writes [st] as one JSON line for a [width] x [height] [image]. The
+*   line goes out in a single write, so threads sharing [fp] do not
+*   interleave.
+*/
+bool stats_print(FILE * fp, const stats_t * st, const char * image,
+                 uint32 width, uint32 height) {
+    char    line[1024], name[512];
+    double  total = st->time[STATS_LOAD] + st->time[STATS_QUANTIZE] +
+                    st->time[STATS_SAVE] + st->time[STATS_METRIC] +
+                    st->time[STATS_TUNE];
+    int     n;
+
+    stats_escape(name, sizeof(name), image);
+    n = snprintf(line, sizeof(line), "{\"image\":\"%s\",\"width\":%u,"
+                 "\"height\":%u", name, width, height);
+    for (int i = 0; i < STATS_STAGES; i++)
+        n += snprintf(line + n, sizeof(line) - n, ",\"%s_ms\":%.3f",
+                      stageNames[i], st->time[i] * 1000);
+    n += snprintf(line + n, sizeof(line) - n,
+                  ",\"decode_calls\":%u,\"encode_calls\":%u,"
+                  "\"total_ms\":%.3f,\"mpx_s\":%.2f,\"bytes_in\":%llu,"
+                  "\"bytes_out\":%llu,\"allocs\":%u,\"alloc_bytes\":%llu",
+                  st->calls[STATS_DECODE], st->calls[STATS_ENCODE],
+                  total * 1000,
+                  total > 0 ? (double) width * height / (total * 1e6) : 0.0,
+                  (unsigned long long) st->bytesIn,
+                  (unsigned long long) st->bytesOut, st->allocs,
+                  (unsigned long long) st->allocBytes);
+    if (st->measured) {
+        const metric_t * q = &st->quality;
+
+        n += snprintf(line + n, sizeof(line) - n,
+                      ",\"mse\":[%.4f,%.4f,%.4f],\"psnr\":[%.3f,%.3f,%.3f],"
+                      "\"psnr_all\":%.3f,\"ssim\":%.5f", q->mse[0],
+                      q->mse[1], q->mse[2], q->psnr[0], q->psnr[1],
+                      q->psnr[2], q->psnrAll, q->ssim);
+    }
+    snprintf(line + n, sizeof(line) - n, "}\n");
+    if (fputs(line, fp) == EOF)
+        return false;
+    return fflush(fp) == 0;
+}
@@ -0,0 +1,90 @@
+#ifndef __STATS_H__
+#define __STATS_H__ (1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include "image.h"
+#include "metric.h"
+#include "thread.h"
+
+/*------------------------------ INSTRUMENTATION -----------------------------*/
+
+/* timed stages of one image, the later ones nest in the earlier ones:
+   header and decode are part of load, clut of quantize, encode of save */
+typedef enum {  STATS_LOAD,         /* whole image load */
+                STATS_HEADER,       /* opening the file, parsing headers */
+                STATS_DECODE,       /* bmp_get_row(), PNM raster reads */
+                STATS_QUANTIZE,     /* palette, mapping and dithering */
+                STATS_CLUT,         /* quantize_uniform_clut(), generators */
+                STATS_SAVE,         /* whole output write */
+                STATS_ENCODE,       /* bmp_put_row(), RLE, GIF, PNG, PNM */
+                STATS_METRIC,       /* metric_compare() */
+                STATS_TUNE,         /* trials of the automatic mode */
+                STATS_STAGES } stats_stage_t;
+
+/* counters of one image, gathered by whichever threads work on it */
+typedef struct stats {
+    double  time[STATS_STAGES];     /* seconds */
+    uint32  calls[STATS_STAGES];
+    uint64  bytesIn, bytesOut;      /* file bytes read and written */
+    uint32  allocs;                 /* image buffers allocated */
+    uint64  allocBytes;
+    bool    measured;               /* [quality] holds the output error */
+    metric_t quality;
+} stats_t;
+
+/* the record of the image this thread works on, NULL when not recording:
+   every hook then costs one test */
+#ifdef USE_THREADS
+extern __thread stats_t * stats_current;
+#else
+extern stats_t * stats_current;
+#endif
+
+void    stats_enable(bool on);
+bool    stats_enabled(void);
+void    stats_reset(stats_t * st);
+void    stats_attach(stats_t * st);
+bool    stats_print(FILE * fp, const stats_t * st, const char * image,
+                    uint32 width, uint32 height);
+
+/* start of a timed section, 0 when not recording */
+static inline double stats_start(void) {
+    return stats_current ? thread_clock() : 0;
+}
+
+/* adds the time since [start] to [stage] */
+static inline void stats_stop(stats_stage_t stage, double start) {
+    stats_t * st = stats_current;
+
+    if (st) {
+        st->time[stage] += thread_clock() - start;
+        st->calls[stage]++;
+    }
+}
+
+static inline void stats_read(uint64 bytes) {
+    if (stats_current)
+        stats_current->bytesIn += bytes;
+}
+
+static inline void stats_write(uint64 bytes) {
+    if (stats_current)
+        stats_current->bytesOut += bytes;
+}
+
+static inline void stats_alloc(uint64 bytes) {
+    if (stats_current) {
+        stats_current->allocs++;
+        stats_current->allocBytes += bytes;
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
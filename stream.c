@@ -0,0 +1,128 @@
+/* STREAM.C: scanline streaming load -> quantize -> save pipeline */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+#include "quantize.h"
+#include "stream.h"
+#include "stats.h"
+
+/*	stream_uniform(): Quantize a Windows BMP file scanline by scanline. The
+ *	uniform 3-3-2 index does not depend on the palette, so every row is
+ *	written as soon as it is read and the CLUT is patched into the output
+ *	header once the last row is done. Memory use is O(width).
+ *
+ *	When both files can be memory mapped, 24-bit scanlines are quantized
+ *	straight from the input mapping into the output mapping, skipping the
+ *	intermediate copies and the B, G, R swap.
+ *
+ *	Params:
+ *		input: 16 or 24-bit uncompressed Windows BMP to read
+ *		output: 8-bit Windows BMP to create
+ *		dither: enable 4x4 ordered dithering
+ *	Returns:
+ *		IMR_OK on success, the reason of failure otherwise; any input that is
+ *		not a Windows BMP, PNM included, gives IMR_FORMAT_UNSUPPORTED
+ */
+image_result_t stream_uniform(const char * input, const char * output,
+							  bool dither) {
+	BMP_CONTEXT		* in, * out;
+	bitmap_t		hdr;
+	bitmap			ref = &hdr;
+	rgb_t			pal[256];
+	cubes			uniCubes = {{0}};
+	uint8			* src = NULL, * dst = NULL;
+	bool			inplace;
+	image_result_t	result = IMR_OK;
+	double			start = stats_start();
+
+	if (!(in = bmp_map(input)) && !(in = bmp_open(input))) {
+		/* tell a missing file from one that is not a usable BMP */
+		FILE * fp = fopen(input, "rb");
+		if (!fp)
+			return IMR_FILE_NOT_FOUND;
+		fclose(fp);
+		return image_detect(input) == BFM_BMP ? IMR_FORMAT_INVALID
+											  : IMR_FORMAT_UNSUPPORTED;
+	}
+	stats_stop(STATS_HEADER, start);
+
+	/* rows must decode to packed RGB24 */
+	if (!(in->info.compress == 0 || in->info.compress == 3) ||
+		!(in->info.bitcount == 16 || in->info.bitcount == 24)) {
+		bmp_close(&in);
+		return IMR_FORMAT_UNSUPPORTED;
+	}
+
+	/* describe the output without allocating its bits */
+	memset(pal, 0, sizeof(pal));
+	hdr.format	= BMF_INDEXED8;
+	hdr.width	= in->info.width;
+	hdr.height	= in->info.height;
+	hdr.rowsize	= in->info.width;
+	hdr.size	= hdr.rowsize * hdr.height;
+	hdr.pal		= pal;
+	hdr.data	= NULL;
+
+	if (!(out = bmp_map_create(output, &ref))) {
+		if (!(out = bmp_create(output))) {
+			bmp_close(&in);
+			return IMR_FILE_CREATE_ERROR;
+		}
+		if (!bmp_setup_header(&out, &ref))
+			result = IMR_NOT_ENOUGH_MEMORY;
+	}
+	inplace = in->map && out->map && in->info.bitcount == 24;
+
+	if (!inplace && result == IMR_OK) {
+		src = (uint8 *) malloc(hdr.width * 3);
+		dst = (uint8 *) malloc(hdr.rowsize);
+		if (!src || !dst)
+			result = IMR_NOT_ENOUGH_MEMORY;
+	}
+
+	if (result == IMR_OK &&
+		(!bmp_put_header_block(&out) || !bmp_put_info_block(&out)))
+		result = IMR_FILE_CREATE_ERROR;
+
+	/* rows are stored bottom-up, dithering works on top-down rows */
+	for (uint32 i = 0; result == IMR_OK && i < hdr.height; i++) {
+		if (inplace)
+			quantize_uniform_row_bgr(bmp_map_row(&in, i), bmp_map_row(&out, i),
+									 hdr.width, hdr.height - i - 1,
+									 dither, uniCubes);
+		else
+		if (!bmp_get_row(&in, src, hdr.width * 3))
+			result = IMR_FILE_CORRUPTED;
+		else {
+			quantize_uniform_row(src, dst, hdr.width, hdr.height - i - 1,
+								 dither, uniCubes);
+			if (!bmp_put_row(&out, dst, hdr.rowsize))
+				result = IMR_FILE_CREATE_ERROR;
+		}
+	}
+
+	/* in place rows bypass the counters of bmp_get_row() and bmp_put_row() */
+	if (result == IMR_OK) {
+		uint64	rows = inplace ? hdr.height : 0;
+
+		stats_read(in->hdr.offset + rows * in->rowsize);
+		stats_write(out->hdr.offset + rows * out->rowsize);
+	}
+
+	if (result == IMR_OK) {
+		quantize_uniform_clut(uniCubes, pal);
+		if (!bmp_put_palette(&out, pal))
+			result = IMR_FILE_CREATE_ERROR;
+	}
+
+	free(src);
+	free(dst);
+	bmp_close(&in);
+	if (!bmp_finish(&out) && result == IMR_OK)
+		result = IMR_FILE_CREATE_ERROR;
+	if (result != IMR_OK)
+		remove(output);
+	return result;
+}
@@ -0,0 +1,21 @@
+#ifndef __STREAM_H__
+#define __STREAM_H__ (1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "image.h"
+
+/*-------------------------- STREAMING QUANTIZATION --------------------------*/
+
+/* quantizes a 24-bit BMP file straight into an 8-bit BMP file, keeping
+   only a couple of scanlines in memory */
+image_result_t  stream_uniform(const char * input, const char * output,
+                               bool dither);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
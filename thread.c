@@ -0,0 +1,134 @@
+/* THREAD.C: minimal fork-join helpers over POSIX threads */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "thread.h"
+
+#ifdef USE_THREADS
+    #include <pthread.h>
+#endif
+#if defined(_WIN32)
+    #include <windows.h>
+#elif defined(USE_THREADS)
+    #include <unistd.h>
+    #include <sched.h>
+#endif
+
+/*  thread_cpus()
+*   returns the number of online processors, at least 1
+*/
+int thread_cpus(void) {
+#if defined(_WIN32)
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors > 0 ? (int) si.dwNumberOfProcessors : 1;
+#elif defined(USE_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+#else
+    return 1;
+#endif
+}
+
+/*  thread_count()
+*   resolves a user supplied thread count, 0 (or less) means one thread per
+*   processor
+*/
+int thread_count(int requested) {
+#ifdef USE_THREADS
+    return requested > 0 ? requested : thread_cpus();
+#else
+    return 1;
+#endif
+}
+
+#ifdef USE_THREADS
+typedef struct {
+    thread_job_t    job;
+    void            * arg;
+    int             index;
+} thread_task_t;
+
+static void * thread_entry(void * arg) {
+    thread_task_t * task = (thread_task_t *) arg;
+    task->job(task->arg, task->index);
+    return NULL;
+}
+#endif
+
+/*  thread_parallel()
+*   runs job(arg, 0) .. job(arg, count-1) concurrently and waits for all of
+*   them. Index 0 runs on the calling thread; any thread that cannot be
+*   started has its job run there as well.
+*/
+void thread_parallel(int count, thread_job_t job, void * arg) {
+#ifdef USE_THREADS
+    pthread_t       * tids = NULL;
+    thread_task_t   * tasks = NULL;
+    char            * started = NULL;
+
+    if (count > 1) {
+        tids    = (pthread_t *) malloc(sizeof(pthread_t) * count);
+        tasks   = (thread_task_t *) malloc(sizeof(thread_task_t) * count);
+        started = (char *) calloc(count, 1);
+    }
+
+    if (tids && tasks && started) {
+        for (int i = 1; i < count; i++) {
+            tasks[i].job = job;
+            tasks[i].arg = arg;
+            tasks[i].index = i;
+            started[i] = !pthread_create(&tids[i], NULL, thread_entry, &tasks[i]);
+        }
+        job(arg, 0);
+        for (int i = 1; i < count; i++) {
+            if (started[i])
+                pthread_join(tids[i], NULL);
+            else
+                job(arg, i);
+        }
+    }
+    else
+        for (int i = 0; i < count; i++)
+            job(arg, i);
+
+    free(tids);
+    free(tasks);
+    free(started);
+#else
+    for (int i = 0; i < count; i++)
+        job(arg, i);
+#endif
+}
+
+/*  thread_yield()
+*   gives up the processor, used by spin waits that run out of patience
+*/
+void thread_yield(void) {
+#if defined(_WIN32)
+    SwitchToThread();
+#elif defined(USE_THREADS)
+    sched_yield();
+#endif
+}
+
+/*  thread_clock()
+*   monotonic wall clock in seconds, for time budgets across threads
+*/
+double thread_clock(void) {
+#if defined(_WIN32)
+    LARGE_INTEGER f, t;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&t);
+    return (double) t.QuadPart / (double) f.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
@@ -0,0 +1,37 @@
+#ifndef __THREAD_H__
+#define __THREAD_H__ (1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*--------------------------- THREADING PRIMITIVES ---------------------------*/
+
+/* DOS has no threads, everything falls back to running on the caller */
+#if !defined(MSDOS) && !defined(__DJGPP__) && !defined(NO_THREADS)
+    #define USE_THREADS
+#endif
+
+/* lock-free progress counters shared between threads */
+#define thread_load(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define thread_store(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define thread_fetch_add(p, v) __atomic_fetch_add((p), (v), __ATOMIC_ACQ_REL)
+/* sets *p to [v] if it still holds [e], true on success */
+#define thread_cas(p, e, v) __extension__ ({ __typeof__(*(p)) _e = (e); \
+    __atomic_compare_exchange_n((p), &_e, (v), 0, __ATOMIC_ACQ_REL, \
+                                __ATOMIC_ACQUIRE); })
+
+/* job body for thread_parallel(), [index] ranges over [0, count) */
+typedef void (*thread_job_t)(void * arg, int index);
+
+int     thread_cpus(void);
+int     thread_count(int requested);
+void    thread_parallel(int count, thread_job_t job, void * arg);
+void    thread_yield(void);
+double  thread_clock(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,260 @@
+/* TUNE.C: picks the palette generator and dithering of an image from
+   trials on a downscaled proxy, under a latency budget */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tune.h"
+#include "metric.h"
+#include "thread.h"
+
+/* fewest proxy rows handed to a thread */
+#define TUNE_BAND_MIN   (16)
+/* trials faster than this many seconds are repeated, up to TUNE_RUNS
+   times, and the fastest run counts */
+#define TUNE_SHORT      (2e-3)
+#define TUNE_RUNS       (4)
+/* estimates within this ratio of the fastest one count as fast */
+#define TUNE_SLACK      (1.1)
+/* share of the budget the trials may spend, the rest is left to the
+   candidate picked */
+#define TUNE_SHARE      (0.5)
+
+/* candidates, cheapest first so ties keep the faster one and a tight
+   budget still gets to try them */
+static const tune_config_t tuneConfigs[TUNE_CONFIGS] = {
+    { PALETTE_UNIFORM, false }, { PALETTE_UNIFORM, true },
+    { PALETTE_WU, false },      { PALETTE_WU, true },
+    { PALETTE_OCTREE, false },  { PALETTE_OCTREE, true } };
+
+/* shared state of a banded downscale */
+typedef struct {
+    const bitmap    src;
+    bitmap          dst;
+    uint32          factor;
+    int             bands;
+} tune_scale_t;
+
+/* averages the source cells of one band of proxy rows */
+static void tune_band(void * arg, int band) {
+    tune_scale_t * job = (tune_scale_t *) arg;
+    const bitmap src = job->src;
+    uint32  f = job->factor;
+    uint32  rows = job->dst->height / job->bands;
+    uint32  rest = job->dst->height % job->bands;
+    uint32  y0 = band * rows + (band < rest ? band : rest);
+    uint32  y1 = y0 + rows + (band < rest ? 1 : 0);
+
+    for (uint32 y = y0; y < y1; y++) {
+        uint32  sy = y * f, ey = sy + f < src->height ? sy + f : src->height;
+        uint8   * dst = job->dst->data + y * job->dst->rowsize;
+
+        for (uint32 x = 0; x < job->dst->width; x++) {
+            uint32  sx = x * f, ex = sx + f < src->width ? sx + f : src->width;
+            uint32  s[3] = { 0, 0, 0 }, n = (ey - sy) * (ex - sx);
+
+            for (uint32 j = sy; j < ey; j++) {
+                const uint8 * p = src->data + j * src->rowsize + sx * 3;
+
+                for (uint32 i = sx; i < ex; i++, p += 3) {
+                    s[0] += p[0];
+                    s[1] += p[1];
+                    s[2] += p[2];
+                }
+            }
+            /* rounded means, cells at the right and bottom may be cut */
+            for (int c = 0; c < 3; c++)
+                dst[x * 3 + c] = (s[c] + n / 2) / n;
+        }
+    }
+}
+
+/*  tune_proxy()
+*   shrinks an RGB24 bitmap to at most [pixels] pixels by averaging square
+*   cells of the smallest whole side that gets there, so the proxy keeps
+*   the gradients and edges the quantizer and the dithering see
+*/
+bitmap tune_proxy(const bitmap bmp, uint32 pixels, int threads) {
+    uint32  f = 1;
+
+    if (!bmp || bmp->format != BMF_RGB24) return NULL;
+    if (pixels < 1)
+        pixels = 1;
+    while ((uint64) ((bmp->width + f - 1) / f) *
+                    ((bmp->height + f - 1) / f) > pixels)
+        f++;
+
+    bitmap res = bitmap_create((bmp->width + f - 1) / f,
+                               (bmp->height + f - 1) / f, BMF_RGB24, false);
+    if (!res) return NULL;
+
+    tune_scale_t job = { bmp, res, f, thread_count(threads) };
+    if (job.bands > (int) (res->height / TUNE_BAND_MIN))
+        job.bands = res->height / TUNE_BAND_MIN;
+    if (job.bands < 1)
+        job.bands = 1;
+    thread_parallel(job.bands, tune_band, &job);
+    return res;
+}
+
+/* runs [config] on [bmp], returns the seconds it took or a negative
+   value on failure. The first result is kept in [res] unless it is NULL. */
+static double tune_time(tune_job_t job, void * arg,
+                        const tune_config_t * config, const bitmap bmp,
+                        bitmap * res) {
+    double  best = -1, total = 0;
+
+    for (int r = 0; r < TUNE_RUNS && total < TUNE_SHORT; r++) {
+        double  start = thread_clock();
+        bitmap  out = job(arg, config, bmp);
+        double  t = thread_clock() - start;
+
+        if (!out)
+            return -1;
+        if (best < 0 || t < best)
+            best = t;
+        total += t;
+        if (res && !r)
+            *res = out;
+        else
+            bitmap_destroy(&out);
+    }
+    return best;
+}
+
+/* lays [n] x [n] copies of [bmp] out in a square: as many colors on more
+   pixels. The copies are cut to whole 4x4 dither cells, so the ordered
+   dither sees the same colors in every one of them. */
+static bitmap tune_tile(const bitmap bmp, uint32 n) {
+    uint32  w = bmp->width & ~3, h = bmp->height & ~3;
+    bitmap  res = bitmap_create(w * n, h * n, BMF_RGB24, false);
+    if (!res) return NULL;
+
+    for (uint32 y = 0; y < res->height; y++) {
+        const uint8 * src = bmp->data + (y % h) * bmp->rowsize;
+        uint8   * dst = res->data + y * res->rowsize;
+
+        for (uint32 i = 0; i < n; i++)
+            memcpy(dst + i * w * 3, src, w * 3);
+    }
+    return res;
+}
+
+/*  tune_select()
+*   measures every candidate on a proxy of a 16th of the image. To predict
+*   its latency on the whole image, the candidate is also timed on a
+*   proxy a quarter that size and on 2 x 2 tiled copies of it: the extra
+*   copies bring pixels but no new colors, so the difference is the cost
+*   per pixel, and the rest, such as reducing the histogram or filling
+*   the inverse colormap, a fixed cost. The time spent on the trials
+*   comes out of [budget], so they stop once they took TUNE_SHARE of it:
+*   on small images the fixed costs alone would use it up.
+*/
+int tune_select(const bitmap bmp, double budget, tune_job_t job, void * arg,
+                tune_trial_t * trials, int threads) {
+    double  start = thread_clock();
+    bitmap  big, small = NULL, tiled = NULL;
+    uint64  full, pb, ps = 0, target;
+    double  fastest = 0;
+    int     best = -1;
+
+    if (!bmp || bmp->format != BMF_RGB24) return -1;
+
+    full = (uint64) bmp->width * bmp->height;
+    target = full / 16;
+    if (target > TUNE_PROXY)
+        target = TUNE_PROXY;
+    if (target < TUNE_PROXY_MIN)
+        target = TUNE_PROXY_MIN;
+    big = full > target ? tune_proxy(bmp, target, threads) : bmp;
+    if (!big) return -1;
+    pb = (uint64) big->width * big->height;
+    if (pb >= 256) {
+        bitmap  quarter = tune_proxy(big, pb / 4, threads);
+        bool    failed = !quarter;
+
+        /* proxies too thin for a dither cell are timed whole, like tiny
+           images */
+        if (quarter && quarter->width >= 4 && quarter->height >= 4) {
+            small = tune_tile(quarter, 1);
+            tiled = tune_tile(quarter, 2);
+            failed = !small || !tiled;
+        }
+        bitmap_destroy(&quarter);
+        if (failed) {
+            if (big != bmp)
+                bitmap_destroy(&big);
+            bitmap_destroy(&small);
+            bitmap_destroy(&tiled);
+            return -1;
+        }
+    }
+    if (small)
+        ps = (uint64) small->width * small->height;
+
+    memset(trials, 0, TUNE_CONFIGS * sizeof(tune_trial_t));
+    for (int i = 0; i < TUNE_CONFIGS; i++)
+        trials[i].config = tuneConfigs[i];
+    for (int i = 0; i < TUNE_CONFIGS; i++) {
+        tune_trial_t * t = &trials[i];
+        bitmap  res = NULL;
+        double  tb, ts = 0, tt = 0, slope, fixed = 0;
+        metric_t m;
+
+        /* the rest stay untried */
+        if (i && budget > 0 &&
+            (thread_clock() - start) * 1000.0 > budget * TUNE_SHARE)
+            break;
+        if ((tb = tune_time(job, arg, &t->config, big, &res)) < 0 ||
+            (small &&
+             ((ts = tune_time(job, arg, &t->config, small, NULL)) < 0 ||
+              (tt = tune_time(job, arg, &t->config, tiled, NULL)) < 0))) {
+            bitmap_destroy(&res);
+            continue;
+        }
+        t->ok = metric_compare(big, res, &m, threads);
+        bitmap_destroy(&res);
+        if (!t->ok)
+            continue;
+        t->psnr = m.psnrAll;
+        t->ssim = m.ssim;
+
+        /* the split is bounded by no cost and every cost per pixel, the
+           timings are noisy. Tiny images have no tiles, all of their cost
+           scales. */
+        slope = tb / pb;
+        if (ps) {
+            slope = tt > ts ? (tt - ts) / (3 * ps) : 0;
+            if (slope > tt / (4 * ps))
+                slope = tt / (4 * ps);
+            fixed = ts > slope * ps ? ts - slope * ps : 0;
+        }
+        t->estimate = (fixed + slope * full) * 1000.0;
+    }
+
+    if (big != bmp)
+        bitmap_destroy(&big);
+    bitmap_destroy(&small);
+    bitmap_destroy(&tiled);
+
+    /* the best quality that fits, or else the best of the fastest */
+    double left = budget - (thread_clock() - start) * 1000.0;
+    for (int i = 0; i < TUNE_CONFIGS; i++)
+        if (trials[i].ok) {
+            trials[i].fits = budget <= 0 || trials[i].estimate <= left;
+            if (fastest <= 0 || trials[i].estimate < fastest)
+                fastest = trials[i].estimate;
+        }
+    for (int i = 0; i < TUNE_CONFIGS; i++) {
+        tune_trial_t * t = &trials[i];
+
+        if (!t->ok || (!t->fits && t->estimate > fastest * TUNE_SLACK))
+            continue;
+        if (best < 0 || (t->fits && !trials[best].fits) ||
+            (t->fits == trials[best].fits &&
+             (t->ssim > trials[best].ssim ||
+              (t->ssim == trials[best].ssim && t->psnr > trials[best].psnr))))
+            best = i;
+    }
+    return best;
+}
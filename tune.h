@@ -0,0 +1,56 @@
+#ifndef __TUNE_H__
+#define __TUNE_H__ (1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "image.h"
+#include "quantize.h"
+
+/*------------------------------ AUTOMATIC TUNING ----------------------------*/
+
+/* pixels of the downscaled proxy the candidates are tried on: a 16th of
+   the image, within these bounds */
+#define TUNE_PROXY      (1 << 16)
+#define TUNE_PROXY_MIN  (1 << 12)
+/* uniform, wu and octree palettes, each without and with ordered dither */
+#define TUNE_CONFIGS    (6)
+
+/* settings chosen between */
+typedef struct tune_config {
+    palette_t   palette;
+    bool        dither;
+} tune_config_t;
+
+/* outcome of the trial of one configuration */
+typedef struct tune_trial {
+    tune_config_t config;
+    bool        ok;             /* the trial ran and was measured */
+    double      psnr;           /* dB, on the proxy */
+    double      ssim;
+    double      estimate;       /* milliseconds predicted at full size */
+    bool        fits;           /* [estimate] fits what is left of the budget */
+} tune_trial_t;
+
+/* quantizes the RGB24 [bmp] with [config], NULL on failure */
+typedef bitmap (*tune_job_t)(void * arg, const tune_config_t * config,
+                             const bitmap bmp);
+
+/* averages an RGB24 bitmap down by the smallest whole factor that leaves
+   at most [pixels] pixels, on [threads] threads. NULL when out of memory. */
+bitmap  tune_proxy(const bitmap bmp, uint32 pixels, int threads);
+
+/* runs the configurations through [job] on a proxy of [bmp], as many as
+   half of [budget] allows, and fills the TUNE_CONFIGS [trials]. Returns the configuration with the best
+   SSIM among those predicted to finish within what is left of [budget]
+   milliseconds (0 = unlimited), the best one of those about as fast as
+   the fastest when none does, or -1 when no trial succeeded. */
+int     tune_select(const bitmap bmp, double budget, tune_job_t job,
+                    void * arg, tune_trial_t * trials, int threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
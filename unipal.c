@@ -1,152 +1,1102 @@
 /* UNIPAL.C: reduce an RGB 24-bit image to 8-bit using uniform palette */
 /* Coded by Trinh D.D. Nguyen, Dec 2024 */
 
-// #define USE_GAMMA_CORRECTION
-
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#ifdef USE_GAMMA_CORRECTION
-    #include <math.h>
-#endif
 #include "image.h"
 #include "bitmap.h"
+#include "quantize.h"
+#include "simd.h"
+#include "thread.h"
+#include "stream.h"
+#include "dither.h"
+#include "octree.h"
+#include "wu.h"
+#include "median.h"
+#include "remap.h"
+#include "kmeans.h"
+#include "palette.h"
+#include "batch.h"
+#include "server.h"
+#include "deflate.h"
+#include "stats.h"
+#include "metric.h"
+#include "tune.h"
+
+/* command line usage */
+void usage(void) {
+    printf("Usage: unipal image.bmp [output.bmp] [options]\n");
+    printf("       unipal -o dir image.bmp|pattern|@list ... [options]\n");
+    printf("Options:\n");
+    printf("  -p, -palette P    palette generator, P = uniform (default), octree, wu,\n");
+    printf("                    median\n");
+    printf("  -c, -colors N     palette size of adaptive generators (2..256)\n");
+    printf("  -k, -kmeans N     refine the palette with up to N k-means iterations\n");
+    printf("  -b, -budget MS    time budget of the k-means refinement (0 = none)\n");
+    printf("  -a, -sample N     build the palette from about N pixels (0 = all)\n");
+    printf("  -u, -union F      add image F to the palette statistics (repeatable)\n");
+    printf("  -w, -write F      save the palette to the JASC-PAL file F\n");
+    printf("  -l, -load F       reuse the palette of file F, only remapping runs\n");
+    printf("  -f, -drift T      with -l: rebuild and save the palette once the\n");
+    printf("                    image histogram drifted by more than T (0..1)\n");
+    printf("  -d, -dither       enable 4x4 ordered dithering\n");
+    printf("  -e, -diffuse K    error diffusion dithering, K = fs, atkinson, sierra\n");
+    printf("  -r, -raster       diffuse in raster order, allows a parallel wavefront\n");
+    printf("  -t, -threads N    quantize using N threads (0 = all processors)\n");
+    printf("  -s, -stream       quantize scanline by scanline with O(width) memory\n");
+    printf("  -z, -rle          write RLE8 (RLE4 up to 16 colors) compressed bitmaps,\n");
+    printf("                    or PNG files at the best compression level\n");
+    printf("  -q, -quality      report the MSE, PSNR and SSIM of every output against\n");
+    printf("                    its input\n");
+    printf("  -G, -gamma C      average the uniform palette in linear light, C = srgb,\n");
+    printf("                    none (default) or an exponent such as 2.2\n");
+    printf("  -A, -auto MS      try the palettes and dithering on a downscaled copy and\n");
+    printf("                    keep the best one that fits MS milliseconds (0 = any)\n");
+    printf("  -g, -stats F      append stage timings and counters of every image to\n");
+    printf("                    F as JSON lines (- = standard output)\n");
+    printf("  -o, -outdir D     batch mode, every input is quantized into directory D\n");
+    printf("  -j, -jobs N       images quantized at once in batch mode (0 = all\n");
+    printf("                    processors)\n");
+    printf("  -S, -serve P      serve requests on the Unix socket P, -j of them at once\n");
+    printf("  -C, -connect P    quantize through the server listening on socket P\n");
+}
+
+/* quantization settings, shared by every image of a batch */
+typedef struct options {
+    bool        dither;
+    bool        diffuse;
+    bool        serpentine;
+    diffuse_kernel_t kernel;
+    palette_t   palette;
+    int         colors;
+    kmeans_t    kmeans;
+    int         samples;
+    const char  ** unions;      /* more images for the palette statistics */
+    int         pooled;
+    const char  * load;         /* palette file to reuse */
+    const char  * save;         /* palette file to write */
+    double      drift;          /* rebuild threshold of [load], < 0 = none */
+    rgb_t       pal[256];       /* palette of every image when [shared] */
+    uint32      shared;
+    int         threads;        /* per image */
+    bool        compress;       /* RLE bitmaps, best level PNG files */
+    bool        verbose;        /* progress of every step */
+    bool        quiet;          /* errors are left to the caller */
+    FILE        * stats;        /* JSON line per image, NULL = none */
+    bool        quality;        /* measure the error of every output */
+    double      tune;           /* latency budget of the automatic choice
+                                   of palette and dithering, < 0 = none */
+} options_t;
 
-typedef struct cube_t {
-    uint32  r, g, b;
+/*  parse_option()
+*   parses the quantization option at argv[i], returns the index of the
+*   next argument, 0 if argv[i] is no such option or -1 if it is invalid.
+*   [unions] of [opt] must have room for every argument.
+*/
+static int parse_option(options_t * opt, int argc, char * argv[], int i) {
+    if (!strcmp(argv[i], "-dither") || !strcmp(argv[i], "-d"))
+        opt->dither = true;
+    else
+    if (!strcmp(argv[i], "-palette") || !strcmp(argv[i], "-p")) {
+        if (++i >= argc || !palette_parse(argv[i], &opt->palette)) {
+            return -1;
+        }
+    }
+    else
+    if (!strcmp(argv[i], "-colors") || !strcmp(argv[i], "-c")) {
+        if (++i >= argc || (opt->colors = atoi(argv[i])) < 2 ||
+            opt->colors > 256) {
+            return -1;
+        }
+    }
+    else
+    if (!strcmp(argv[i], "-kmeans") || !strcmp(argv[i], "-k")) {
+        if (++i >= argc || (opt->kmeans.iterations = atoi(argv[i])) < 0) {
+            return -1;
+        }
+    }
+    else
+    if (!strcmp(argv[i], "-budget") || !strcmp(argv[i], "-b")) {
+        if (++i >= argc || (opt->kmeans.budget = atof(argv[i])) < 0) {
+            return -1;
+        }
+    }
+    else
+    if (!strcmp(argv[i], "-sample") || !strcmp(argv[i], "-a")) {
+        if (++i >= argc || (opt->samples = atoi(argv[i])) < 0) {
+            return -1;
+        }
+    }
+    else
+    if (!strcmp(argv[i], "-union") || !strcmp(argv[i], "-u")) {
+        if (++i >= argc) {
+            return -1;
+        }
+        opt->unions[opt->pooled++] = argv[i];
+    }
+    else
+    if (!strcmp(argv[i], "-write") || !strcmp(argv[i], "-w")) {
+        if (++i >= argc) {
+            return -1;
+        }
+        opt->save = argv[i];
+    }
+    else
+    if (!strcmp(argv[i], "-load") || !strcmp(argv[i], "-l")) {
+        if (++i >= argc) {
+            return -1;
+        }
+        opt->load = argv[i];
+    }
+    else
+    if (!strcmp(argv[i], "-drift") || !strcmp(argv[i], "-f")) {
+        if (++i >= argc || (opt->drift = atof(argv[i])) < 0 ||
+            opt->drift > 1) {
+            return -1;
+        }
+    }
+    else
+    if (!strcmp(argv[i], "-diffuse") || !strcmp(argv[i], "-e")) {
+        if (++i >= argc || !diffuse_parse(argv[i], &opt->kernel)) {
+            return -1;
+        }
+        opt->diffuse = true;
+    }
+    else
+    if (!strcmp(argv[i], "-raster") || !strcmp(argv[i], "-r"))
+        opt->serpentine = false;
+    else
+    if (!strcmp(argv[i], "-rle") || !strcmp(argv[i], "-z"))
+        opt->compress = true;
+    else
+        return 0;
+    return i + 1;
+}
+
+/* progress messages, batches only report one line per image */
+#define note(opt, ...) do { if ((opt)->verbose) printf(__VA_ARGS__); } while (0)
+/* errors, unless the caller handles them as tuning trials do */
+#define complain(opt, ...) do { if (!(opt)->quiet) printf(__VA_ARGS__); } while (0)
+
+/* builds a palette from the statistics bitmap [est], returns its size */
+static uint32 build_palette(const options_t * opt, const bitmap est,
+                            rgb_t * pal) {
     uint32  count;
-} cube, cubes[256];
-
-/* for ordered dithering */
-uint8 bayerMatrix[16] = { 0,  8,  2, 10, 
-                         12,  4, 14,  6,
-                          3, 11,  1,  9,
-                         15,  7, 13,  5};
-
-/* slightly fast color clamping */
-inline uint8 clamp(int n) {
-    n &= -(n >= 0);
-    return n | ((255 - n) >> 31);
-}
-
-#ifdef USE_GAMMA_CORRECTION
-
-float   gamma_value = 2.2;
-
-/* gamma correction for an RGB triplet */
-void gamma_correction(int *r, int *g, int *b, float gamma) { 
-    float rNorm = *r / 255.0; 
-    float gNorm = *g / 255.0; 
-    float bNorm = *b / 255.0; 
-    
-    // perform corrections
-    rNorm = pow(rNorm, gamma); 
-    gNorm = pow(gNorm, gamma); 
-    bNorm = pow(bNorm, gamma); 
-    
-    *r = (int)(rNorm * 255.0); 
-    *g = (int)(gNorm * 255.0); 
-    *b = (int)(bNorm * 255.0); 
-}
-#endif
-
-/* fast RGB quantization */
-bitmap quantize_uniform(const bitmap bmp, bool dither) {
-    if (!bmp) return NULL;
-    if (bmp->format != BMF_RGB24) return NULL;
-
-    /* create output indexed bitmap */
-    bitmap res = bitmap_create(bmp->width, bmp->height, BMF_INDEXED8, true);
-        
-    cubes uniCubes = {0};       /* RGB cubes */ 
-    uint8 * src = bmp->data;    /* pointer to source bitmap bits */
-    uint8 * dst = res->data;    /* pointer to output bitmap bits */    
-    
-    /* quantization phase */
-    for (int y = 0; y < bmp->height; y++) {
-        for (int x = 0; x < bmp->width; x++) {
-            /* dithering if needed */
-            int t = dither ? (bayerMatrix[((y & 3) << 2) + (x & 3)] - 8) : 0;
-            int b = clamp((*src++) + (t << 1));
-            int g = clamp((*src++) + (t << 1));
-            int r = clamp((*src++) + (t << 1));
-#ifdef USE_GAMMA_CORRECTION
-            gamma_correction(&r, &g, &b, gamma_value);
-#endif
-            /* quantize */
-            uint8 k = ((r >> 5) << 5) + ((g >> 5) << 2) + (b >> 6);
-		    (*dst++) = k;
-
-            /* preparing RGB cubes for CLUT */
-            uniCubes[k].r += r;
-            uniCubes[k].g += g;
-            uniCubes[k].b += b;
-            uniCubes[k].count++;		
-        }
-    }
-
-    /* generate a uniform CLUT based on the quantized colors */
-    for (int i = 0; i < 256; i++)
-        if (uniCubes[i].count) {
-            res->pal[i].r = (uniCubes[i].r / uniCubes[i].count);
-            res->pal[i].g = (uniCubes[i].g / uniCubes[i].count);
-            res->pal[i].b = (uniCubes[i].b / uniCubes[i].count);
-        }
-        else {
-            res->pal[i].r = 0;
-            res->pal[i].g = 0;
-            res->pal[i].b = 0;
+
+    note(opt, ". Building palette (palette: %s, colors: %d)...\n",
+         palette_name(opt->palette), opt->colors);
+    if ((count = palette_generate(est, opt->palette, opt->colors, pal,
+                                  opt->threads)) &&
+        opt->kmeans.iterations) {
+        note(opt, ". Refining palette (k-means: %d iterations, budget: %g ms, simd: %s)...\n",
+             opt->kmeans.iterations, opt->kmeans.budget,
+             simd_name(simd_level()));
+        int done = kmeans_refine(est, pal, count, &opt->kmeans, opt->threads);
+        if (done < 0)
+            count = 0;
+        else
+            note(opt, "  - Iterations run = %d\n", done);
+    }
+    return count;
+}
+
+/* writes [pal] with the signature of the images it was built from */
+static void save_palette(const char * filename, const bitmap est,
+                         const rgb_t * pal, uint32 count) {
+    palette_sig_t   sig;
+
+    printf(". Saving palette to [%s]...\n", filename);
+    palette_signature(est, &sig);
+    if (palette_save(filename, pal, count, &sig) != IMR_OK)
+        printf("ERROR: cannot write palette file.\n");
+}
+
+/* writes an output image, -z picks RLE bitmaps or the best PNG level */
+static bool save_image(const options_t * opt, const char * filename,
+                       const bitmap * bmp) {
+    if (opt->compress && image_type(filename) == BFM_BMP)
+        return bmp_save_rle(filename, bmp);
+    if (opt->compress && image_type(filename) == BFM_PNG)
+        return png_save_level(filename, bmp, DEFLATE_BEST);
+    return image_save(filename, bmp);
+}
+
+/* why save_image() may have failed on [filename]: PGM and PBM files only
+   hold grey levels, or black and white */
+static const char * save_error(const char * filename) {
+    const char  * dot = strrchr(filename, '.');
+
+    if (dot && (!strcmp(dot, ".pgm") || !strcmp(dot, ".PGM")))
+        return ", a PGM only holds grey levels";
+    if (dot && (!strcmp(dot, ".pbm") || !strcmp(dot, ".PBM")))
+        return ", a PBM only holds black and white";
+    return "";
+}
+
+/* measures the error of [res] against its input [bmp], also kept in the
+   statistics of the image when they are recorded */
+static bool measure_image(const options_t * opt, const bitmap bmp,
+                          const bitmap res, metric_t * m) {
+    double  start = stats_start();
+    bool    ok = metric_compare(bmp, res, m, opt->threads);
+
+    stats_stop(STATS_METRIC, start);
+    if (ok && stats_current) {
+        stats_current->measured = true;
+        stats_current->quality = *m;
+    }
+    return ok;
+}
+
+/* quantizes one image, NULL on failure once the reason is printed */
+static bitmap quantize_image(const options_t * opt, const bitmap bmp) {
+    const char  * save = opt->save;
+    int         threads = opt->threads;
+    bitmap      res = NULL;
+
+    if (bmp->format != BMF_RGB24) {
+        complain(opt, "ERROR: input bitmap must be 24-bit.\n");
+        return NULL;
+    }
+
+    /* a palette shared by the whole batch only needs remapping */
+    if (opt->shared) {
+        if (opt->diffuse)
+            res = quantize_diffuse(bmp, opt->kernel, opt->serpentine,
+                                   opt->pal, opt->shared, threads);
+        else
+            res = remap_bitmap(bmp, opt->pal, opt->shared, opt->dither,
+                               threads);
+        if (!res)
+            complain(opt, "ERROR: not enough memory.\n");
+        return res;
+    }
+
+    /* palette statistics come from a union of images or from a pixel
+       sample on request */
+    bitmap est = bmp;
+    if (opt->pooled) {
+        if (!(est = palette_union(bmp, opt->unions, opt->pooled,
+                                  opt->samples))) {
+            complain(opt, "ERROR: cannot build the union histogram, all images must be bitmaps.\n");
+            return NULL;
+        }
+        note(opt, "  - Union histogram = %d images, %d pixels\n",
+             opt->pooled + 1, est->width * est->height);
+    }
+    else
+    if (opt->samples && opt->samples < (uint64) bmp->width * bmp->height) {
+        if (!(est = palette_sample(bmp, opt->samples))) {
+            complain(opt, "ERROR: not enough memory.\n");
+            return NULL;
+        }
+        note(opt, "  - Palette sample = %d x %d\n", est->width, est->height);
+    }
+
+    if (opt->load || save || opt->kmeans.iterations ||
+        (opt->palette != PALETTE_UNIFORM &&
+         (opt->dither || opt->diffuse || est != bmp))) {
+        /* shared palettes, refining, dithering or sampling need the palette
+           first, then remap every pixel */
+        rgb_t   pal[256];
+        uint32  count = 0;
+
+        if (opt->load) {
+            palette_sig_t   ref;
+            image_result_t  r = palette_load(opt->load, pal, &count, &ref);
+
+            if (r == IMR_OK && opt->drift >= 0) {
+                /* compare with the images the palette was built from */
+                palette_sig_t   cur;
+                double          d;
+
+                palette_signature(bmp, &cur);
+                d = palette_drift(&ref, &cur);
+                note(opt, "  - Palette drift = %.4f (threshold: %.4f)\n", d,
+                     opt->drift);
+                if (d > opt->drift) {
+                    count = 0;
+                    if (!save) save = opt->load;
+                }
+            }
+            else
+            if (r == IMR_FILE_NOT_FOUND && opt->drift >= 0) {
+                if (!save) save = opt->load;
+            }
+            else
+            if (r != IMR_OK) {
+                complain(opt, "ERROR: cannot load palette [%s]\n", opt->load);
+                if (est != bmp)
+                    bitmap_destroy(&est);
+                return NULL;
+            }
+            if (count)
+                note(opt, ". Reusing palette [%s] (colors: %d)...\n",
+                     opt->load, count);
+        }
+
+        if (!count && (count = build_palette(opt, est, pal)) && save)
+            save_palette(save, est, pal, count);
+        if (count) {
+            if (opt->diffuse) {
+                note(opt, ". Remapping colors (error diffusion: %s, scan: %s, threads: %d)...\n",
+                     diffuse_name(opt->kernel),
+                     opt->serpentine ? "serpentine" : "raster",
+                     opt->serpentine ? 1 : thread_count(threads));
+                res = quantize_diffuse(bmp, opt->kernel, opt->serpentine, pal,
+                                       count, threads);
+            }
+            else {
+                note(opt, ". Remapping colors (dithering: %s, threads: %d)...\n",
+                     opt->dither ? "yes" : "no", thread_count(threads));
+                res = remap_bitmap(bmp, pal, count, opt->dither, threads);
+            }
+        }
+    }
+    else
+    if (opt->palette == PALETTE_OCTREE) {
+        note(opt, ". Quantizing colors (palette: octree, colors: %d, threads: %d)...\n",
+             opt->colors, thread_count(threads));
+        res = quantize_octree(bmp, opt->colors, threads);
+    }
+    else
+    if (opt->palette == PALETTE_WU) {
+        note(opt, ". Quantizing colors (palette: wu, colors: %d, threads: %d)...\n",
+             opt->colors, thread_count(threads));
+        res = quantize_wu(bmp, opt->colors, threads);
+    }
+    else
+    if (opt->palette == PALETTE_MEDIAN) {
+        note(opt, ". Quantizing colors (palette: median, colors: %d, threads: %d)...\n",
+             opt->colors, thread_count(threads));
+        res = quantize_median(bmp, opt->colors, threads);
+    }
+    else
+    if (opt->diffuse) {
+        note(opt, ". Quantizing colors (error diffusion: %s, scan: %s, threads: %d)...\n",
+             diffuse_name(opt->kernel),
+             opt->serpentine ? "serpentine" : "raster",
+             opt->serpentine ? 1 : thread_count(threads));
+        res = quantize_diffuse(bmp, opt->kernel, opt->serpentine, NULL, 0,
+                               threads);
+    }
+    else
+    if (est != bmp) {
+        note(opt, ". Quantizing colors (dithering: %s, simd: %s, threads: %d, sampled)...\n",
+             opt->dither ? "yes" : "no", simd_name(simd_level()),
+             thread_count(threads));
+        res = quantize_uniform_sampled(bmp, est, opt->dither, threads);
+    }
+    else {
+        note(opt, ". Quantizing colors (dithering: %s, simd: %s, threads: %d)...\n",
+             opt->dither ? "yes" : "no", simd_name(simd_level()),
+             thread_count(threads));
+        res = quantize_uniform(bmp, opt->dither, threads);
+    }
+
+    if (!res)
+        complain(opt, "ERROR: not enough memory.\n");
+    if (est != bmp)
+        bitmap_destroy(&est);
+    return res;
+}
+
+/* tune_select() job: quantizes a proxy quietly with the settings tried */
+static bitmap tune_quantize(void * arg, const tune_config_t * config,
+                            const bitmap bmp) {
+    options_t   o = *(const options_t *) arg;
+
+    o.palette = config->palette;
+    o.dither = config->dither;
+    o.verbose = false;
+    o.quiet = true;
+    return quantize_image(&o, bmp);
+}
+
+/* copies [opt] into [tuned] with the palette generator and dithering
+   picked for [bmp], false when no trial could run */
+static bool tune_image(const options_t * opt, const bitmap bmp,
+                       options_t * tuned) {
+    tune_trial_t    trials[TUNE_CONFIGS];
+    stats_t         * st = stats_current;
+    double          start = stats_start();
+    int             best;
+
+    if (opt->tune > 0)
+        note(opt, ". Tuning palette and dithering (budget: %g ms, threads: %d)...\n",
+             opt->tune, thread_count(opt->threads));
+    else
+        note(opt, ". Tuning palette and dithering (budget: none, threads: %d)...\n",
+             thread_count(opt->threads));
+    /* the trials stay out of the counters of the image */
+    stats_attach(NULL);
+    best = tune_select(bmp, opt->tune, tune_quantize, (void *) opt, trials,
+                       opt->threads);
+    stats_attach(st);
+    stats_stop(STATS_TUNE, start);
+    if (best < 0)
+        return false;
+
+    for (int i = 0; i < TUNE_CONFIGS; i++)
+        if (trials[i].ok)
+            note(opt, "  - %-7s %-10s PSNR %.2f dB, SSIM %.4f, ~%.1f ms%s\n",
+                 palette_name(trials[i].config.palette),
+                 trials[i].config.dither ? "dithered" : "plain",
+                 trials[i].psnr, trials[i].ssim, trials[i].estimate,
+                 trials[i].fits ? "" : " (over budget)");
+    *tuned = *opt;
+    tuned->palette = trials[best].config.palette;
+    tuned->dither = trials[best].config.dither;
+    note(opt, "  - Picked = %s, %s\n", palette_name(tuned->palette),
+         tuned->dither ? "dithered" : "plain");
+    return true;
+}
+
+/* why tune_image() failed on [bmp] */
+static const char * tune_error(const bitmap bmp) {
+    return bmp->format != BMF_RGB24 ? "input must be a 24-bit bitmap" :
+                                      "not enough memory";
+}
+
+/* batch job: quantizes one image of the list into the output directory */
+typedef struct {
+    const options_t     * opt;
+    const batch_list_t  * list;
+    const char          * outdir;
+} batch_ctx_t;
+
+static bool batch_image(void * arg, int index, bitmap bmp) {
+    const batch_ctx_t * ctx = (const batch_ctx_t *) arg;
+    const char  * input = ctx->list->name[index];
+    char        output[1024], error[64] = "", tuned[40] = "";
+    options_t   o;
+    const options_t * opt = ctx->opt;
+    bitmap      res;
+    metric_t    m;
+    bool        ok = false;
+
+    if (!batch_output(output, sizeof(output), ctx->outdir, input))
+        printf("ERROR: output name of [%s] is too long.\n", input);
+    else
+    if (!bmp)
+        printf("ERROR: cannot load [%s]\n", input);
+    else
+    if (opt->tune >= 0 && !tune_image(opt, bmp, &o))
+        printf("ERROR: cannot tune [%s], %s.\n", input, tune_error(bmp));
+    else {
+        if (opt->tune >= 0) {
+            opt = &o;
+            snprintf(tuned, sizeof(tuned), " [%s, %s]",
+                     palette_name(o.palette), o.dither ? "dithered" : "plain");
+        }
+        double start = stats_start();
+        res = quantize_image(opt, bmp);
+        stats_stop(STATS_QUANTIZE, start);
+        if (res) {
+            if (opt->quality && measure_image(opt, bmp, res, &m))
+                snprintf(error, sizeof(error), " (PSNR %.2f dB, SSIM %.4f)",
+                         m.psnrAll, m.ssim);
+            start = stats_start();
+            if (!(ok = save_image(opt, output, &res)))
+                printf("ERROR: cannot write [%s]\n", output);
+            stats_stop(STATS_SAVE, start);
+            bitmap_destroy(&res);
+        }
+    }
+    if (ok) {
+        printf("  - [%d/%d] %s -> %s%s%s\n", index + 1, ctx->list->count,
+               input, output, tuned, error);
+        if (ctx->opt->stats && stats_current)
+            stats_print(ctx->opt->stats, stats_current, input, bmp->width,
+                        bmp->height);
+    }
+    return ok;
+}
+
+/* quantizes every image of [list] into [outdir], returns the failures */
+static int batch(options_t * opt, const batch_list_t * list,
+                 const char * outdir, int jobs, int threads) {
+    int     workers = thread_count(jobs);
+    int     failed;
+
+    if (workers > list->count)
+        workers = list->count;
+    /* processors are split among the images unless told otherwise */
+    opt->threads = threads > 0 ? threads :
+                   thread_count(threads) / workers > 1 ?
+                   thread_count(threads) / workers : 1;
+
+    /* the kernels are picked before any worker starts */
+    printf(". Batch = %d images into [%s] (workers: %d, threads per image: %d, simd: %s)\n",
+           list->count, outdir, workers, opt->threads, simd_name(simd_level()));
+
+    /* a palette file or a union histogram gives every image one palette */
+    if (opt->load) {
+        palette_sig_t   ref;
+
+        if (palette_load(opt->load, opt->pal, &opt->shared, &ref) != IMR_OK) {
+            printf("ERROR: cannot load palette [%s]\n", opt->load);
+            return list->count;
+        }
+        printf(". Reusing palette [%s] (colors: %d)...\n", opt->load,
+               opt->shared);
+    }
+    else
+    if (opt->save || opt->pooled) {
+        const char  ** names;
+        bitmap      est;
+
+        if (!(names = (const char **) malloc((list->count + opt->pooled) *
+                                             sizeof(char *)))) {
+            printf("ERROR: not enough memory.\n");
+            return list->count;
+        }
+        memcpy(names, list->name, list->count * sizeof(char *));
+        if (opt->pooled)
+            memcpy(names + list->count, opt->unions,
+                   opt->pooled * sizeof(char *));
+        est = palette_union(NULL, names, list->count + opt->pooled,
+                            opt->samples);
+        free(names);
+        if (!est) {
+            printf("ERROR: cannot build the union histogram, all images must be bitmaps.\n");
+            return list->count;
+        }
+        printf("  - Union histogram = %d images, %d pixels\n",
+               list->count + opt->pooled, est->width * est->height);
+
+        opt->verbose = true;
+        opt->threads = thread_count(threads);
+        if ((opt->shared = build_palette(opt, est, opt->pal)) && opt->save)
+            save_palette(opt->save, est, opt->pal, opt->shared);
+        bitmap_destroy(&est);
+        if (!opt->shared) {
+            printf("ERROR: cannot build the palette.\n");
+            return list->count;
+        }
+        opt->threads = threads > 0 ? threads :
+                       thread_count(threads) / workers > 1 ?
+                       thread_count(threads) / workers : 1;
+    }
+
+    opt->verbose = false;
+    batch_ctx_t ctx = { opt, list, outdir };
+    failed = batch_run(list, workers, batch_image, &ctx);
+    printf(". Done, %d of %d images quantized\n", list->count - failed,
+           list->count);
+    return failed;
+}
+
+/* per worker cache of the server: the palette of the last palette file
+   requested, with its inverse colormap still filled */
+typedef struct {
+    remap_t     * map;
+} serve_cache_t;
+
+typedef struct {
+    const options_t * base;     /* options given to the server */
+    serve_cache_t   * cache;    /* one per worker */
+} serve_t;
+
+/* server job: parses the request options on top of the server ones, then
+   quantizes the inline image or the named file */
+static bitmap serve_request(void * arg, server_request_t * req) {
+    serve_t     * srv = (serve_t *) arg;
+    options_t   opt = *srv->base;
+    const char  * unions[SERVER_ARGS];
+    const char  * path = NULL;
+    double      start = thread_clock();
+    bitmap      bmp, res = NULL;
+
+    opt.unions = unions;
+    for (int i = 0; i < req->argc; i++) {
+        int next = parse_option(&opt, req->argc, req->argv, i);
+        if (next < 0 || (!next && (req->argv[i][0] == '-' || path))) {
+            snprintf(req->error, SERVER_ERROR, "invalid argument [%s]",
+                     req->argv[i]);
+            return NULL;
         }
+        if (next)
+            i = next - 1;
+        else
+            path = req->argv[i];
+    }
+    if (opt.save || opt.drift >= 0) {
+        snprintf(req->error, SERVER_ERROR, "palette files are read only");
+        return NULL;
+    }
 
+    /* the input lands in the bitmap kept by the worker */
+    if (req->data)
+        bmp = image_decode(req->data, req->size, req->input);
+    else
+    if (path)
+        bmp = image_reload(path, req->input);
+    else {
+        snprintf(req->error, SERVER_ERROR, "no input image");
+        return NULL;
+    }
+    if (!bmp) {
+        snprintf(req->error, SERVER_ERROR, "cannot load the input image");
+        return NULL;
+    }
+
+    if (opt.load) {
+        serve_cache_t   * cache = &srv->cache[req->worker];
+        palette_sig_t   sig;
+
+        if (palette_load(opt.load, opt.pal, &opt.shared, &sig) != IMR_OK) {
+            snprintf(req->error, SERVER_ERROR, "cannot load palette [%s]",
+                     opt.load);
+            return NULL;
+        }
+        opt.load = NULL;
+        /* the colormap is kept while the palette stays the same */
+        if (cache->map && (cache->map->colors != opt.shared ||
+            memcmp(cache->map->pal, opt.pal, opt.shared * sizeof(rgb_t))))
+            remap_destroy(&cache->map);
+        if (!cache->map)
+            cache->map = remap_create(opt.pal, opt.shared);
+        if (cache->map && !opt.diffuse)
+            res = remap_bitmap_with(bmp, cache->map, opt.dither);
+    }
+    if (!res)
+        res = quantize_image(&opt, bmp);
+
+    req->compress = opt.compress;
+    if (!res)
+        snprintf(req->error, SERVER_ERROR, "cannot quantize the input image");
+    else
+        printf("  - [worker %d] %d x %d, %s palette, %.2f ms\n", req->worker,
+               bmp->width, bmp->height,
+               opt.shared ? "shared" : palette_name(opt.palette),
+               (thread_clock() - start) * 1000);
     return res;
 }
 
+/* serves quantization requests on [path] until told to stop */
+static int serve(const options_t * opt, const char * path, int jobs) {
+    serve_cache_t   * cache;
+    int             workers = thread_count(jobs);
+
+    if (!(cache = (serve_cache_t *) calloc(workers, sizeof(serve_cache_t)))) {
+        printf("ERROR: not enough memory.\n");
+        return -1;
+    }
+    printf(". Serving on [%s] (workers: %d, threads per image: %d, simd: %s)...\n",
+           path, workers, opt->threads, simd_name(simd_level()));
+    fflush(stdout);
+
+    serve_t srv = { opt, cache };
+    bool ok = server_run(path, workers, serve_request, &srv);
+    if (!ok)
+        printf("ERROR: cannot listen on [%s]\n", path);
+    else
+        printf(". Server stopped\n");
+
+    for (int i = 0; i < workers; i++)
+        remap_destroy(&cache[i].map);
+    free(cache);
+    return ok ? 0 : -1;
+}
+
+/* sends [input] to the server on [path] and saves its answer to [output] */
+static int connect_server(const char * path, const char * input,
+                          const char * output, const char * args) {
+    FILE    * fp;
+    uint8   * data = NULL, * reply = NULL;
+    long    size;
+    uint32  length = 0;
+    char    error[SERVER_ERROR];
+    bool    ok;
+
+    if (!(fp = fopen(input, "rb"))) {
+        printf("ERROR: cannot load [%s]\n", input);
+        return -1;
+    }
+    if (fseek(fp, 0, SEEK_END) || (size = ftell(fp)) < 0 ||
+        size > SERVER_DATA_MAX || fseek(fp, 0, SEEK_SET) ||
+        !(data = (uint8 *) malloc(size ? size : 1)) ||
+        fread(data, 1, size, fp) != (size_t) size) {
+        printf("ERROR: cannot load [%s]\n", input);
+        fclose(fp);
+        free(data);
+        return -1;
+    }
+    fclose(fp);
+
+    double start = thread_clock();
+    ok = server_call(path, args, data, size, &reply, &length, error,
+                     sizeof(error));
+    free(data);
+    if (!ok) {
+        printf("ERROR: %s\n", error);
+        free(reply);
+        return -1;
+    }
+    printf(". Quantized by [%s] in %.2f ms\n", path,
+           (thread_clock() - start) * 1000);
+
+    printf(". Saving output to [%s]...\n", output);
+    if (!(fp = fopen(output, "wb")) || fwrite(reply, 1, length, fp) != length) {
+        printf("ERROR: cannot write output bitmap.\n");
+        ok = false;
+    }
+    if (fp && fclose(fp))
+        ok = false;
+    free(reply);
+    return ok ? 0 : -1;
+}
+
+/* releases what main() allocated and closes the statistics file,
+   returns [rc] */
+static int leave(options_t * opt, const char ** names, int rc) {
+    if (opt->stats && opt->stats != stdout)
+        fclose(opt->stats);
+    free(opt->unions);
+    free(names);
+    return rc;
+}
+
 /* main program */
 int main(int argc, char * argv[]) {
+    options_t   opt;
     bitmap  bmp;
-    bool    dither = false;
+    bool    stream = false;
+    int     threads = 0;
+    int     jobs = 0;
+    const char ** names = NULL;
+    int     files = 0;
+    const char * outdir = NULL;
+    const char * serving = NULL, * server = NULL;
+    const char * stats = NULL;
+    gamma_t curve = GAMMA_NONE;
+    double  exponent = 0;
+    stats_t st;
+    char    forward[SERVER_LINE] = "";
     char    input[256] = {0}, output[256] = "output.bmp";
 
+    memset(&opt, 0, sizeof(opt));
+    opt.serpentine = true;
+    opt.kernel = DIFFUSE_FLOYD;
+    opt.palette = PALETTE_UNIFORM;
+    opt.colors = 256;
+    opt.kmeans.tolerance = KMEANS_TOLERANCE;
+    opt.drift = -1;
+    opt.tune = -1;
+    opt.verbose = true;
+
     if (argc < 2) {
-        printf("Usage: unipal image.bmp [output.bmp] [-d[ither]]\n");
+        usage();
         return -1;
     }
 
-    if (argc >= 2) {
-        strncpy(input, argv[1], 255);
-        if (argc == 3) {
-            dither = !strcmp(argv[2], "-dither") || !strcmp(argv[2], "-d") ;
-            if (!dither)
-                strncpy(output, argv[2], 255);
+    /* option values and positional arguments point into argv */
+    if (!(opt.unions = (const char **) malloc(argc * sizeof(char *))) ||
+        !(names = (const char **) malloc(argc * sizeof(char *)))) {
+        printf("ERROR: not enough memory.\n");
+        return leave(&opt, names, -1);
+    }
+
+    for (int i = 1; i < argc; i++) {
+        int next = parse_option(&opt, argc, argv, i);
+        if (next < 0) {
+            usage();
+            return leave(&opt, names, -1);
+        }
+        if (next) {
+            /* a client forwards the quantization options to the server */
+            for (int j = i; j < next; j++)
+                if (strlen(forward) + strlen(argv[j]) + 2 < sizeof(forward)) {
+                    strcat(forward, " ");
+                    strcat(forward, argv[j]);
+                }
+            i = next - 1;
+            continue;
+        }
+        if (!strcmp(argv[i], "-stream") || !strcmp(argv[i], "-s"))
+            stream = true;
+        else
+        if (!strcmp(argv[i], "-threads") || !strcmp(argv[i], "-t")) {
+            if (++i >= argc) {
+                usage();
+                return leave(&opt, names, -1);
+            }
+            threads = atoi(argv[i]);
+        }
+        else
+        if (!strcmp(argv[i], "-outdir") || !strcmp(argv[i], "-o")) {
+            if (++i >= argc) {
+                usage();
+                return leave(&opt, names, -1);
+            }
+            outdir = argv[i];
+        }
+        else
+        if (!strcmp(argv[i], "-serve") || !strcmp(argv[i], "-S")) {
+            if (++i >= argc) {
+                usage();
+                return leave(&opt, names, -1);
+            }
+            serving = argv[i];
+        }
+        else
+        if (!strcmp(argv[i], "-connect") || !strcmp(argv[i], "-C")) {
+            if (++i >= argc) {
+                usage();
+                return leave(&opt, names, -1);
+            }
+            server = argv[i];
         }
-        else 
-        if (argc > 3) {
-            strncpy(output, argv[2], 255);
-            dither = !strcmp(argv[3], "-dither") || !strcmp(argv[3], "-d") ;
+        else
+        if (!strcmp(argv[i], "-quality") || !strcmp(argv[i], "-q"))
+            opt.quality = true;
+        else
+        if (!strcmp(argv[i], "-gamma") || !strcmp(argv[i], "-G")) {
+            if (++i >= argc || !gamma_parse(argv[i], &curve, &exponent)) {
+                usage();
+                return leave(&opt, names, -1);
+            }
+        }
+        else
+        if (!strcmp(argv[i], "-auto") || !strcmp(argv[i], "-A")) {
+            if (++i >= argc || (opt.tune = atof(argv[i])) < 0) {
+                usage();
+                return leave(&opt, names, -1);
+            }
+        }
+        else
+        if (!strcmp(argv[i], "-stats") || !strcmp(argv[i], "-g")) {
+            if (++i >= argc) {
+                usage();
+                return leave(&opt, names, -1);
+            }
+            stats = argv[i];
+        }
+        else
+        if (!strcmp(argv[i], "-jobs") || !strcmp(argv[i], "-j")) {
+            if (++i >= argc) {
+                usage();
+                return leave(&opt, names, -1);
+            }
+            jobs = atoi(argv[i]);
+        }
+        else
+        if (argv[i][0] == '-') {
+            printf("ERROR: unknown option [%s]\n", argv[i]);
+            return leave(&opt, names, -1);
+        }
+        else
+            names[files++] = argv[i];
+    }
+
+    /* only the uniform palette is an average of the pixels it stands for */
+    if (curve != GAMMA_NONE &&
+        (opt.palette != PALETTE_UNIFORM || opt.diffuse || opt.load ||
+         opt.tune >= 0 || server)) {
+        printf("ERROR: linear light averaging needs the uniform palette, without -e, -l, -A or a server to connect to.\n");
+        return leave(&opt, names, -1);
+    }
+    /* the tables are built before any worker starts */
+    gamma_set(curve, exponent);
+
+    if (serving) {
+        if (files || stream || outdir || server || opt.pooled || opt.save ||
+            opt.drift >= 0 || stats || opt.quality || opt.tune >= 0) {
+            printf("ERROR: the server takes no inputs, batch, stream, union, palette writing, tuning, quality or statistics options.\n");
+            return leave(&opt, names, -1);
         }
+        /* processors are split among the requests unless told otherwise */
+        opt.threads = threads > 0 ? threads :
+                      thread_count(threads) / thread_count(jobs) > 1 ?
+                      thread_count(threads) / thread_count(jobs) : 1;
+        opt.verbose = false;
+        return leave(&opt, names, serve(&opt, serving, jobs));
+    }
+
+    if (!files) {
+        usage();
+        return leave(&opt, names, -1);
+    }
+
+    /* positional arguments: input first, then output, all inputs in a
+       batch */
+    if (!outdir) {
+        strncpy(input, names[0], 255);
+        if (files > 1)
+            strncpy(output, names[1], 255);
+        printf(". Input  = [%s]\n", input);
+        printf(". Output = [%s]\n", output);
+    }
+
+    if (stream && (opt.diffuse || outdir || opt.quality || opt.tune >= 0)) {
+        printf("ERROR: error diffusion, batches, tuning and quality measures are not available in streaming mode.\n");
+        return leave(&opt, names, -1);
+    }
+
+    if (opt.tune >= 0 && (opt.palette != PALETTE_UNIFORM || opt.dither ||
+                          opt.diffuse || opt.pooled || opt.load ||
+                          opt.save)) {
+        printf("ERROR: tuning picks the palette and dithering itself, it does not combine with -p, -d, -e or shared palettes.\n");
+        return leave(&opt, names, -1);
     }
 
-    printf(". Input  = [%s]\n", input);
-    printf(". Output = [%s]\n", output);
+    if (opt.palette != PALETTE_UNIFORM && stream) {
+        printf("ERROR: the %s palette is not available in streaming mode.\n",
+               palette_name(opt.palette));
+        return leave(&opt, names, -1);
+    }
+
+    if ((opt.kmeans.iterations || opt.samples) && stream) {
+        printf("ERROR: palette refinement and sampling are not available in streaming mode.\n");
+        return leave(&opt, names, -1);
+    }
+
+    if ((opt.pooled || opt.load || opt.save) && stream) {
+        printf("ERROR: shared palettes are not available in streaming mode.\n");
+        return leave(&opt, names, -1);
+    }
+
+    if (opt.drift >= 0 && (!opt.load || outdir)) {
+        printf("ERROR: the drift threshold needs a palette file to load, outside batches.\n");
+        return leave(&opt, names, -1);
+    }
+
+    if (server) {
+        if (stream || outdir || stats || opt.quality || opt.tune >= 0) {
+            printf("ERROR: a client cannot stream, run batches, tune, measure quality or record statistics.\n");
+            return leave(&opt, names, -1);
+        }
+        return leave(&opt, names,
+                     connect_server(server, input, output, forward));
+    }
+
+    /* statistics are appended, so runs can share one log */
+    if (stats) {
+        opt.stats = strcmp(stats, "-") ? fopen(stats, "a") : stdout;
+        if (!opt.stats) {
+            printf("ERROR: cannot write statistics to [%s]\n", stats);
+            return leave(&opt, names, -1);
+        }
+        stats_enable(true);
+        stats_reset(&st);
+    }
+
+    if (outdir) {
+        batch_list_t    list = { NULL, 0, 0 };
+        int             failed, clash, first, second;
+
+        for (int i = 0; i < files; i++)
+            if (!batch_add(&list, names[i])) {
+                printf("ERROR: cannot list [%s]\n", names[i]);
+                batch_free(&list);
+                return leave(&opt, names, -1);
+            }
+        /* two workers must never write the same file */
+        if ((clash = batch_clash(&list, outdir, &first, &second))) {
+            if (clash > 0 &&
+                batch_output(output, sizeof(output), outdir, list.name[first]))
+                printf("ERROR: [%s] and [%s] would both be written to [%s]\n",
+                       list.name[first], list.name[second], output);
+            else
+                printf("ERROR: not enough memory.\n");
+            batch_free(&list);
+            return leave(&opt, names, -1);
+        }
+        failed = list.count ? batch(&opt, &list, outdir, jobs, threads) : 0;
+        batch_free(&list);
+        return leave(&opt, names, failed ? -1 : 0);
+    }
+
+    if (opt.stats)
+        stats_attach(&st);
+
+    if (stream) {
+        bitmap_info_t   info;
+
+        printf(". Streaming [%s] (dithering: %s, simd: %s)...\n", input,
+               opt.dither ? "yes" : "no", simd_name(simd_level()));
+        /* the single pass is counted as quantization */
+        double start = stats_start();
+        image_result_t r = stream_uniform(input, output, opt.dither);
+        if (r == IMR_FILE_CREATE_ERROR) {
+            printf("ERROR: cannot write [%s]\n", output);
+            return leave(&opt, names, -1);
+        }
+        if (r != IMR_OK) {
+            printf("ERROR: cannot quantize [%s], %s.\n", input,
+                   r == IMR_FILE_NOT_FOUND ? "cannot open it" :
+                   r == IMR_NOT_ENOUGH_MEMORY ? "not enough memory" :
+                   r == IMR_FILE_CORRUPTED ? "the file is truncated" :
+                   r == IMR_FORMAT_INVALID ? "its bitmap header is invalid" :
+                   image_detect(input) != BFM_BMP ?
+                   "streaming reads Windows bitmaps only, drop -s" :
+                   "input must be an uncompressed 16 or 24-bit bitmap");
+            return leave(&opt, names, -1);
+        }
+        stats_stop(STATS_QUANTIZE, start);
+        if (opt.stats) {
+            stats_attach(NULL);
+            if (image_info(input, &info))
+                stats_print(opt.stats, &st, input, info.width, info.height);
+        }
+        return leave(&opt, names, 0);
+    }
 
     printf(". Loading bitmap [%s]...\n", input);
-    if (!(bmp = bmp_load(input))) {
+    double start = stats_start();
+    if (!(bmp = image_load(input))) {
         printf("ERROR: cannot load [%s]\n", input);
-        return -1;
+        return leave(&opt, names, -1);
     }
+    stats_stop(STATS_LOAD, start);
     printf("  - Image dimensions = %d x %d\n", bmp->width, bmp->height);
 
-    printf(". Quantizing colors (dithering: %s)...\n", dither ? "yes" : "no");
-    bitmap res = quantize_uniform(bmp, dither);
+    opt.threads = threads;
+    options_t tuned;
+    if (opt.tune >= 0) {
+        if (!tune_image(&opt, bmp, &tuned)) {
+            printf("ERROR: cannot tune [%s], %s.\n", input, tune_error(bmp));
+            bitmap_destroy(&bmp);
+            return leave(&opt, names, -1);
+        }
+        opt = tuned;
+    }
+    start = stats_start();
+    bitmap res = quantize_image(&opt, bmp);
+    stats_stop(STATS_QUANTIZE, start);
+    bool ok = res != NULL;
+    if (res && opt.quality) {
+        metric_t    m;
 
+        printf(". Measuring quality (simd: %s, threads: %d)...\n",
+               simd_name(simd_level()), thread_count(threads));
+        if (measure_image(&opt, bmp, res, &m)) {
+            printf("  - MSE  = %.2f (R %.2f, G %.2f, B %.2f)\n", m.mseAll,
+                   m.mse[0], m.mse[1], m.mse[2]);
+            printf("  - PSNR = %.2f dB (R %.2f, G %.2f, B %.2f)\n",
+                   m.psnrAll, m.psnr[0], m.psnr[1], m.psnr[2]);
+            printf("  - SSIM = %.4f\n", m.ssim);
+        }
+        else
+            printf("ERROR: cannot measure the output, not enough memory.\n");
+    }
     if (res) {
         printf(". Saving output to [%s]...\n", output);
-        if (!bmp_save(output, &res))
-            printf("ERROR: cannot write output bitmap.\n");
+        start = stats_start();
+        if (!(ok = save_image(&opt, output, &res)))
+            printf("ERROR: cannot write output bitmap%s.\n",
+                   save_error(output));
+        stats_stop(STATS_SAVE, start);
         bitmap_destroy(&res);
     }
-    else
-        printf("ERROR: input bitmap must be 24-bit.\n");
 
+    if (opt.stats) {
+        stats_attach(NULL);
+        if (ok)
+            stats_print(opt.stats, &st, input, bmp->width, bmp->height);
+    }
     bitmap_destroy(&bmp);
-    return 0;
+    return leave(&opt, names, ok ? 0 : -1);
 }
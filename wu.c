@@ -0,0 +1,475 @@
+/* WU.C: Xiaolin Wu's variance-minimizing color quantizer */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wu.h"
+#include "thread.h"
+#include "stats.h"
+
+/* fewest rows handed to a histogram or mapping thread */
+#define WU_BAND_MIN     (16)
+/* histogram copies are large, do not make too many of them */
+#define WU_HIST_BANDS   (8)
+
+#define WU_SHIFT        (8 - WU_BITS)
+#define WU_AT(r, g, b)  (((r) * WU_SIDE + (g)) * WU_SIDE + (b))
+
+typedef enum { WU_RED, WU_GREEN, WU_BLUE } wu_axis_t;
+
+/* a box of histogram cells, lower bounds exclusive and upper inclusive */
+typedef struct {
+    int     r0, r1;
+    int     g0, g1;
+    int     b0, b1;
+    int     vol;
+} wu_box_t;
+
+/* histogram cell of a color, cells with a zero index are the borders
+   needed by the cumulative sums */
+static inline int wu_cell(uint8 r, uint8 g, uint8 b) {
+    return WU_AT((r >> WU_SHIFT) + 1, (g >> WU_SHIFT) + 1, (b >> WU_SHIFT) + 1);
+}
+
+/*  wu_create()
+*   allocates an empty histogram
+*/
+wu_t * wu_create(void) {
+    wu_t * wu = (wu_t *) calloc(1, sizeof(wu_t));
+
+    if (!wu) return NULL;
+
+    wu->wt  = (long long *) calloc(WU_CELLS, sizeof(long long));
+    wu->mr  = (long long *) calloc(WU_CELLS, sizeof(long long));
+    wu->mg  = (long long *) calloc(WU_CELLS, sizeof(long long));
+    wu->mb  = (long long *) calloc(WU_CELLS, sizeof(long long));
+    wu->m2  = (double *) calloc(WU_CELLS, sizeof(double));
+    wu->tag = (uint8 *) calloc(WU_CELLS, 1);
+    if (!wu->wt || !wu->mr || !wu->mg || !wu->mb || !wu->m2 || !wu->tag)
+        wu_destroy(&wu);
+    return wu;
+}
+
+void wu_destroy(wu_t ** wu) {
+    if (*wu) {
+        free((*wu)->wt);
+        free((*wu)->mr);
+        free((*wu)->mg);
+        free((*wu)->mb);
+        free((*wu)->m2);
+        free((*wu)->tag);
+        free(*wu);
+        *wu = NULL;
+    }
+}
+
+/*  wu_add_row()
+*   feeds an RGB24 scanline into the histogram
+*/
+void wu_add_row(wu_t * wu, const uint8 * src, uint32 width) {
+    for (uint32 x = 0; x < width; x++, src += 3) {
+        int r = src[0], g = src[1], b = src[2];
+        int i = wu_cell(r, g, b);
+
+        wu->wt[i]++;
+        wu->mr[i] += r;
+        wu->mg[i] += g;
+        wu->mb[i] += b;
+        wu->m2[i] += r * r + g * g + b * b;
+    }
+}
+
+/*  wu_merge()
+*   adds the histogram of [other] into [wu]
+*/
+void wu_merge(wu_t * wu, const wu_t * other) {
+    for (int i = 0; i < WU_CELLS; i++) {
+        wu->wt[i] += other->wt[i];
+        wu->mr[i] += other->mr[i];
+        wu->mg[i] += other->mg[i];
+        wu->mb[i] += other->mb[i];
+        wu->m2[i] += other->m2[i];
+    }
+}
+
+/* turns the histogram into moments cumulated from the origin */
+static void wu_moments(wu_t * wu) {
+    long long   line, liner, lineg, lineb;
+    long long   area[WU_SIDE], arear[WU_SIDE], areag[WU_SIDE], areab[WU_SIDE];
+    double      line2, area2[WU_SIDE];
+
+    for (int r = 1; r < WU_SIDE; r++) {
+        for (int i = 0; i < WU_SIDE; i++) {
+            area[i] = arear[i] = areag[i] = areab[i] = 0;
+            area2[i] = 0;
+        }
+        for (int g = 1; g < WU_SIDE; g++) {
+            line = liner = lineg = lineb = 0;
+            line2 = 0;
+            for (int b = 1; b < WU_SIDE; b++) {
+                int i = WU_AT(r, g, b);
+                int p = WU_AT(r - 1, g, b);
+
+                line  += wu->wt[i];
+                liner += wu->mr[i];
+                lineg += wu->mg[i];
+                lineb += wu->mb[i];
+                line2 += wu->m2[i];
+
+                area[b]  += line;
+                arear[b] += liner;
+                areag[b] += lineg;
+                areab[b] += lineb;
+                area2[b] += line2;
+
+                wu->wt[i] = wu->wt[p] + area[b];
+                wu->mr[i] = wu->mr[p] + arear[b];
+                wu->mg[i] = wu->mg[p] + areag[b];
+                wu->mb[i] = wu->mb[p] + areab[b];
+                wu->m2[i] = wu->m2[p] + area2[b];
+            }
+        }
+    }
+}
+
+/* sum of a moment over a box, from its eight corners */
+static long long wu_volume(const wu_box_t * c, const long long * m) {
+    return  m[WU_AT(c->r1, c->g1, c->b1)] - m[WU_AT(c->r1, c->g1, c->b0)]
+          - m[WU_AT(c->r1, c->g0, c->b1)] + m[WU_AT(c->r1, c->g0, c->b0)]
+          - m[WU_AT(c->r0, c->g1, c->b1)] + m[WU_AT(c->r0, c->g1, c->b0)]
+          + m[WU_AT(c->r0, c->g0, c->b1)] - m[WU_AT(c->r0, c->g0, c->b0)];
+}
+
+static double wu_volume2(const wu_box_t * c, const double * m) {
+    return  m[WU_AT(c->r1, c->g1, c->b1)] - m[WU_AT(c->r1, c->g1, c->b0)]
+          - m[WU_AT(c->r1, c->g0, c->b1)] + m[WU_AT(c->r1, c->g0, c->b0)]
+          - m[WU_AT(c->r0, c->g1, c->b1)] + m[WU_AT(c->r0, c->g1, c->b0)]
+          + m[WU_AT(c->r0, c->g0, c->b1)] - m[WU_AT(c->r0, c->g0, c->b0)];
+}
+
+/* part of the volume that does not depend on the cut position */
+static long long wu_bottom(const wu_box_t * c, wu_axis_t axis,
+                           const long long * m) {
+    switch (axis) {
+    case WU_RED:
+        return - m[WU_AT(c->r0, c->g1, c->b1)] + m[WU_AT(c->r0, c->g1, c->b0)]
+               + m[WU_AT(c->r0, c->g0, c->b1)] - m[WU_AT(c->r0, c->g0, c->b0)];
+    case WU_GREEN:
+        return - m[WU_AT(c->r1, c->g0, c->b1)] + m[WU_AT(c->r1, c->g0, c->b0)]
+               + m[WU_AT(c->r0, c->g0, c->b1)] - m[WU_AT(c->r0, c->g0, c->b0)];
+    default:
+        return - m[WU_AT(c->r1, c->g1, c->b0)] + m[WU_AT(c->r1, c->g0, c->b0)]
+               + m[WU_AT(c->r0, c->g1, c->b0)] - m[WU_AT(c->r0, c->g0, c->b0)];
+    }
+}
+
+/* remainder of the volume when cutting the box at [pos] along [axis] */
+static long long wu_top(const wu_box_t * c, wu_axis_t axis, int pos,
+                        const long long * m) {
+    switch (axis) {
+    case WU_RED:
+        return   m[WU_AT(pos, c->g1, c->b1)] - m[WU_AT(pos, c->g1, c->b0)]
+               - m[WU_AT(pos, c->g0, c->b1)] + m[WU_AT(pos, c->g0, c->b0)];
+    case WU_GREEN:
+        return   m[WU_AT(c->r1, pos, c->b1)] - m[WU_AT(c->r1, pos, c->b0)]
+               - m[WU_AT(c->r0, pos, c->b1)] + m[WU_AT(c->r0, pos, c->b0)];
+    default:
+        return   m[WU_AT(c->r1, c->g1, pos)] - m[WU_AT(c->r1, c->g0, pos)]
+               - m[WU_AT(c->r0, c->g1, pos)] + m[WU_AT(c->r0, c->g0, pos)];
+    }
+}
+
+/* weighted variance of the colors in a box */
+static double wu_variance(const wu_t * wu, const wu_box_t * c) {
+    double dr = (double) wu_volume(c, wu->mr);
+    double dg = (double) wu_volume(c, wu->mg);
+    double db = (double) wu_volume(c, wu->mb);
+    double xx = wu_volume2(c, wu->m2);
+
+    return xx - (dr * dr + dg * dg + db * db) / (double) wu_volume(c, wu->wt);
+}
+
+/* finds the cut along [axis] maximizing the between-part variance, the
+   cut position goes to [cut], -1 if the box cannot be split there */
+static double wu_maximize(const wu_t * wu, const wu_box_t * c, wu_axis_t axis,
+                          int first, int last, int * cut,
+                          long long wr, long long wg, long long wb,
+                          long long ww) {
+    long long   br = wu_bottom(c, axis, wu->mr);
+    long long   bg = wu_bottom(c, axis, wu->mg);
+    long long   bb = wu_bottom(c, axis, wu->mb);
+    long long   bw = wu_bottom(c, axis, wu->wt);
+    double      best = 0.0;
+
+    *cut = -1;
+    for (int i = first; i < last; i++) {
+        long long hr = br + wu_top(c, axis, i, wu->mr);
+        long long hg = bg + wu_top(c, axis, i, wu->mg);
+        long long hb = bb + wu_top(c, axis, i, wu->mb);
+        long long hw = bw + wu_top(c, axis, i, wu->wt);
+
+        /* both halves must hold pixels */
+        if (!hw || hw == ww)
+            continue;
+
+        double t = ((double) hr * hr + (double) hg * hg + (double) hb * hb) / hw;
+        hr = wr - hr;
+        hg = wg - hg;
+        hb = wb - hb;
+        t += ((double) hr * hr + (double) hg * hg + (double) hb * hb) /
+             (ww - hw);
+
+        if (t > best) {
+            best = t;
+            *cut = i;
+        }
+    }
+    return best;
+}
+
+/* splits [a] into [a] and [b] along its best axis, false if impossible */
+static bool wu_cut(const wu_t * wu, wu_box_t * a, wu_box_t * b) {
+    long long   wr = wu_volume(a, wu->mr);
+    long long   wg = wu_volume(a, wu->mg);
+    long long   wb = wu_volume(a, wu->mb);
+    long long   ww = wu_volume(a, wu->wt);
+    int         cutr, cutg, cutb;
+    wu_axis_t   axis;
+
+    double maxr = wu_maximize(wu, a, WU_RED,   a->r0 + 1, a->r1, &cutr,
+                              wr, wg, wb, ww);
+    double maxg = wu_maximize(wu, a, WU_GREEN, a->g0 + 1, a->g1, &cutg,
+                              wr, wg, wb, ww);
+    double maxb = wu_maximize(wu, a, WU_BLUE,  a->b0 + 1, a->b1, &cutb,
+                              wr, wg, wb, ww);
+
+    if (maxr >= maxg && maxr >= maxb) {
+        axis = WU_RED;
+        if (cutr < 0)
+            return false;       /* the box holds a single color */
+    }
+    else
+    if (maxg >= maxr && maxg >= maxb)
+        axis = WU_GREEN;
+    else
+        axis = WU_BLUE;
+
+    b->r1 = a->r1;
+    b->g1 = a->g1;
+    b->b1 = a->b1;
+
+    switch (axis) {
+    case WU_RED:
+        b->r0 = a->r1 = cutr;
+        b->g0 = a->g0;
+        b->b0 = a->b0;
+        break;
+    case WU_GREEN:
+        b->g0 = a->g1 = cutg;
+        b->r0 = a->r0;
+        b->b0 = a->b0;
+        break;
+    case WU_BLUE:
+        b->b0 = a->b1 = cutb;
+        b->r0 = a->r0;
+        b->g0 = a->g0;
+        break;
+    }
+
+    a->vol = (a->r1 - a->r0) * (a->g1 - a->g0) * (a->b1 - a->b0);
+    b->vol = (b->r1 - b->r0) * (b->g1 - b->g0) * (b->b1 - b->b0);
+    return true;
+}
+
+/* labels every histogram cell of a box with its palette entry */
+static void wu_mark(wu_t * wu, const wu_box_t * c, uint8 label) {
+    for (int r = c->r0 + 1; r <= c->r1; r++)
+        for (int g = c->g0 + 1; g <= c->g1; g++)
+            memset(wu->tag + WU_AT(r, g, c->b0 + 1), label, c->b1 - c->b0);
+}
+
+/*  wu_palette()
+*   splits the color space into at most [colors] boxes (2..256), always
+*   cutting the box of largest variance, and averages each box into [pal].
+*   Unused entries are black. The histogram is turned into moments, so no
+*   pixels can be added afterwards. Returns the number of colors.
+*/
+uint32 wu_palette(wu_t * wu, uint32 colors, rgb_t * pal) {
+    wu_box_t    box[256];
+    double      vv[256];
+    uint32      count, next = 0;
+
+    if (colors < 2)   colors = 2;
+    if (colors > 256) colors = 256;
+
+    wu_moments(wu);
+
+    box[0].r0 = box[0].g0 = box[0].b0 = 0;
+    box[0].r1 = box[0].g1 = box[0].b1 = WU_SIDE - 1;
+    box[0].vol = (WU_SIDE - 1) * (WU_SIDE - 1) * (WU_SIDE - 1);
+    vv[0] = 0.0;
+
+    for (count = 1; count < colors; count++) {
+        if (wu_cut(wu, &box[next], &box[count])) {
+            /* boxes of a single cell cannot be split any further */
+            vv[next]  = box[next].vol > 1 ? wu_variance(wu, &box[next]) : 0.0;
+            vv[count] = box[count].vol > 1 ? wu_variance(wu, &box[count]) : 0.0;
+        }
+        else {
+            vv[next] = 0.0;     /* do not try to split this one again */
+            count--;
+        }
+
+        /* carry on with the box of largest variance */
+        double best = vv[next = 0];
+        for (uint32 k = 1; k <= count; k++)
+            if (vv[k] > best) {
+                best = vv[k];
+                next = k;
+            }
+        if (best <= 0.0) {
+            count++;
+            break;
+        }
+    }
+
+    memset(pal, 0, 256 * sizeof(rgb_t));
+    for (uint32 k = 0; k < count; k++) {
+        long long w = wu_volume(&box[k], wu->wt);
+
+        wu_mark(wu, &box[k], k);
+        if (w) {
+            pal[k].r = wu_volume(&box[k], wu->mr) / w;
+            pal[k].g = wu_volume(&box[k], wu->mg) / w;
+            pal[k].b = wu_volume(&box[k], wu->mb) / w;
+        }
+    }
+    return count;
+}
+
+/*  wu_index()
+*   palette index of a color, valid after wu_palette()
+*/
+uint8 wu_index(const wu_t * wu, uint8 r, uint8 g, uint8 b) {
+    return wu->tag[wu_cell(r, g, b)];
+}
+
+/* shared state of a banded histogram or mapping run */
+typedef struct {
+    wu_t            ** hist;    /* one histogram per band */
+    const bitmap    src;
+    bitmap          dst;
+    int             bands;
+} wu_job_t;
+
+static void wu_rows(const wu_job_t * job, int band, uint32 * y0, uint32 * y1) {
+    uint32  rows = job->src->height / job->bands;
+    uint32  rest = job->src->height % job->bands;
+
+    *y0 = band * rows + (band < rest ? band : rest);
+    *y1 = *y0 + rows + (band < rest ? 1 : 0);
+}
+
+static void wu_histogram_band(void * arg, int band) {
+    wu_job_t    * job = (wu_job_t *) arg;
+    uint32      y0, y1;
+
+    wu_rows(job, band, &y0, &y1);
+    for (uint32 y = y0; y < y1; y++)
+        wu_add_row(job->hist[band], job->src->data + y * job->src->rowsize,
+                   job->src->width);
+}
+
+static void wu_map_band(void * arg, int band) {
+    wu_job_t    * job = (wu_job_t *) arg;
+    uint32      y0, y1;
+
+    wu_rows(job, band, &y0, &y1);
+    for (uint32 y = y0; y < y1; y++) {
+        const uint8 * src = job->src->data + y * job->src->rowsize;
+        uint8       * dst = job->dst->data + y * job->dst->rowsize;
+
+        for (uint32 x = 0; x < job->src->width; x++, src += 3)
+            dst[x] = job->hist[0]->tag[wu_cell(src[0], src[1], src[2])];
+    }
+}
+
+/* splits the image into at most [limit] bands of WU_BAND_MIN rows */
+static int wu_bands(const bitmap bmp, int threads, int limit) {
+    int bands = thread_count(threads);
+
+    if (bands > limit)
+        bands = limit;
+    if (bands > bmp->height / WU_BAND_MIN)
+        bands = bmp->height / WU_BAND_MIN;
+    return bands < 1 ? 1 : bands;
+}
+
+/* builds the histogram of an RGB24 bitmap in row bands, one histogram per
+   band merged into the first one */
+static wu_t * wu_histogram(const bitmap bmp, int threads) {
+    wu_t        * hist[WU_HIST_BANDS] = { NULL };
+    wu_job_t    job = { hist, bmp, NULL, 1 };
+
+    job.bands = wu_bands(bmp, threads, WU_HIST_BANDS);
+    for (int i = 0; i < job.bands; i++)
+        if (!(hist[i] = wu_create())) {
+            job.bands = i;
+            break;
+        }
+
+    if (job.bands) {
+        thread_parallel(job.bands, wu_histogram_band, &job);
+        for (int i = 1; i < job.bands; i++) {
+            wu_merge(hist[0], hist[i]);
+            wu_destroy(&hist[i]);
+        }
+    }
+    return hist[0];
+}
+
+/*  palette_wu()
+*   computes the Wu palette of an RGB24 bitmap without mapping it, returns
+*   the number of colors or 0 on failure
+*/
+uint32 palette_wu(const bitmap bmp, uint32 colors, rgb_t * pal, int threads) {
+    if (!bmp) return 0;
+    if (bmp->format != BMF_RGB24) return 0;
+
+    wu_t * hist = wu_histogram(bmp, threads);
+    if (!hist) return 0;
+
+    double start = stats_start();
+    colors = wu_palette(hist, colors, pal);
+    stats_stop(STATS_CLUT, start);
+    wu_destroy(&hist);
+    return colors;
+}
+
+/* RGB quantization using Wu's algorithm with a palette of [colors]
+   entries, histogram and mapping run on [threads] threads (0 = every
+   processor) */
+bitmap quantize_wu(const bitmap bmp, uint32 colors, int threads) {
+    if (!bmp) return NULL;
+    if (bmp->format != BMF_RGB24) return NULL;
+
+    /* create output indexed bitmap */
+    bitmap res = bitmap_create(bmp->width, bmp->height, BMF_INDEXED8, true);
+    if (!res) return NULL;
+
+    wu_t * hist = wu_histogram(bmp, threads);
+    if (!hist) {
+        bitmap_destroy(&res);
+        return NULL;
+    }
+    double start = stats_start();
+    wu_palette(hist, colors, res->pal);
+    stats_stop(STATS_CLUT, start);
+
+    /* mapping phase, one table lookup per pixel */
+    wu_job_t job = { &hist, bmp, res, wu_bands(bmp, threads, bmp->height) };
+    thread_parallel(job.bands, wu_map_band, &job);
+
+    wu_destroy(&hist);
+    return res;
+}
@@ -0,0 +1,42 @@
+#ifndef __WU_H__
+#define __WU_H__ (1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "image.h"
+
+/*------------------------ WU VARIANCE-MINIMIZING QUANTIZER ------------------*/
+
+/* histogram resolution in bits per channel, 5 gives the classic 33^3 table */
+#ifndef WU_BITS
+    #define WU_BITS     (5)
+#endif
+#define WU_SIDE         ((1 << WU_BITS) + 1)
+#define WU_CELLS        (WU_SIDE * WU_SIDE * WU_SIDE)
+
+/* 3D color histogram, turned in place into cumulative moment tables */
+typedef struct wu_context {
+    long long   * wt;           /* pixel counts */
+    long long   * mr, * mg, * mb;   /* first moments */
+    double      * m2;           /* second moment, r^2 + g^2 + b^2 */
+    uint8       * tag;          /* palette entry of every histogram cell */
+} wu_t;
+
+wu_t *      wu_create(void);
+void        wu_destroy(wu_t ** wu);
+void        wu_add_row(wu_t * wu, const uint8 * src, uint32 width);
+void        wu_merge(wu_t * wu, const wu_t * other);
+uint32      wu_palette(wu_t * wu, uint32 colors, rgb_t * pal);
+uint8       wu_index(const wu_t * wu, uint8 r, uint8 g, uint8 b);
+
+uint32      palette_wu(const bitmap bmp, uint32 colors, rgb_t * pal,
+                       int threads);
+bitmap      quantize_wu(const bitmap bmp, uint32 colors, int threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif